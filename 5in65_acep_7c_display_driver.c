@@ -41,10 +41,11 @@
 #define DISPLAY_HEIGHT 448
 
 #include "display_items.h"
+#include "display_messages.h"
 #include "display_common.h"
-#include "draw_common.h"
 #include "font.c"
 #include "spi_display.h"
+#include "dither.h"
 
 #define CHAR_WIDTH 8
 
@@ -52,6 +53,11 @@
 #define CHECK_OVERFLOW 1
 #define SELF_TEST 0
 
+// Wait 2 seconds before allowing a new refresh
+// this is not on datasheets, but without this the screen will not update.
+#define REFRESH_COOLDOWN_MS 2000
+#define DEFAULT_CLEAN_REFRESH_INTERVAL 5
+
 static const char *TAG = "5in65_acep_7c_display_driver";
 
 static void send_message(term pid, term message, GlobalContext *global);
@@ -69,6 +75,19 @@ struct SPI
 
     int count_to_refresh;
     uint64_t last_refresh;
+    // refreshes between clean refreshes, 0 when they are disabled
+    int clean_refresh_interval;
+
+    // latest update, that is drawn once the panel is ready, older ones are replaced
+    Message *pending_update;
+
+    // hash of the last frame that has been refreshed, identical frames are not refreshed again
+    uint32_t last_frame_hash;
+    bool last_frame_hash_valid;
+
+    // display list items are released all at once after each update
+    struct FrameArena arena;
+    uint8_t *line_buf;
 };
 
 struct PendingReply
@@ -77,15 +96,87 @@ struct PendingReply
     term pending_call_pid;
 };
 
-static QueueHandle_t display_messages_queue;
+// values found by trial and error
+// they try to get closer to real colors than pure saturated RGB colors
+static const uint8_t acep7_colors[7][3] = {
+    { 0x00, 0x00, 0x00 },
+    { 0xFF, 0xFF, 0xFF },
+    { 0x00, 0xFF, 0x00 },
+    { 0x00, 0x00, 0xFF },
+    { 0xFF, 0x00, 0x00 },
+    { 0xFF, 0xFF, 0x00 },
+    { 0xFF, 0x80, 0x00 }
+};
+
+// Nearest palette color of each RGB444 cube cell, so no distance is computed while drawing.
+#define ACEP7_LUT_BITS 4
+static uint8_t acep7_lut[1 << (ACEP7_LUT_BITS * 3)];
+
+static struct ErrorDiffusion acep7_diffusion;
+
+static void acep7_lut_init(void)
+{
+    const int levels = 1 << ACEP7_LUT_BITS;
+    const int cell = 256 / levels;
+
+    for (int i = 0; i < levels * levels * levels; i++) {
+        // cell center
+        int r1 = (i / (levels * levels)) * cell + cell / 2;
+        int g1 = ((i / levels) % levels) * cell + cell / 2;
+        int b1 = (i % levels) * cell + cell / 2;
+
+        int min = INT_MAX;
+        int min_index = 0;
+
+        for (int j = 0; j < 7; j++) {
+            int dr = acep7_colors[j][0] - r1;
+            int dg = acep7_colors[j][1] - g1;
+            int db = acep7_colors[j][2] - b1;
+
+#ifdef NO_WEIGHTS
+            int d = dr * dr + dg * dg + db * db;
+#else
+            // weights are 0.30, 0.59 and 0.11, squared and scaled by 10000
+            int d = dr * dr * 900 + dg * dg * 3481 + db * db * 121;
+#endif
+
+            if (d < min) {
+                min = d;
+                min_index = j;
+            }
+        }
+
+        acep7_lut[i] = min_index;
+    }
+}
+
+static inline uint8_t acep7_nearest(int r, int g, int b)
+{
+    const int shift = 8 - ACEP7_LUT_BITS;
+    return acep7_lut[((r >> shift) << (ACEP7_LUT_BITS * 2)) | ((g >> shift) << ACEP7_LUT_BITS) | (b >> shift)];
+}
 
-static inline float square(float p)
+static inline int clamp_channel(int value)
 {
-    return p * p;
+    return (value < 0) ? 0 : ((value > 255) ? 255 : value);
 }
 
 static uint8_t dither_acep7(int x, int y, uint8_t r, uint8_t g, uint8_t b)
 {
+    if (acep7_diffusion.mode != DitherOrdered) {
+        error_diffusion_seek(&acep7_diffusion, y);
+        int r1 = error_diffusion_apply(&acep7_diffusion, x, 0, r);
+        int g1 = error_diffusion_apply(&acep7_diffusion, x, 1, g);
+        int b1 = error_diffusion_apply(&acep7_diffusion, x, 2, b);
+
+        uint8_t c = acep7_nearest(r1, g1, b1);
+        error_diffusion_spread(&acep7_diffusion, x, 0, r1 - acep7_colors[c][0]);
+        error_diffusion_spread(&acep7_diffusion, x, 1, g1 - acep7_colors[c][1]);
+        error_diffusion_spread(&acep7_diffusion, x, 2, b1 - acep7_colors[c][2]);
+
+        return c;
+    }
+
     const uint8_t m[4][4] = {
         { 0, 8, 2, 10 },
         { 12, 4, 14, 6 },
@@ -95,43 +186,17 @@ static uint8_t dither_acep7(int x, int y, uint8_t r, uint8_t g, uint8_t b)
 
     // following r parameters have been found using standard deviation
     // that gives a decent result
-    int r1 = r + roundf(92.0 * ((float) m[x % 4][y % 4] * 0.0625 - 0.5));
-    int g1 = g + roundf(85.0 * ((float) m[x % 4][y % 4] * 0.0625 - 0.5));
-    int b1 = b + roundf(65.0 * ((float) m[x % 4][y % 4] * 0.0625 - 0.5));
-
-    // values found by trial and error
-    // they try to get closer to real colors than pure saturated RGB colors
-    uint8_t colors[7][3] = {
-        { 0x00, 0x00, 0x00 },
-        { 0xFF, 0xFF, 0xFF },
-        { 0x00, 0xFF, 0x00 },
-        { 0x00, 0x00, 0xFF },
-        { 0xFF, 0x00, 0x00 },
-        { 0xFF, 0xFF, 0x00 },
-        { 0xFF, 0x80, 0x00 }
-    };
-
-    float min = INT_MAX;
-    int min_index = 0;
-
-    for (int i = 0; i < 7; i++) {
-        int r2 = colors[i][0];
-        int g2 = colors[i][1];
-        int b2 = colors[i][2];
+    // each offset is roundf(K * ((float) m[x % 4][y % 4] * 0.0625 - 0.5)), with K 92, 85 and 65
+    static const int8_t r_offsets[16] = { -46, -40, -35, -29, -23, -17, -12, -6, 0, 6, 12, 17, 23, 29, 35, 40 };
+    static const int8_t g_offsets[16] = { -43, -37, -32, -27, -21, -16, -11, -5, 0, 5, 11, 16, 21, 27, 32, 37 };
+    static const int8_t b_offsets[16] = { -33, -28, -24, -20, -16, -12, -8, -4, 0, 4, 8, 12, 16, 20, 24, 28 };
 
-#ifdef NO_WEIGHTS
-        float d = square((r2 - r1)) + square((g2 - g1)) + square((b2 - b1));
-#else
-        float d = square((r2 - r1) * 0.30) + square((g2 - g1) * 0.59) + square((b2 - b1) * 0.11);
-#endif
-
-        if (d < min) {
-            min = d;
-            min_index = i;
-        }
-    }
+    int v = m[x & 3][y & 3];
+    int r1 = clamp_channel(r + r_offsets[v]);
+    int g1 = clamp_channel(g + g_offsets[v]);
+    int b1 = clamp_channel(b + b_offsets[v]);
 
-    return min_index;
+    return acep7_nearest(r1, g1, b1);
 }
 
 static void writecommand(struct SPI *spi, uint8_t cmd)
@@ -160,7 +225,15 @@ static void wait_busy_level(struct SPI *spi, int level)
     }
 }
 
-static inline void draw_pixel_x(uint8_t *line_buf, int xpos, uint8_t c)
+typedef uint32_t SurfaceColor;
+
+// colors are kept as RGBA8888, since they are dithered when they are written
+static inline SurfaceColor uint32_color_to_surface(uint32_t color)
+{
+    return color;
+}
+
+static inline void draw_pixel_x(uint8_t *line_buf, int xpos, int ypos, SurfaceColor color)
 {
 #if CHECK_OVERFLOW
     if (xpos > DISPLAY_WIDTH) {
@@ -169,6 +242,11 @@ static inline void draw_pixel_x(uint8_t *line_buf, int xpos, uint8_t c)
     }
 #endif
 
+    uint8_t r = color >> 24;
+    uint8_t g = (color >> 16) & 0xFF;
+    uint8_t b = (color >> 8) & 0xFF;
+    uint8_t c = dither_acep7(xpos, ypos, r, g, b);
+
     if ((xpos & 1) == 0) {
         line_buf[xpos / 2] = (line_buf[xpos / 2] & 0xF) | (c << 4);
     } else {
@@ -176,279 +254,58 @@ static inline void draw_pixel_x(uint8_t *line_buf, int xpos, uint8_t c)
     }
 }
 
-static int draw_image_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
-{
-    int x = item->x;
-    int y = item->y;
-
-    int bgcolor_r;
-    int bgcolor_g;
-    int bgcolor_b;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor_r = (item->brcolor >> 24) & 0xFF;
-        bgcolor_g = (item->brcolor >> 16) & 0xFF;
-        bgcolor_b = (item->brcolor >> 8) & 0xFF;
-        visible_bg = true;
-    } else {
-        bgcolor_r = 0;
-        bgcolor_g = 0;
-        bgcolor_b = 0;
-        visible_bg = false;
-    }
-
-    int width = item->width;
-    const char *data = item->data.image_data.pix;
-
-    int drawn_pixels = 0;
-
-    uint32_t *pixels = ((uint32_t *) data) + (ypos - y) * width + (xpos - x);
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        if ((*pixels >> 24) & 0xFF) {
-            uint8_t r = img_pixel >> 24;
-            uint8_t g = (img_pixel >> 16) & 0xFF;
-            uint8_t b = (img_pixel >> 8) & 0xFF;
-
-            uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, r, g, b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else if (visible_bg) {
-            uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, bgcolor_r, bgcolor_g, bgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        pixels++;
-    }
-
-    return drawn_pixels;
-}
-
-static int draw_scaled_cropped_img_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
-{
-    int x = item->x;
-    int y = item->y;
-
-    int bgcolor_r;
-    int bgcolor_g;
-    int bgcolor_b;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor_r = (item->brcolor >> 24) & 0xFF;
-        bgcolor_g = (item->brcolor >> 16) & 0xFF;
-        bgcolor_b = (item->brcolor >> 8) & 0xFF;
-        visible_bg = true;
-    } else {
-        bgcolor_r = 0;
-        bgcolor_g = 0;
-        bgcolor_b = 0;
-        visible_bg = false;
-    }
-
-    int width = item->width;
-    const char *data = item->data.image_data_with_size.pix;
-
-    int drawn_pixels = 0;
-
-    int y_scale = item->y_scale;
-    int x_scale = item->x_scale;
-    int img_width = item->data.image_data_with_size.width;
-
-    int source_x = item->source_x;
-    int source_y = item->source_y;
-
-    uint32_t *pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + ((xpos - x) / x_scale);
-
-    if (source_x + (width / x_scale) > img_width) {
-        width = (img_width - source_x) * x_scale;
-    }
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        if ((*pixels >> 24) & 0xFF) {
-            uint8_t r = img_pixel >> 24;
-            uint8_t g = (img_pixel >> 16) & 0xFF;
-            uint8_t b = (img_pixel >> 8) & 0xFF;
-
-            uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, r, g, b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else if (visible_bg) {
-            uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, bgcolor_r, bgcolor_g, bgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + (j / x_scale);
-    }
-
-    return drawn_pixels;
-}
+#include "draw_common.h"
 
-static int draw_rect_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static uint64_t now_ms(void)
 {
-    int x = item->x;
-    int width = item->width;
-
-    uint8_t r = (item->brcolor >> 24) & 0xFF;
-    uint8_t g = (item->brcolor >> 16) & 0xFF;
-    uint8_t b = (item->brcolor >> 8) & 0xFF;
-
-    int drawn_pixels = 0;
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, r, g, b);
-        draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-        drawn_pixels++;
-    }
-
-    return drawn_pixels;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000LL + (tv.tv_usec / 1000LL);
 }
 
-static int draw_text_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+// Returns how long the display task can wait for newer updates before the panel is ready.
+static TickType_t ticks_until_ready(struct SPI *spi)
 {
-    int x = item->x;
-    int y = item->y;
-    bool visible_bg;
-
-    int fgcolor_r = (item->data.text_data.fgcolor >> 24) & 0xFF;
-    int fgcolor_g = (item->data.text_data.fgcolor >> 16) & 0xFF;
-    int fgcolor_b = (item->data.text_data.fgcolor >> 8) & 0xFF;
-
-    int bgcolor_r;
-    int bgcolor_g;
-    int bgcolor_b;
-
-    if (item->brcolor != 0) {
-        bgcolor_r = (item->brcolor >> 24) & 0xFF;
-        bgcolor_g = (item->brcolor >> 16) & 0xFF;
-        bgcolor_b = (item->brcolor >> 8) & 0xFF;
-        visible_bg = true;
-    } else {
-        bgcolor_r = 0;
-        bgcolor_g = 0;
-        bgcolor_b = 0;
-        visible_bg = false;
-    }
-
-    char *text = (char *) item->data.text_data.text;
-
-    int width = item->width;
-
-    int drawn_pixels = 0;
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        int char_index = j / CHAR_WIDTH;
-        char c = text[char_index];
-        unsigned const char *glyph = fontdata + ((unsigned char) c) * 16;
-
-        unsigned char row = glyph[ypos - y];
-
-        bool opaque;
-        int k = j % CHAR_WIDTH;
-        if (row & (1 << (7 - k))) {
-            opaque = true;
-        } else {
-            opaque = false;
-        }
-
-        if (opaque) {
-            uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, fgcolor_r, fgcolor_g, fgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else if (visible_bg) {
-            uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, bgcolor_r, bgcolor_g, bgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
+    uint64_t delta = now_ms() - spi->last_refresh;
+    if (delta >= REFRESH_COOLDOWN_MS) {
+        return 0;
     }
 
-    return drawn_pixels;
-}
-
-void wait_some_time(Context *ctx)
-{
-    struct SPI *spi = ctx->platform_data;
-
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    uint64_t now = tv.tv_sec * 1000LL + (tv.tv_usec / 1000LL);
-    uint64_t delta = now - spi->last_refresh;
-    if (delta < 2000) {
-        // Wait 2 seconds before allowing a new refresh
-        // this is not on datasheets, but without this the screen will not update.
-        vTaskDelay((2000 - delta) / portTICK_PERIOD_MS);
-    }
+    return (REFRESH_COOLDOWN_MS - delta) / portTICK_PERIOD_MS;
 }
 
 void update_last_refresh_ts(Context *ctx)
 {
     struct SPI *spi = ctx->platform_data;
 
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    spi->last_refresh = tv.tv_sec * 1000LL + (tv.tv_usec / 1000LL);
+    spi->last_refresh = now_ms();
 }
 
-void maybe_refresh(Context *ctx)
+static inline uint32_t fnv1a_update(uint32_t hash, const uint8_t *data, size_t len)
 {
-    struct SPI *spi = ctx->platform_data;
-
-    spi->count_to_refresh--;
-    if (spi->count_to_refresh <= 0) {
-        // 7 is the special "clear screen color"
-        clear_screen(ctx, 7);
-        update_last_refresh_ts(ctx);
-        spi->count_to_refresh = 5;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 16777619;
     }
+
+    return hash;
 }
 
-static void do_update(Context *ctx, term display_list)
+// Rendered rows are always written to the panel memory, but the (slow) refresh is skipped when
+// the frame is identical to the one that is already displayed. Returns true when refreshed.
+static bool do_update(Context *ctx, term display_list)
 {
-    maybe_refresh(ctx);
-    // it looks like we need to wait some time
-    // let's use 2 seconds
-    wait_some_time(ctx);
-
-    int proper;
-    int len = term_list_length(display_list, &proper);
-
-    BaseDisplayItem *items = malloc(sizeof(BaseDisplayItem) * len);
+    struct SPI *spi = ctx->platform_data;
 
-    term t = display_list;
-    for (int i = 0; i < len; i++) {
-        init_item(&items[i], term_get_list_head(t), ctx);
-        t = term_get_list_tail(t);
-    }
+    int len;
+    DISPLAY_STATS_START(parse_start);
+    BaseDisplayItem *items = init_items(display_list, &len, NULL, 0, ctx, &spi->arena);
+    struct ScanlineIndex index;
+    scanline_index_init(&index, items, len, DISPLAY_WIDTH, &spi->arena);
+    DISPLAY_STATS_ADD_ELAPSED(parse_us, parse_start);
+    DISPLAY_STATS_ADD(frames, 1);
 
     int screen_width = DISPLAY_WIDTH;
     int screen_height = DISPLAY_HEIGHT;
-    struct SPI *spi = ctx->platform_data;
 
     struct SPIDisplay *spi_disp = &spi->spi_disp;
     spi_device_acquire_bus(spi_disp->handle, portMAX_DELAY);
@@ -465,30 +322,39 @@ static void do_update(Context *ctx, term display_list)
 
     gpio_set_level(spi->dc_gpio, 1);
 
-    uint8_t *buf = heap_caps_malloc(DISPLAY_WIDTH / 2, MALLOC_CAP_DMA);
+    uint8_t *buf = spi->line_buf;
     memset(buf, 0x11, DISPLAY_WIDTH / 2);
 
     bool transaction_in_progress = false;
+    uint32_t hash = 2166136261;
 
     for (int ypos = 0; ypos < screen_height; ypos++) {
         if (transaction_in_progress) {
-            spi_transaction_t *trans = NULL;
-            spi_device_get_trans_result(spi->spi_disp.handle, &trans, portMAX_DELAY);
+            spi_display_wait_dmawrite(&spi->spi_disp);
         }
 
+        DISPLAY_STATS_START(raster_start);
         int xpos = 0;
         while (xpos < screen_width) {
-            int drawn_pixels = draw_x(buf, xpos, ypos, items, len);
+            int drawn_pixels = draw_x(buf, xpos, ypos, &index);
             xpos += drawn_pixels;
         }
+        DISPLAY_STATS_ADD_ELAPSED(raster_us, raster_start);
+        hash = fnv1a_update(hash, buf, DISPLAY_WIDTH / 2);
 
         spi_display_dmawrite(&spi->spi_disp, DISPLAY_WIDTH / 2, buf);
         transaction_in_progress = true;
     }
 
     if (transaction_in_progress) {
-        spi_transaction_t *trans = NULL;
-        spi_device_get_trans_result(spi->spi_disp.handle, &trans, portMAX_DELAY);
+        spi_display_wait_dmawrite(&spi->spi_disp);
+    }
+
+    frame_arena_reset(&spi->arena);
+
+    if (spi->last_frame_hash_valid && (hash == spi->last_frame_hash)) {
+        spi_device_release_bus(spi_disp->handle);
+        return false;
     }
 
     // not sure if we should add 0x11, which is end of data command or not
@@ -506,9 +372,39 @@ static void do_update(Context *ctx, term display_list)
     spi_device_release_bus(spi_disp->handle);
     wait_busy_level(spi, 0);
 
-    destroy_items(items, len);
-
     update_last_refresh_ts(ctx);
+    spi->last_frame_hash = hash;
+    spi->last_frame_hash_valid = true;
+
+    return true;
+}
+
+// Called once the panel is ready: when a clean refresh is due, it is done first, and the update
+// is deferred again, so updates that arrive meanwhile replace it.
+static void draw_pending_update(Context *ctx)
+{
+    struct SPI *spi = ctx->platform_data;
+
+    if ((spi->clean_refresh_interval > 0) && (spi->count_to_refresh <= 0)) {
+        // 7 is the special "clear screen color"
+        clear_screen(ctx, 7);
+        update_last_refresh_ts(ctx);
+        spi->last_frame_hash_valid = false;
+        spi->count_to_refresh = spi->clean_refresh_interval;
+        return;
+    }
+
+    Message *message = spi->pending_update;
+    spi->pending_update = NULL;
+
+    GenMessage gen_message;
+    port_parse_gen_message(message->message, &gen_message);
+    if (do_update(ctx, term_get_tuple_element(gen_message.req, 1))) {
+        spi->count_to_refresh--;
+    }
+
+    display_messages_reply_ok(message, ctx->global);
+    display_messages_dispose(message, ctx->global);
 }
 
 static void process_message(Message *message, Context *ctx)
@@ -525,11 +421,20 @@ static void process_message(Message *message, Context *ctx)
     }
     term cmd = term_get_tuple_element(req, 0);
 
-    if (cmd == context_make_atom(ctx, "\x6"
-                                      "update")) {
+    struct SPI *spi = ctx->platform_data;
 
-        term display_list = term_get_tuple_element(req, 1);
-        do_update(ctx, display_list);
+    if (cmd == context_make_atom(ctx, "\x9"
+                                      "get_stats")) {
+        DISPLAY_STATS_COLLECT_SPI(&spi->spi_disp);
+        display_messages_send_stats(&gen_message, ctx->global);
+        return;
+
+    } else if (cmd == context_make_atom(ctx, "\xB"
+                                             "reset_stats")) {
+        display_messages_reset_stats();
+        DISPLAY_STATS_RESET_SPI(&spi->spi_disp);
+        display_messages_send_reply(&gen_message, OK_ATOM, ctx->global);
+        return;
 
     } else {
 #if REPORT_UNEXPECTED_MSGS
@@ -548,18 +453,33 @@ static void process_message(Message *message, Context *ctx)
     END_WITH_STACK_HEAP(heap, ctx->global);
 }
 
+// Updates are never drawn while the panel is not ready: the latest one is kept pending, while
+// other messages are still processed.
 static void process_messages(void *arg)
 {
-    struct SPI *args = arg;
+    struct SPI *spi = arg;
+    Context *ctx = spi->ctx;
 
     while (true) {
-        Message *message;
-        xQueueReceive(display_messages_queue, &message, portMAX_DELAY);
-        process_message(message, args->ctx);
+        TickType_t timeout = spi->pending_update ? ticks_until_ready(spi) : portMAX_DELAY;
+        Message *message = display_messages_receive_timeout(timeout);
+        if (!message) {
+            draw_pending_update(ctx);
+            continue;
+        }
 
-        BEGIN_WITH_STACK_HEAP(1, temp_heap);
-        mailbox_message_dispose(&message->base, &temp_heap);
-        END_WITH_STACK_HEAP(temp_heap, args->ctx->global);
+        if (display_messages_is_update(message)) {
+            if (spi->pending_update) {
+                display_messages_reply_ok(spi->pending_update, ctx->global);
+                display_messages_dispose(spi->pending_update, ctx->global);
+                display_messages_coalesced++;
+            }
+            spi->pending_update = message;
+            continue;
+        }
+
+        process_message(message, ctx);
+        display_messages_dispose(message, ctx->global);
     }
 }
 
@@ -590,8 +510,7 @@ static void clear_screen(Context *ctx, int color)
 
     for (int i = 0; i < DISPLAY_HEIGHT; i++) {
         if (transaction_in_progress) {
-            spi_transaction_t *trans = NULL;
-            spi_device_get_trans_result(spi->spi_disp.handle, &trans, portMAX_DELAY);
+            spi_display_wait_dmawrite(&spi->spi_disp);
         }
 
         // let's ensure a memset otherwise we might generate odd artifacts
@@ -601,8 +520,7 @@ static void clear_screen(Context *ctx, int color)
     }
 
     if (transaction_in_progress) {
-        spi_transaction_t *trans = NULL;
-        spi_device_get_trans_result(spi->spi_disp.handle, &trans, portMAX_DELAY);
+        spi_display_wait_dmawrite(&spi->spi_disp);
     }
 
     writecommand(spi, 0x04);
@@ -616,6 +534,8 @@ static void clear_screen(Context *ctx, int color)
 
 static void display_spi_init(Context *ctx, term opts)
 {
+    display_atoms_init(ctx->global);
+
     struct SPI *spi = malloc(sizeof(struct SPI));
     // TODO check here
 
@@ -688,9 +608,29 @@ static void display_spi_init(Context *ctx, term opts)
     ctx->platform_data = spi;
 
     spi->ctx = ctx;
+    frame_arena_init(&spi->arena);
+    spi->line_buf = heap_caps_malloc(DISPLAY_WIDTH / 2, MALLOC_CAP_DMA);
+
+    acep7_lut_init();
+    enum dither_mode dither;
+    if (!dither_mode_from_opts(opts, &dither, ctx->global)
+        || !error_diffusion_init(&acep7_diffusion, dither, DISPLAY_WIDTH, 3)) {
+        ESP_LOGE(TAG, "Failed init: invalid dither option.");
+        return;
+    }
 
     update_last_refresh_ts(ctx);
     spi->count_to_refresh = 0;
+    spi->pending_update = NULL;
+    spi->last_frame_hash_valid = false;
+
+    term clean_refresh_interval = interop_kv_get_value_default(opts, ATOM_STR("\x16", "clean_refresh_interval"),
+        term_from_int(DEFAULT_CLEAN_REFRESH_INTERVAL), ctx->global);
+    if (!term_is_integer(clean_refresh_interval) || (term_to_int(clean_refresh_interval) < 0)) {
+        ESP_LOGE(TAG, "Failed init: invalid clean_refresh_interval option.");
+        return;
+    }
+    spi->clean_refresh_interval = term_to_int(clean_refresh_interval);
 
 #if SELF_TEST
     for (int i = 0; i < 8; i++) {
@@ -703,7 +643,10 @@ static void display_spi_init(Context *ctx, term opts)
     while (1)
         ;
 #else
-    display_messages_queue = xQueueCreate(32, sizeof(Message *));
+    if (!display_messages_init(opts, ctx->global)) {
+        ESP_LOGE(TAG, "Failed init: invalid coalesce_updates option.");
+        return;
+    }
     xTaskCreate(process_messages, "display", 10000, spi, 1, NULL);
 #endif
 }
@@ -713,7 +656,7 @@ static NativeHandlerResult display_driver_consume_mailbox(Context *ctx)
     MailboxMessage *mbox_msg = mailbox_take_message(&ctx->mailbox);
     Message *msg = CONTAINER_OF(mbox_msg, Message, base);
 
-    xQueueSend(display_messages_queue, &msg, 1);
+    display_messages_enqueue(msg);
 
     return NativeContinue;
 }
@@ -0,0 +1,352 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2021-2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+// Maximum number of disjoint damaged rectangles that are tracked for each update.
+#ifndef DAMAGE_MAX_RECTANGLES
+#define DAMAGE_MAX_RECTANGLES 8
+#endif
+
+// Cost of starting a new windowed burst (CASET + PASET + RAMWR and their data), expressed as
+// the number of pixels that could be sent in the same time.
+#ifndef DAMAGE_RECTANGLE_OVERHEAD
+#define DAMAGE_RECTANGLE_OVERHEAD 256
+#endif
+
+struct Rectangle
+{
+    int x;
+    int y;
+    int width;
+    int height;
+    bool valid;
+};
+
+struct DamageList
+{
+    struct Rectangle rectangles[DAMAGE_MAX_RECTANGLES];
+    int count;
+};
+
+static inline int int_min(int a, int b)
+{
+    return (a > b) ? b : a;
+}
+
+static inline int int_max(int a, int b)
+{
+    return (a > b) ? a : b;
+}
+
+// Palettes might be copied into the arena, while run length encoded rows are derived from pixels.
+static bool image_aux_equal(enum image_format format, const void *a, const void *b)
+{
+    return (format != FormatIndexed8) || (a == b) || !memcmp(a, b, 256 * 4);
+}
+
+static bool cmp_display_item(BaseDisplayItem *a, BaseDisplayItem *b)
+{
+    if (a->primitive != b->primitive || a->x != b->x || a->y != b->y ||
+            a->width != b->width || a->height != b->height || a->brcolor != b->brcolor) {
+        return false;
+    }
+
+    switch (a->primitive) {
+        case Image:
+            return (a->data.image_data.pix == b->data.image_data.pix) &&
+                (a->data.image_data.format == b->data.image_data.format) &&
+                image_aux_equal(a->data.image_data.format, a->data.image_data.aux, b->data.image_data.aux);
+
+        case Rect:
+            return true;
+
+        case Text:
+            return (a->data.text_data.fgcolor == b->data.text_data.fgcolor) &&
+                !strcmp(a->data.text_data.text, b->data.text_data.text);
+
+        case GlyphRun: {
+            const struct GlyphRunData *a_run = &a->data.glyph_run_data;
+            const struct GlyphRunData *b_run = &b->data.glyph_run_data;
+            if ((a_run->fgcolor != b_run->fgcolor) || (a_run->glyphs_count != b_run->glyphs_count)) {
+                return false;
+            }
+            // coverage pointers are owned by the glyph cache, so equal glyphs have equal pointers
+            for (int i = 0; i < a_run->glyphs_count; i++) {
+                const struct PlacedGlyph *a_glyph = &a_run->glyphs[i];
+                const struct PlacedGlyph *b_glyph = &b_run->glyphs[i];
+                if ((a_glyph->x != b_glyph->x) || (a_glyph->y != b_glyph->y)
+                    || (a_glyph->coverage != b_glyph->coverage)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        case ScrollArea:
+            return (a->data.scroll_area_data.top == b->data.scroll_area_data.top) &&
+                (a->data.scroll_area_data.height == b->data.scroll_area_data.height) &&
+                (a->data.scroll_area_data.offset == b->data.scroll_area_data.offset);
+
+        case ScaledCroppedImage:
+            return (a->data.image_data_with_size.pix == b->data.image_data_with_size.pix) &&
+                (a->data.image_data_with_size.width == b->data.image_data_with_size.width) &&
+                (a->data.image_data_with_size.format == b->data.image_data_with_size.format) &&
+                image_aux_equal(a->data.image_data_with_size.format, a->data.image_data_with_size.aux,
+                    b->data.image_data_with_size.aux) &&
+                (a->x_step == b->x_step) && (a->y_step == b->y_step) && (a->filter == b->filter) &&
+                (a->source_x == b->source_x) && (a->source_y == b->source_y);
+
+        default: {
+            return true;
+        }
+    }
+}
+
+static void update_damaged_area(struct Rectangle *area, const struct Rectangle *damage)
+{
+    if (area->valid) {
+        int x1 = int_max(area->x + area->width, damage->x + damage->width);
+        int y1 = int_max(area->y + area->height, damage->y + damage->height);
+        area->x = int_min(area->x, damage->x);
+        area->y = int_min(area->y, damage->y);
+        area->width = x1 - area->x;
+        area->height = y1 - area->y;
+    } else {
+        area->x = damage->x;
+        area->y = damage->y;
+        area->width = damage->width;
+        area->height = damage->height;
+        area->valid = true;
+    }
+}
+
+static void clip_rectangle(struct Rectangle *rectangle, const struct Rectangle *clip_region)
+{
+    int x1 = int_min(rectangle->x + rectangle->width, clip_region->x + clip_region->width);
+    int y1 = int_min(rectangle->y + rectangle->height, clip_region->y + clip_region->height);
+    rectangle->x = int_max(rectangle->x, clip_region->x);
+    rectangle->y = int_max(rectangle->y, clip_region->y);
+    rectangle->width = x1 - rectangle->x;
+    rectangle->height = y1 - rectangle->y;
+
+    if ((rectangle->width <= 0) || (rectangle->height <= 0)) {
+        rectangle->valid = false;
+    }
+}
+
+static inline bool rectangles_overlap(const struct Rectangle *a, const struct Rectangle *b)
+{
+    return (a->x < b->x + b->width) && (b->x < a->x + a->width)
+        && (a->y < b->y + b->height) && (b->y < a->y + a->height);
+}
+
+// Returns how many pixels are needlessly repainted when a and b are replaced by their bounding
+// box, less the overhead that is saved by sending a single window. a and b must be disjoint.
+static int merge_cost(const struct Rectangle *a, const struct Rectangle *b)
+{
+    int x0 = int_min(a->x, b->x);
+    int y0 = int_min(a->y, b->y);
+    int x1 = int_max(a->x + a->width, b->x + b->width);
+    int y1 = int_max(a->y + a->height, b->y + b->height);
+
+    int wasted = (x1 - x0) * (y1 - y0) - a->width * a->height - b->width * b->height;
+
+    return wasted - DAMAGE_RECTANGLE_OVERHEAD;
+}
+
+static inline void damage_list_init(struct DamageList *list)
+{
+    list->count = 0;
+}
+
+static inline void damage_list_remove(struct DamageList *list, int index)
+{
+    list->count--;
+    list->rectangles[index] = list->rectangles[list->count];
+}
+
+// Rectangles in the list are kept disjoint: overlapping ones are always merged, while others
+// are merged only when a single window is cheaper than two. When the list is full the new
+// rectangle is merged with the cheapest one.
+static void damage_list_add(struct DamageList *list, const struct Rectangle *damage)
+{
+    if (!damage->valid || (damage->width <= 0) || (damage->height <= 0)) {
+        return;
+    }
+
+    struct Rectangle rect = *damage;
+
+    bool merged;
+    do {
+        merged = false;
+        for (int i = 0; i < list->count; i++) {
+            struct Rectangle *other = &list->rectangles[i];
+            if (rectangles_overlap(&rect, other) || (merge_cost(&rect, other) <= 0)) {
+                update_damaged_area(&rect, other);
+                damage_list_remove(list, i);
+                merged = true;
+                break;
+            }
+        }
+
+        if (!merged && (list->count == DAMAGE_MAX_RECTANGLES)) {
+            int cheapest = 0;
+            int cheapest_cost = merge_cost(&rect, &list->rectangles[0]);
+            for (int i = 1; i < list->count; i++) {
+                int cost = merge_cost(&rect, &list->rectangles[i]);
+                if (cost < cheapest_cost) {
+                    cheapest = i;
+                    cheapest_cost = cost;
+                }
+            }
+            update_damaged_area(&rect, &list->rectangles[cheapest]);
+            damage_list_remove(list, cheapest);
+            merged = true;
+        }
+        // a grown rectangle might now overlap with rectangles that have been already checked
+    } while (merged);
+
+    list->rectangles[list->count] = rect;
+    list->count++;
+}
+
+static void damage_list_clip(struct DamageList *list, const struct Rectangle *clip_region)
+{
+    int i = 0;
+    while (i < list->count) {
+        clip_rectangle(&list->rectangles[i], clip_region);
+        if (list->rectangles[i].valid) {
+            i++;
+        } else {
+            damage_list_remove(list, i);
+        }
+    }
+}
+
+// Returns how many rows in [0, height) are covered by at least one damaged rectangle.
+static inline int damage_list_rows(const struct DamageList *list, int height)
+{
+    int rows = 0;
+    for (int y = 0; y < height; y++) {
+        for (int i = 0; i < list->count; i++) {
+            const struct Rectangle *rect = &list->rectangles[i];
+            if ((y >= rect->y) && (y < rect->y + rect->height)) {
+                rows++;
+                break;
+            }
+        }
+    }
+
+    return rows;
+}
+
+static void damage_item(struct DamageList *damaged, const BaseDisplayItem *item)
+{
+    struct Rectangle irect = {
+        .x = item->x,
+        .y = item->y,
+        .width = item->width,
+        .height = item->height,
+        .valid = true
+    };
+    damage_list_add(damaged, &irect);
+}
+
+// Both lists are sorted from the topmost item to the bottom one: items that are found in both
+// lists (in the same relative order) are left untouched, all the others are marked as damaged,
+// both at their old and at their new position.
+static void dumb_diff(BaseDisplayItem *orig, int orig_len, BaseDisplayItem *new, int new_len, struct DamageList *damaged)
+{
+    int j = 0;
+
+    for (int i = 0; i < new_len; i++) {
+        bool found = false;
+        for (int k = j; k < orig_len; k++) {
+            if (cmp_display_item(&new[i], &orig[k])) {
+                // items that have been skipped are not part of the new display list anymore
+                for (int l = j; l < k; l++) {
+                    damage_item(damaged, &orig[l]);
+                }
+
+                j = k + 1;
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            damage_item(damaged, &new[i]);
+        }
+    }
+
+    // trailing items have been removed
+    for (int l = j; l < orig_len; l++) {
+        damage_item(damaged, &orig[l]);
+    }
+}
+
+// Hardware scrolling moved rows [top, top + height) up by delta rows, and rows that left the area
+// wrapped around. Previous items inside the area are moved as well, so items that scrolled
+// together with the area are not damaged again: only exposed rows are, together with items that
+// did not follow the scrolling.
+static void scroll_prev_items(BaseDisplayItem *prev, int prev_len, int top, int height, int delta,
+    int screen_width, struct DamageList *damaged)
+{
+    int bottom = top + height;
+
+    for (int i = 0; i < prev_len; i++) {
+        BaseDisplayItem *item = &prev[i];
+        if ((item->width <= 0) || (item->height <= 0) || (item->y + item->height <= top) || (item->y >= bottom)) {
+            continue;
+        }
+
+        if ((item->y >= top) && (item->y + item->height <= bottom)) {
+            item->y -= delta;
+            // the part that left the area is not there anymore
+            if ((item->y < top) || (item->y + item->height > bottom)) {
+                damage_item(damaged, item);
+            }
+
+        } else if ((item->primitive != Rect) || (item->y > top) || (item->y + item->height < bottom)) {
+            // uniform rects that fill the whole area look the same after scrolling
+            int y0 = int_max(item->y, top);
+            int y1 = int_min(item->y + item->height, bottom);
+            struct Rectangle stale = {
+                .x = item->x,
+                .y = y0,
+                .width = item->width,
+                .height = y1 - y0,
+                .valid = true
+            };
+            damage_list_add(damaged, &stale);
+        }
+    }
+
+    int exposed_height = int_min((delta < 0) ? -delta : delta, height);
+    struct Rectangle exposed = {
+        .x = 0,
+        .y = (delta > 0) ? bottom - exposed_height : top,
+        .width = screen_width,
+        .height = exposed_height,
+        .valid = true
+    };
+    damage_list_add(damaged, &exposed);
+}
@@ -0,0 +1,338 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Panel throughput benchmark, that is run by a {benchmark, Opts} call. It measures:
+// - sustained DMA writes of full frames, using transactions of band_height lines each
+// - the time taken by a single command and by setting the paint area
+// - full frames that are rendered and sent exactly as updates, both for solid and image content
+// Panel content is overwritten, so the previous display list is forgotten and next update draws
+// everything again.
+//
+// The driver must define the following before including this file:
+// - struct SPI, with struct SPIDisplay spi_disp and struct DisplayPipeline *pipeline fields
+// - screen, with w, h and framebuffer fields
+// - writecommand, set_screen_paint_area and begin_ram_write
+// - update_area and update_framebuffer_area, that draw a damaged rectangle
+// - forget_prev_display_list
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+#include <globalcontext.h>
+#include <interop.h>
+#include <port.h>
+#include <term.h>
+#include <utils.h>
+
+#define BENCHMARK_MAX_BAND_HEIGHTS 8
+#define BENCHMARK_TILE_SIZE 32
+// NOP is the same command for all supported panels
+#define BENCHMARK_NOP 0x00
+
+struct BenchmarkOpts
+{
+    int band_heights[BENCHMARK_MAX_BAND_HEIGHTS];
+    int band_heights_count;
+    int frames;
+    int iterations;
+};
+
+struct BenchmarkBandResult
+{
+    int band_height;
+    int bytes;
+    avm_float_t fps;
+    avm_float_t mb_per_s;
+};
+
+struct BenchmarkResults
+{
+    struct BenchmarkBandResult bands[BENCHMARK_MAX_BAND_HEIGHTS];
+    int bands_count;
+    avm_float_t command_us;
+    avm_float_t paint_area_us;
+    avm_float_t solid_fps;
+    avm_float_t image_fps;
+};
+
+static bool benchmark_positive_int_from_opts(term opts, AtomString key, int default_value, int *value,
+    GlobalContext *glb)
+{
+    term t = interop_kv_get_value_default(opts, key, term_from_int(default_value), glb);
+    if (!term_is_integer(t) || (term_to_int(t) < 1)) {
+        return false;
+    }
+    *value = term_to_int(t);
+
+    return true;
+}
+
+// Parses frames (default 10), iterations (default 100) and band_heights, that defaults to 1, 2, 4
+// lines and as many lines as a single transaction can hold.
+static bool benchmark_parse_opts(term opts, struct BenchmarkOpts *bench_opts, int max_band_height,
+    GlobalContext *glb)
+{
+    if (!benchmark_positive_int_from_opts(opts, ATOM_STR("\x6", "frames"), 10, &bench_opts->frames, glb)
+        || !benchmark_positive_int_from_opts(opts, ATOM_STR("\xA", "iterations"), 100, &bench_opts->iterations, glb)) {
+        return false;
+    }
+
+    bench_opts->band_heights_count = 0;
+    term band_heights = interop_kv_get_value(opts, ATOM_STR("\xC", "band_heights"), glb);
+    if (band_heights == term_invalid_term()) {
+        for (int lines = 1; (lines <= 4) && (lines < max_band_height); lines *= 2) {
+            bench_opts->band_heights[bench_opts->band_heights_count] = lines;
+            bench_opts->band_heights_count++;
+        }
+        bench_opts->band_heights[bench_opts->band_heights_count] = max_band_height;
+        bench_opts->band_heights_count++;
+        return true;
+    }
+
+    while (term_is_nonempty_list(band_heights)) {
+        term lines = term_get_list_head(band_heights);
+        if ((bench_opts->band_heights_count == BENCHMARK_MAX_BAND_HEIGHTS) || !term_is_integer(lines)
+            || (term_to_int(lines) < 1) || (term_to_int(lines) > max_band_height)) {
+            return false;
+        }
+        bench_opts->band_heights[bench_opts->band_heights_count] = term_to_int(lines);
+        bench_opts->band_heights_count++;
+        band_heights = term_get_list_tail(band_heights);
+    }
+
+    return term_is_nil(band_heights) && (bench_opts->band_heights_count > 0);
+}
+
+// Sends frames full frames of buf, one transaction for each band of band_height lines.
+static void benchmark_dmawrite(struct SPI *spi, const uint8_t *buf, int band_height, int frames,
+    struct BenchmarkBandResult *result)
+{
+    int line_size = screen->w * sizeof(uint16_t);
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < frames; i++) {
+        begin_ram_write(spi, 0, 0, screen->w, screen->h);
+        spi_device_acquire_bus(spi->spi_disp.handle, portMAX_DELAY);
+        for (int y = 0; y < screen->h; y += band_height) {
+            int lines = int_min(band_height, screen->h - y);
+            spi_display_queue_dmawrite(&spi->spi_disp, lines * line_size, buf);
+        }
+        spi_display_wait_queued(&spi->spi_disp);
+        spi_device_release_bus(spi->spi_disp.handle);
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start;
+
+    result->band_height = band_height;
+    result->bytes = band_height * line_size;
+    result->fps = (frames * 1000000.0) / elapsed_us;
+    // bytes per microsecond are MB/s
+    result->mb_per_s = ((avm_float_t) frames * screen->h * line_size) / elapsed_us;
+}
+
+static avm_float_t benchmark_render(struct SPI *spi, BaseDisplayItem *items, int items_count, int frames)
+{
+    struct FrameArena *arena = &spi->arenas[spi->next_arena];
+    struct Rectangle screen_rect = {
+        .x = 0,
+        .y = 0,
+        .width = screen->w,
+        .height = screen->h,
+        .valid = true
+    };
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < frames; i++) {
+        struct ScanlineIndex index;
+        scanline_index_init(&index, items, items_count, screen->w, arena);
+        if (screen->framebuffer) {
+            update_framebuffer_area(spi, &screen_rect, &index);
+        } else {
+            update_area(spi, &screen_rect, &index);
+        }
+        frame_arena_reset(arena);
+    }
+    // last bands might still be queued
+    if (spi->pipeline) {
+        pipeline_sync(spi->pipeline);
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start;
+
+    return (frames * 1000000.0) / elapsed_us;
+}
+
+// Tiles have a gradient with an alpha ramp, so pixels are converted and blended with the background.
+static void benchmark_init_tile(uint8_t *tile)
+{
+    for (int y = 0; y < BENCHMARK_TILE_SIZE; y++) {
+        for (int x = 0; x < BENCHMARK_TILE_SIZE; x++) {
+            uint8_t *pixel = tile + (y * BENCHMARK_TILE_SIZE + x) * 4;
+            pixel[0] = x * 8;
+            pixel[1] = y * 8;
+            pixel[2] = 0x80;
+            pixel[3] = (x + y) * 4;
+        }
+    }
+}
+
+static int benchmark_init_tiles(BaseDisplayItem *items, const uint8_t *tile)
+{
+    int count = 0;
+    for (int y = 0; y < screen->h; y += BENCHMARK_TILE_SIZE) {
+        for (int x = 0; x < screen->w; x += BENCHMARK_TILE_SIZE) {
+            BaseDisplayItem *item = &items[count];
+            memset(item, 0, sizeof(BaseDisplayItem));
+            item->primitive = Image;
+            item->x = x;
+            item->y = y;
+            item->width = BENCHMARK_TILE_SIZE;
+            item->height = BENCHMARK_TILE_SIZE;
+            item->brcolor = 0x204060FF;
+            item->data.image_data.pix = (const char *) tile;
+            item->data.image_data.format = FormatRGBA8888;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static bool benchmark_run(struct SPI *spi, const struct BenchmarkOpts *bench_opts, struct BenchmarkResults *results)
+{
+    int max_band_height = SPI_DISPLAY_MAX_TRANSFER_SIZE / (screen->w * sizeof(uint16_t));
+    int tiles_count = ((screen->w + BENCHMARK_TILE_SIZE - 1) / BENCHMARK_TILE_SIZE)
+        * ((screen->h + BENCHMARK_TILE_SIZE - 1) / BENCHMARK_TILE_SIZE);
+
+    uint8_t *buf = heap_caps_malloc(max_band_height * screen->w * sizeof(uint16_t), MALLOC_CAP_DMA);
+    uint8_t *tile = malloc(BENCHMARK_TILE_SIZE * BENCHMARK_TILE_SIZE * 4);
+    BaseDisplayItem *items = malloc(sizeof(BaseDisplayItem) * tiles_count);
+    if (IS_NULL_PTR(buf) || IS_NULL_PTR(tile) || IS_NULL_PTR(items)) {
+        heap_caps_free(buf);
+        free(tile);
+        free(items);
+        return false;
+    }
+    memset(buf, 0x55, max_band_height * screen->w * sizeof(uint16_t));
+
+    // commands use the bus directly, so previous bands must be sent first
+    if (spi->pipeline) {
+        pipeline_sync(spi->pipeline);
+    }
+    // items are rendered from the arena of next display list, so the previous one must go
+    forget_prev_display_list(spi, spi->ctx->global);
+
+    results->bands_count = bench_opts->band_heights_count;
+    for (int i = 0; i < bench_opts->band_heights_count; i++) {
+        benchmark_dmawrite(spi, buf, bench_opts->band_heights[i], bench_opts->frames, &results->bands[i]);
+    }
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < bench_opts->iterations; i++) {
+        writecommand(spi, BENCHMARK_NOP);
+    }
+    results->command_us = (avm_float_t) (esp_timer_get_time() - start) / bench_opts->iterations;
+
+    start = esp_timer_get_time();
+    for (int i = 0; i < bench_opts->iterations; i++) {
+        set_screen_paint_area(spi, 0, 0, screen->w, screen->h);
+    }
+    results->paint_area_us = (avm_float_t) (esp_timer_get_time() - start) / bench_opts->iterations;
+
+    BaseDisplayItem *background = &items[0];
+    memset(background, 0, sizeof(BaseDisplayItem));
+    background->primitive = Rect;
+    background->width = screen->w;
+    background->height = screen->h;
+    background->brcolor = 0x336699FF;
+    results->solid_fps = benchmark_render(spi, background, 1, bench_opts->frames);
+
+    benchmark_init_tile(tile);
+    int items_count = benchmark_init_tiles(items, tile);
+    results->image_fps = benchmark_render(spi, items, items_count, bench_opts->frames);
+
+    heap_caps_free(buf);
+    free(tile);
+    free(items);
+
+    return true;
+}
+
+#define BENCHMARK_BAND_RESULT_SIZE (CONS_SIZE + term_map_size_in_terms(4) + 2 * FLOAT_SIZE)
+#define BENCHMARK_RESULTS_SIZE \
+    (term_map_size_in_terms(5) + 4 * FLOAT_SIZE + BENCHMARK_MAX_BAND_HEIGHTS * BENCHMARK_BAND_RESULT_SIZE)
+
+// Map keys must be sorted, so they are set in alphabetical order.
+static term benchmark_results_to_term(const struct BenchmarkResults *results, Heap *heap, GlobalContext *glb)
+{
+    term bands = term_nil();
+    for (int i = results->bands_count - 1; i >= 0; i--) {
+        const struct BenchmarkBandResult *band = &results->bands[i];
+        term band_map = term_alloc_map(4, heap);
+        term_set_map_assoc(band_map, 0, globalcontext_make_atom(glb, ATOM_STR("\xB", "band_height")),
+            term_from_int(band->band_height));
+        term_set_map_assoc(band_map, 1, globalcontext_make_atom(glb, ATOM_STR("\x5", "bytes")),
+            term_from_int(band->bytes));
+        term_set_map_assoc(band_map, 2, globalcontext_make_atom(glb, ATOM_STR("\x3", "fps")),
+            term_from_float(band->fps, heap));
+        term_set_map_assoc(band_map, 3, globalcontext_make_atom(glb, ATOM_STR("\x8", "mb_per_s")),
+            term_from_float(band->mb_per_s, heap));
+        bands = term_list_prepend(band_map, bands, heap);
+    }
+
+    term map = term_alloc_map(5, heap);
+    term_set_map_assoc(map, 0, globalcontext_make_atom(glb, ATOM_STR("\xA", "command_us")),
+        term_from_float(results->command_us, heap));
+    term_set_map_assoc(map, 1, globalcontext_make_atom(glb, ATOM_STR("\x9", "dmawrite")), bands);
+    term_set_map_assoc(map, 2, globalcontext_make_atom(glb, ATOM_STR("\x9", "image_fps")),
+        term_from_float(results->image_fps, heap));
+    term_set_map_assoc(map, 3, globalcontext_make_atom(glb, ATOM_STR("\xD", "paint_area_us")),
+        term_from_float(results->paint_area_us, heap));
+    term_set_map_assoc(map, 4, globalcontext_make_atom(glb, ATOM_STR("\x9", "solid_fps")),
+        term_from_float(results->solid_fps, heap));
+
+    return map;
+}
+
+// Handles a {benchmark, Opts} call, replies with a map or with error when options are invalid.
+static void benchmark_handle_call(struct SPI *spi, const GenMessage *gen_message, GlobalContext *glb)
+{
+    term req = gen_message->req;
+    term opts = (term_get_tuple_arity(req) >= 2) ? term_get_tuple_element(req, 1) : term_nil();
+
+    struct BenchmarkOpts bench_opts;
+    int max_band_height = SPI_DISPLAY_MAX_TRANSFER_SIZE / (screen->w * sizeof(uint16_t));
+    struct BenchmarkResults results;
+    if (!benchmark_parse_opts(opts, &bench_opts, max_band_height, glb) || !benchmark_run(spi, &bench_opts, &results)) {
+        display_messages_send_reply(gen_message, ERROR_ATOM, glb);
+        return;
+    }
+
+    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(2) + REF_SIZE + BENCHMARK_RESULTS_SIZE, heap);
+    term return_tuple = term_alloc_tuple(2, &heap);
+    term_put_tuple_element(return_tuple, 0, gen_message->ref);
+    term_put_tuple_element(return_tuple, 1, benchmark_results_to_term(&results, &heap, glb));
+
+    display_messages_send(gen_message->pid, return_tuple, glb);
+    END_WITH_STACK_HEAP(heap, glb);
+}
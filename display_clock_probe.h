@@ -0,0 +1,180 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Startup probe of the highest stable SPI clock. A test pattern is written to panel memory at
+// each candidate clock, and it is read back with RAMRD at a slow clock, since panel reads are
+// much slower than writes. Commands are never sent at a candidate clock. Candidates are tried in ascending order until the first failure, so
+// MISO must be wired. Reads use 18 bit pixels, as panels do on serial interfaces, and the number
+// of dummy clocks before data is not assumed.
+//
+// The driver must define the following before including this file:
+// - struct SPI, with a struct SPIDisplay spi_disp field
+// - write_paint_area, that expects the bus to be acquired, and begin_ram_write
+// The panel must be already initialized, and the pipeline must not be running.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <esp_heap_caps.h>
+
+#include <utils.h>
+
+// RAMRD is the same command for all supported panels
+#define CLOCK_PROBE_RAMRD 0x2E
+#define CLOCK_PROBE_READ_CLOCK_HZ 5000000
+#define CLOCK_PROBE_PIXELS 32
+// room for up to 16 dummy clocks before data
+#define CLOCK_PROBE_READ_SIZE (CLOCK_PROBE_PIXELS * 3 + 3)
+
+// Clocks that can be derived from 80 MHz
+static const int clock_probe_candidates[] = { 20000000, 26666666, 40000000, 80000000 };
+
+// Returns 8 bits starting from bit_offset
+static inline uint8_t clock_probe_get_byte(const uint8_t *data, int bit_offset)
+{
+    int index = bit_offset / 8;
+    int shift = bit_offset % 8;
+    if (shift == 0) {
+        return data[index];
+    }
+
+    return (data[index] << shift) | (data[index + 1] >> (8 - shift));
+}
+
+// Only upper bits of each 6 bit channel are compared, since RGB565 is expanded when stored.
+// Some panels swap red and blue on read when BGR order is set, so both orders are accepted.
+static bool clock_probe_pixel_equal(uint16_t pixel, uint8_t c0, uint8_t c1, uint8_t c2)
+{
+    int r = pixel >> 11;
+    int g = (pixel >> 5) & 0x3F;
+    int b = pixel & 0x1F;
+
+    if ((c1 >> 2) != g) {
+        return false;
+    }
+
+    return (((c0 >> 3) == r) && ((c2 >> 3) == b)) || (((c0 >> 3) == b) && ((c2 >> 3) == r));
+}
+
+static bool clock_probe_verify(const uint16_t *pattern, const uint8_t *readback)
+{
+    for (int dummy_bits = 0; dummy_bits <= 16; dummy_bits++) {
+        bool equal = true;
+        for (int i = 0; (i < CLOCK_PROBE_PIXELS) && equal; i++) {
+            int bit_offset = dummy_bits + i * 24;
+            equal = clock_probe_pixel_equal(pattern[i], clock_probe_get_byte(readback, bit_offset),
+                clock_probe_get_byte(readback, bit_offset + 8), clock_probe_get_byte(readback, bit_offset + 16));
+        }
+        if (equal) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// pattern holds the same pixels in native byte order first, and then big endian ones.
+// Commands are always sent at command_clock_hz, that is known to work, and only the pixel payload
+// is sent at the candidate clock: payload bytes are sent as data, so a failing clock can corrupt
+// test pixels, but it cannot issue commands that would change panel state.
+static bool clock_probe_test(struct SPI *spi, int command_clock_hz, int clock_speed_hz, uint16_t *pattern, uint8_t *readback)
+{
+    if (!spi_display_set_clock(&spi->spi_disp, command_clock_hz)) {
+        return false;
+    }
+    begin_ram_write(spi, 0, 0, CLOCK_PROBE_PIXELS, 1);
+
+    if (!spi_display_set_clock(&spi->spi_disp, clock_speed_hz)) {
+        return false;
+    }
+    spi_device_acquire_bus(spi->spi_disp.handle, portMAX_DELAY);
+    bool ok = spi_display_dmawrite(&spi->spi_disp, CLOCK_PROBE_PIXELS * sizeof(uint16_t), pattern + CLOCK_PROBE_PIXELS);
+    if (ok) {
+        spi_display_wait_dmawrite(&spi->spi_disp);
+    }
+    spi_device_release_bus(spi->spi_disp.handle);
+
+    if (!ok || !spi_display_set_clock(&spi->spi_disp, CLOCK_PROBE_READ_CLOCK_HZ)) {
+        return false;
+    }
+
+    memset(readback, 0, CLOCK_PROBE_READ_SIZE);
+    spi_device_acquire_bus(spi->spi_disp.handle, portMAX_DELAY);
+    write_paint_area(spi, 0, 0, CLOCK_PROBE_PIXELS, 1);
+    ok = spi_display_read_command(&spi->spi_disp, CLOCK_PROBE_RAMRD, readback, CLOCK_PROBE_READ_SIZE);
+    spi_device_release_bus(spi->spi_disp.handle);
+
+    return ok && clock_probe_verify(pattern, readback);
+}
+
+// Returns the highest stable clock, that is also set, or -1 when readback does not work even at
+// clock_speed_hz (such as when MISO is not wired): in that case clock_speed_hz is kept.
+static int clock_probe_run(struct SPI *spi, int clock_speed_hz)
+{
+    uint16_t *pattern = heap_caps_malloc(CLOCK_PROBE_PIXELS * 2 * sizeof(uint16_t), MALLOC_CAP_DMA);
+    uint8_t *readback = heap_caps_malloc(CLOCK_PROBE_READ_SIZE, MALLOC_CAP_DMA);
+    if (IS_NULL_PTR(pattern) || IS_NULL_PTR(readback)) {
+        heap_caps_free(pattern);
+        heap_caps_free(readback);
+        return -1;
+    }
+
+    // alternating bit patterns first, then pseudo random pixels
+    uint16_t value = 0x5AA5;
+    for (int i = 0; i < CLOCK_PROBE_PIXELS; i++) {
+        switch (i) {
+            case 0:
+                pattern[i] = 0xAAAA;
+                break;
+            case 1:
+                pattern[i] = 0x5555;
+                break;
+            default:
+                value = value * 0x6255 + 0x3619;
+                pattern[i] = value;
+                break;
+        }
+        pattern[CLOCK_PROBE_PIXELS + i] = SPI_SWAP_DATA_TX(pattern[i], 16);
+    }
+
+    int best = -1;
+    // panel has been initialized at clock_speed_hz, so commands are sent at it
+    if (clock_probe_test(spi, clock_speed_hz, clock_speed_hz, pattern, readback)) {
+        best = clock_speed_hz;
+        for (size_t i = 0; i < sizeof(clock_probe_candidates) / sizeof(clock_probe_candidates[0]); i++) {
+            int candidate = clock_probe_candidates[i];
+            if (candidate <= best) {
+                continue;
+            }
+            if (!clock_probe_test(spi, clock_speed_hz, candidate, pattern, readback)) {
+                break;
+            }
+            best = candidate;
+        }
+    }
+
+    spi_display_set_clock(&spi->spi_disp, (best > 0) ? best : clock_speed_hz);
+
+    heap_caps_free(pattern);
+    heap_caps_free(readback);
+
+    return best;
+}
@@ -19,7 +19,12 @@
  */
 
 #include <context.h>
+#include <interop.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+
+#include "frame_arena.h"
 
 // TODO: deprecated helper, remove this
 static inline term context_make_atom(Context *ctx, AtomString string)
@@ -33,7 +38,10 @@ enum primitive
     Image,
     ScaledCroppedImage,
     Rect,
-    Text
+    Text,
+    GlyphRun,
+    // it is not drawn, it just tells drivers that support hardware scrolling how rows moved
+    ScrollArea
 };
 
 struct TextData
@@ -42,9 +50,59 @@ struct TextData
     const char *text;
 };
 
+// A glyph of a glyph run, coordinates are relative to the item
+struct PlacedGlyph
+{
+    int x;
+    int y;
+    int width;
+    int height;
+    // 8 bit coverage, owned by the glyph cache
+    const uint8_t *coverage;
+};
+
+struct ScrollAreaData
+{
+    int top;
+    int height;
+    int offset;
+};
+
+struct GlyphRunData
+{
+    uint32_t fgcolor;
+    // sorted by x
+    const struct PlacedGlyph *glyphs;
+    int glyphs_count;
+    int max_glyph_width;
+};
+
+enum image_format
+{
+    // 4 bytes per pixel: R, G, B, A
+    FormatRGBA8888 = 0,
+    // 2 bytes per pixel, big endian, which is the byte order expected by RGB565 panels
+    FormatRGB565BE,
+    // a big endian RGB565 plane followed by an 8 bit alpha plane
+    FormatRGB565A8,
+    // 1 byte per pixel, that is an index in a palette of RGBA8888 colors
+    FormatIndexed8,
+    // run length encoded big endian RGB565 rows, see parse_rle565_image
+    FormatRLE565
+};
+
 struct ImageData
 {
     const char *pix;
+    enum image_format format;
+    // FormatIndexed8: 256 palette entries, FormatRLE565: offset of each row inside pix
+    const void *aux;
+};
+
+enum scale_filter
+{
+    FilterNearest = 0,
+    FilterBilinear
 };
 
 struct ImageDataWithSize
@@ -52,8 +110,27 @@ struct ImageDataWithSize
     int width;
     int height;
     const char *pix;
+    enum image_format format;
+    const void *aux;
 };
 
+// Only for formats that store every pixel, compressed images are never cached.
+static inline int image_format_bytes_per_pixel(enum image_format format)
+{
+    switch (format) {
+        case FormatIndexed8:
+            return 1;
+        case FormatRGB565BE:
+            return 2;
+        case FormatRGB565A8:
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+#include "image_cache.h"
+
 struct BaseDisplayItem
 {
     enum primitive primitive;
@@ -67,50 +144,449 @@ struct BaseDisplayItem
         struct ImageData image_data;
         struct ImageDataWithSize image_data_with_size;
         struct TextData text_data;
+        struct GlyphRunData glyph_run_data;
+        struct ScrollAreaData scroll_area_data;
     } data;
 
     //used just for scaled cropped image
     int source_x;
     int source_y;
-    int x_scale;
-    int y_scale;
+    // source pixels for each displayed pixel, 16.16 fixed point, so no division is required
+    int32_t x_step;
+    int32_t y_step;
+    enum scale_filter filter;
+
+    // display list tuple the item has been built from
+    term source;
+    // size of rasterized pixels that are owned by the item, 0 when pixels belong to a binary
+    size_t owned_pix_size;
+    // size of the compressed image lookup table allocated from the arena, 0 when there is none
+    size_t owned_aux_size;
 };
 
 typedef struct BaseDisplayItem BaseDisplayItem;
 
-static void init_item(BaseDisplayItem *item, term req, Context *ctx)
+#ifdef ENABLE_UFONT
+// ufontlib.h must be included before this file, and the driver must provide the font manager
+extern UFontManager *ufont_manager;
+
+// Text is laid out once, as a run of glyphs from the glyph cache, so rasterized glyphs are shared
+// by all items and by all frames.
+static bool init_glyph_run(BaseDisplayItem *item, const EpdFont *font, const char *text, struct FrameArena *arena)
+{
+    int max_glyphs = 0;
+    const char *t = text;
+    while (ufont_next_code_point(&t)) {
+        max_glyphs++;
+    }
+
+    struct PlacedGlyph *glyphs = frame_arena_alloc(arena, sizeof(struct PlacedGlyph) * max_glyphs);
+    if (IS_NULL_PTR(glyphs) && max_glyphs) {
+        return false;
+    }
+
+    int glyphs_count = 0;
+    int max_glyph_width = 0;
+    int width = 0;
+    int height = 0;
+    int cursor_x = 0;
+    int baseline = font->ascender;
+
+    uint32_t cp;
+    t = text;
+    while ((cp = ufont_next_code_point(&t))) {
+        if (cp == '\n') {
+            cursor_x = 0;
+            baseline += font->advance_y;
+            continue;
+        }
+
+        const UFontCachedGlyph *cached = ufont_manager_get_glyph(ufont_manager, font, cp);
+        if (!cached) {
+            continue;
+        }
+
+        struct PlacedGlyph glyph = {
+            .x = cursor_x + cached->left,
+            .y = baseline - cached->top,
+            .width = cached->width,
+            .height = cached->height,
+            .coverage = cached->coverage
+        };
+        cursor_x += cached->advance_x;
+        width = (cursor_x > width) ? cursor_x : width;
+
+        if ((glyph.width == 0) || (glyph.height == 0)) {
+            continue;
+        }
+        width = (glyph.x + glyph.width > width) ? glyph.x + glyph.width : width;
+        height = (glyph.y + glyph.height > height) ? glyph.y + glyph.height : height;
+        max_glyph_width = (glyph.width > max_glyph_width) ? glyph.width : max_glyph_width;
+
+        // glyphs are almost always already sorted, unless there are multiple lines
+        int i = glyphs_count;
+        while ((i > 0) && (glyphs[i - 1].x > glyph.x)) {
+            glyphs[i] = glyphs[i - 1];
+            i--;
+        }
+        glyphs[i] = glyph;
+        glyphs_count++;
+    }
+
+    item->primitive = GlyphRun;
+    item->width = width;
+    item->height = height;
+    item->data.glyph_run_data.glyphs = glyphs;
+    item->data.glyph_run_data.glyphs_count = glyphs_count;
+    item->data.glyph_run_data.max_glyph_width = max_glyph_width;
+
+    return true;
+}
+#endif
+
+// Atoms used by display lists, they are resolved once when the port is created.
+struct DisplayAtoms
+{
+    term image;
+    term scaled_cropped_image;
+    term rect;
+    term text;
+    term transparent;
+    term default16px;
+    term rgba8888;
+    term rgb565_be;
+    term rgb565a8;
+    term indexed8;
+    term rle565;
+    term update;
+    term nearest;
+    term bilinear;
+    term scroll_area;
+    term image_ref;
+};
+
+static struct DisplayAtoms display_atoms;
+
+static inline void display_atoms_init(GlobalContext *global)
+{
+    display_atoms.image = globalcontext_make_atom(global, ATOM_STR("\x5", "image"));
+    display_atoms.scaled_cropped_image = globalcontext_make_atom(global, ATOM_STR("\x14", "scaled_cropped_image"));
+    display_atoms.rect = globalcontext_make_atom(global, ATOM_STR("\x4", "rect"));
+    display_atoms.text = globalcontext_make_atom(global, ATOM_STR("\x4", "text"));
+    display_atoms.transparent = globalcontext_make_atom(global, ATOM_STR("\xB", "transparent"));
+    display_atoms.default16px = globalcontext_make_atom(global, ATOM_STR("\xB", "default16px"));
+    display_atoms.rgba8888 = globalcontext_make_atom(global, ATOM_STR("\x8", "rgba8888"));
+    display_atoms.rgb565_be = globalcontext_make_atom(global, ATOM_STR("\x9", "rgb565_be"));
+    display_atoms.rgb565a8 = globalcontext_make_atom(global, ATOM_STR("\x8", "rgb565a8"));
+    display_atoms.indexed8 = globalcontext_make_atom(global, ATOM_STR("\x8", "indexed8"));
+    display_atoms.rle565 = globalcontext_make_atom(global, ATOM_STR("\x6", "rle565"));
+    display_atoms.update = globalcontext_make_atom(global, ATOM_STR("\x6", "update"));
+    display_atoms.nearest = globalcontext_make_atom(global, ATOM_STR("\x7", "nearest"));
+    display_atoms.bilinear = globalcontext_make_atom(global, ATOM_STR("\x8", "bilinear"));
+    display_atoms.scroll_area = globalcontext_make_atom(global, ATOM_STR("\xB", "scroll_area"));
+    display_atoms.image_ref = globalcontext_make_atom(global, ATOM_STR("\x9", "image_ref"));
+}
+
+static inline bool is_image_ref(term img)
+{
+    return term_is_tuple(img) && (term_get_tuple_arity(img) == 2)
+        && (term_get_tuple_element(img, 0) == display_atoms.image_ref);
+}
+
+static inline bool is_compressed_image(term img)
+{
+    return term_is_tuple(img) && (term_get_tuple_arity(img) >= 1)
+        && ((term_get_tuple_element(img, 0) == display_atoms.indexed8)
+            || (term_get_tuple_element(img, 0) == display_atoms.rle565));
+}
+
+// Palettes are expanded to 256 entries, so any index can be looked up without checking it, and
+// missing entries are transparent.
+static bool parse_indexed8_image(term img, struct FrameArena *arena, struct ImageDataWithSize *image,
+    size_t *owned_aux_size)
+{
+    term palette = term_get_tuple_element(img, 3);
+    term pix_binary = term_get_tuple_element(img, 4);
+    if (!term_is_binary(palette) || (term_binary_size(pix_binary) < (size_t) (image->width * image->height))) {
+        return false;
+    }
+    size_t palette_size = term_binary_size(palette);
+    if ((palette_size % 4 != 0) || (palette_size > 256 * 4)) {
+        return false;
+    }
+    image->pix = term_binary_data(pix_binary);
+
+    if (palette_size == 256 * 4) {
+        image->aux = term_binary_data(palette);
+        return true;
+    }
+    uint8_t *entries = frame_arena_alloc(arena, 256 * 4);
+    if (IS_NULL_PTR(entries)) {
+        return false;
+    }
+    memcpy(entries, term_binary_data(palette), palette_size);
+    memset(entries + palette_size, 0, 256 * 4 - palette_size);
+    image->aux = entries;
+    *owned_aux_size = 256 * 4;
+
+    return true;
+}
+
+#define RLE565_LITERAL 0
+#define RLE565_FILL 1
+#define RLE565_TRANSPARENT 2
+
+// Each packet starts with a header byte: its 2 upper bits are the packet kind, while the lower 6
+// bits are the number of pixels minus 1. Literal packets are followed by that many RGB565 pixels,
+// fill packets by a single one, and transparent packets by nothing. Packets never cross rows, so
+// the offset of each row is computed (and the whole binary validated) once here, and any row can
+// be decoded on its own.
+static bool parse_rle565_image(term img, struct FrameArena *arena, struct ImageDataWithSize *image,
+    size_t *owned_aux_size)
+{
+    term pix_binary = term_get_tuple_element(img, 3);
+    const uint8_t *data = (const uint8_t *) term_binary_data(pix_binary);
+    size_t size = term_binary_size(pix_binary);
+
+    uint32_t *rows = frame_arena_alloc(arena, sizeof(uint32_t) * image->height);
+    if (IS_NULL_PTR(rows) && image->height) {
+        return false;
+    }
+
+    size_t offset = 0;
+    for (int row = 0; row < image->height; row++) {
+        rows[row] = offset;
+        int row_len = 0;
+        while (row_len < image->width) {
+            if (offset >= size) {
+                return false;
+            }
+            uint8_t header = data[offset];
+            int count = (header & 0x3F) + 1;
+            switch (header >> 6) {
+                case RLE565_LITERAL:
+                    offset += 1 + count * 2;
+                    break;
+                case RLE565_FILL:
+                    offset += 3;
+                    break;
+                case RLE565_TRANSPARENT:
+                    offset += 1;
+                    break;
+                default:
+                    return false;
+            }
+            row_len += count;
+        }
+        if ((row_len != image->width) || (offset > size)) {
+            return false;
+        }
+    }
+
+    image->pix = (const char *) data;
+    image->aux = rows;
+    *owned_aux_size = sizeof(uint32_t) * image->height;
+
+    return true;
+}
+
+// Both image tuples and {image_ref, Handle} tuples are accepted. Compressed images allocate their
+// lookup tables from arena, that must not be NULL for them.
+static bool parse_image_tuple(term img, Context *ctx, struct FrameArena *arena, struct ImageDataWithSize *image,
+    size_t *owned_aux_size)
+{
+    image->aux = NULL;
+    *owned_aux_size = 0;
+
+    if (is_image_ref(img)) {
+        struct ImageCacheEntry *entry = image_cache_find(term_get_tuple_element(img, 1));
+        if (!entry) {
+            fprintf(stderr, "image not found in cache: ");
+            term_display(stderr, img, ctx);
+            fprintf(stderr, "\n");
+            return false;
+        }
+        image->format = entry->format;
+        image->width = entry->width;
+        image->height = entry->height;
+        image->pix = (const char *) entry->pix;
+        return true;
+    }
+
+    int arity = term_is_tuple(img) ? term_get_tuple_arity(img) : 0;
+    int expected_arity = (arity >= 1) && (term_get_tuple_element(img, 0) == display_atoms.indexed8) ? 5 : 4;
+    if ((arity != expected_arity) || !term_is_binary(term_get_tuple_element(img, arity - 1))) {
+        fprintf(stderr, "invalid image: ");
+        term_display(stderr, img, ctx);
+        fprintf(stderr, "\n");
+        return false;
+    }
+
+    term format_atom = term_get_tuple_element(img, 0);
+    if (format_atom == display_atoms.rgba8888) {
+        image->format = FormatRGBA8888;
+    } else if (format_atom == display_atoms.rgb565_be) {
+        image->format = FormatRGB565BE;
+    } else if (format_atom == display_atoms.rgb565a8) {
+        image->format = FormatRGB565A8;
+    } else if (format_atom == display_atoms.indexed8) {
+        image->format = FormatIndexed8;
+    } else if (format_atom == display_atoms.rle565) {
+        image->format = FormatRLE565;
+    } else {
+        fprintf(stderr, "unsupported image format: ");
+        term_display(stderr, format_atom, ctx);
+        fprintf(stderr, "\n");
+        return false;
+    }
+
+    image->width = term_to_int(term_get_tuple_element(img, 1));
+    image->height = term_to_int(term_get_tuple_element(img, 2));
+    if ((image->width < 0) || (image->height < 0)) {
+        fprintf(stderr, "invalid image size: %i x %i.\n", image->width, image->height);
+        return false;
+    }
+
+    if ((image->format == FormatIndexed8) || (image->format == FormatRLE565)) {
+        bool valid = arena
+            && ((image->format == FormatIndexed8) ? parse_indexed8_image(img, arena, image, owned_aux_size)
+                                                  : parse_rle565_image(img, arena, image, owned_aux_size));
+        if (!valid) {
+            fprintf(stderr, "invalid compressed image: ");
+            term_display(stderr, format_atom, ctx);
+            fprintf(stderr, " %i x %i.\n", image->width, image->height);
+        }
+        return valid;
+    }
+
+    term pix_binary = term_get_tuple_element(img, 3);
+    if (term_binary_size(pix_binary) < (size_t) (image->width * image->height * image_format_bytes_per_pixel(image->format))) {
+        fprintf(stderr, "image binary is too small: %i x %i.\n", image->width, image->height);
+        return false;
+    }
+    image->pix = term_binary_data(pix_binary);
+
+    return true;
+}
+
+// Scale factors can be either integers or floats, they are turned into a 16.16 fixed point step
+// that is rounded up, so integer factors map exactly to the same source pixels of integer math.
+static bool parse_scale_factor(term t, int32_t *step)
+{
+    double scale;
+    if (term_is_integer(t)) {
+        scale = term_to_int(t);
+    } else if (term_is_float(t)) {
+        scale = term_to_float(t);
+    } else {
+        return false;
+    }
+    // it also rejects NaN
+    if (!(scale >= 1.0 / 256.0) || (scale > 65536.0)) {
+        return false;
+    }
+
+    double fixed_step = 65536.0 / scale;
+    *step = (int32_t) fixed_step;
+    if (*step < fixed_step) {
+        (*step)++;
+    }
+
+    return true;
+}
+
+// Copies an image tuple into the image cache, unless handle is already cached (cached images never
+// change, a new handle must be used for a new image). When *evicted is set the previous display
+// list must be forgotten.
+static inline bool cache_image_tuple(term handle, term img, Context *ctx, bool *evicted)
+{
+    *evicted = false;
+    if (image_cache_lookup(handle)) {
+        return true;
+    }
+
+    // cached pixels might be evicted while they are copied
+    if (is_image_ref(img) || is_compressed_image(img)) {
+        return false;
+    }
+    struct ImageDataWithSize image;
+    size_t owned_aux_size;
+    if (!parse_image_tuple(img, ctx, NULL, &image, &owned_aux_size)) {
+        return false;
+    }
+
+    size_t size = image.width * image.height * image_format_bytes_per_pixel(image.format);
+    struct ImageCacheEntry *entry = image_cache_alloc(handle, image.format, image.width, image.height, size, evicted);
+    if (IS_NULL_PTR(entry)) {
+        fprintf(stderr, "image does not fit in cache: %i bytes.\n", (int) size);
+        return false;
+    }
+    memcpy(entry->pix, image.pix, size);
+
+    return true;
+}
+
+// Returns a NUL terminated copy of a binary or a charlist, or NULL when t is not a valid string.
+static char *term_to_arena_string(term t, struct FrameArena *arena)
 {
+    size_t len;
+    if (interop_iolist_size(t, &len) != InteropOk) {
+        return NULL;
+    }
+
+    char *str = frame_arena_alloc(arena, len + 1);
+    if (IS_NULL_PTR(str) || (interop_write_iolist(t, str) != InteropOk)) {
+        return NULL;
+    }
+    str[len] = '\0';
+
+    return str;
+}
+
+static void init_invalid_item(BaseDisplayItem *item)
+{
+    item->primitive = Invalid;
+    item->x = -1;
+    item->y = -1;
+    item->width = 1;
+    item->height = 1;
+    item->owned_aux_size = 0;
+}
+
+// Any memory required by item is allocated from arena, so it is released when the arena is reset.
+static void init_item(BaseDisplayItem *item, term req, Context *ctx, struct FrameArena *arena)
+{
+    item->source = req;
+    item->owned_pix_size = 0;
+    item->owned_aux_size = 0;
+
     term cmd = term_get_tuple_element(req, 0);
 
-    if (cmd == context_make_atom(ctx, "\x5"
-                                      "image")) {
+    if (cmd == display_atoms.image) {
         item->primitive = Image;
         item->x = term_to_int(term_get_tuple_element(req, 1));
         item->y = term_to_int(term_get_tuple_element(req, 2));
 
         term bgcolor = term_get_tuple_element(req, 3);
-        if (bgcolor == context_make_atom(ctx, "\xB"
-                                              "transparent")) {
+        if (bgcolor == display_atoms.transparent) {
             item->brcolor = 0;
         } else {
             item->brcolor = ((uint32_t) term_to_int(bgcolor)) << 8 | 0xFF;
         }
 
         term img = term_get_tuple_element(req, 4);
-
-        term format = term_get_tuple_element(img, 0);
-        if (format != context_make_atom(ctx, "\x8"
-                                             "rgba8888")) {
-            fprintf(stderr, "unsupported image format: ");
-            term_display(stderr, format, ctx);
-            fprintf(stderr, "\n");
+        struct ImageDataWithSize image;
+        if (!parse_image_tuple(img, ctx, arena, &image, &item->owned_aux_size)) {
+            init_invalid_item(item);
             return;
         }
-        item->width = term_to_int(term_get_tuple_element(img, 1));
-        item->height = term_to_int(term_get_tuple_element(img, 2));
-        item->data.image_data.pix = term_binary_data(term_get_tuple_element(img, 3));
+        item->width = image.width;
+        item->height = image.height;
+        item->data.image_data.pix = image.pix;
+        item->data.image_data.format = image.format;
+        item->data.image_data.aux = image.aux;
 
-    } else if (cmd == globalcontext_make_atom(ctx->global, ATOM_STR("\x14", "scaled_cropped_image"))) {
+    } else if (cmd == display_atoms.scaled_cropped_image) {
         item->primitive = ScaledCroppedImage;
         item->x = term_to_int(term_get_tuple_element(req, 1));
         item->y = term_to_int(term_get_tuple_element(req, 2));
@@ -118,8 +594,7 @@ static void init_item(BaseDisplayItem *item, term req, Context *ctx)
         item->height = term_to_int(term_get_tuple_element(req, 4));
 
         term bgcolor = term_get_tuple_element(req, 5);
-        if (bgcolor == globalcontext_make_atom(ctx->global, "\xB"
-                                              "transparent")) {
+        if (bgcolor == display_atoms.transparent) {
             item->brcolor = 0;
         } else {
             item->brcolor = ((uint32_t) term_to_int(bgcolor)) << 8 | 0xFF;
@@ -127,27 +602,42 @@ static void init_item(BaseDisplayItem *item, term req, Context *ctx)
 
         item->source_x = term_to_int(term_get_tuple_element(req, 6));
         item->source_y = term_to_int(term_get_tuple_element(req, 7));
-        item->x_scale = term_to_int(term_get_tuple_element(req, 8));
-        item->y_scale = term_to_int(term_get_tuple_element(req, 9));
+        if (!parse_scale_factor(term_get_tuple_element(req, 8), &item->x_step)
+            || !parse_scale_factor(term_get_tuple_element(req, 9), &item->y_step)) {
+            fprintf(stderr, "invalid scale factor: ");
+            term_display(stderr, req, ctx);
+            fprintf(stderr, "\n");
+            init_invalid_item(item);
+            return;
+        }
 
-        // 10th element is for opts, but right now no opts are supported
+        term opts = term_get_tuple_element(req, 10);
+        term filter = interop_kv_get_value_default(opts, ATOM_STR("\x6", "filter"), display_atoms.nearest, ctx->global);
+        if (filter == display_atoms.nearest) {
+            item->filter = FilterNearest;
+        } else if (filter == display_atoms.bilinear) {
+            item->filter = FilterBilinear;
+        } else {
+            fprintf(stderr, "unsupported filter: ");
+            term_display(stderr, filter, ctx);
+            fprintf(stderr, "\n");
+            init_invalid_item(item);
+            return;
+        }
 
         term img = term_get_tuple_element(req, 11);
-
-        term format = term_get_tuple_element(img, 0);
-        if (format != globalcontext_make_atom(ctx->global, "\x8"
-                                             "rgba8888")) {
-            fprintf(stderr, "unsupported image format: ");
-            term_display(stderr, format, ctx);
-            fprintf(stderr, "\n");
+        if (!parse_image_tuple(img, ctx, arena, &item->data.image_data_with_size, &item->owned_aux_size)) {
+            init_invalid_item(item);
+            return;
+        }
+        // run length encoded rows cannot be randomly accessed
+        if (item->data.image_data_with_size.format == FormatRLE565) {
+            fprintf(stderr, "rle565 images cannot be scaled.\n");
+            init_invalid_item(item);
             return;
         }
-        item->data.image_data_with_size.width = term_to_int(term_get_tuple_element(img, 1));
-        item->data.image_data_with_size.height = term_to_int(term_get_tuple_element(img, 2));
-        item->data.image_data_with_size.pix = term_binary_data(term_get_tuple_element(img, 3));
 
-    } else if (cmd == context_make_atom(ctx, "\x4"
-                                             "rect")) {
+    } else if (cmd == display_atoms.rect) {
         item->primitive = Rect;
         item->x = term_to_int(term_get_tuple_element(req, 1));
         item->y = term_to_int(term_get_tuple_element(req, 2));
@@ -155,30 +645,28 @@ static void init_item(BaseDisplayItem *item, term req, Context *ctx)
         item->height = term_to_int(term_get_tuple_element(req, 4));
         item->brcolor = term_to_int(term_get_tuple_element(req, 5)) << 8 | 0xFF;
 
-    } else if (cmd == context_make_atom(ctx, "\x4"
-                                             "text")) {
+    } else if (cmd == display_atoms.text) {
         item->x = term_to_int(term_get_tuple_element(req, 1));
         item->y = term_to_int(term_get_tuple_element(req, 2));
         uint32_t fgcolor = term_to_int(term_get_tuple_element(req, 4)) << 8 | 0xFF;
         uint32_t brcolor;
         term bgcolor = term_get_tuple_element(req, 5);
-        if (bgcolor == globalcontext_make_atom(ctx->global, "\xB"
-                                              "transparent")) {
+        if (bgcolor == display_atoms.transparent) {
             brcolor = 0;
         } else {
             brcolor = ((uint32_t) term_to_int(bgcolor)) << 8 | 0xFF;
         }
         term text_term = term_get_tuple_element(req, 6);
-        int ok;
-        char *text = interop_term_to_string(text_term, &ok);
-        if (!ok) {
+        char *text = term_to_arena_string(text_term, arena);
+        if (IS_NULL_PTR(text)) {
             fprintf(stderr, "invalid text.\n");
+            init_invalid_item(item);
             return;
         }
 
         term font = term_get_tuple_element(req, 3);
 
-        if (font == globalcontext_make_atom(ctx->global, "\xB" "default16px")) {
+        if (font == display_atoms.default16px) {
             item->primitive = Text;
             item->height = 16;
             item->width = strlen(text) * 8;
@@ -197,32 +685,17 @@ static void init_item(BaseDisplayItem *item, term req, Context *ctx)
                 fprintf(stderr, "unsupported font: ");
                 term_display(stderr, font, ctx);
                 fprintf(stderr, "\n");
+                init_invalid_item(item);
                 return;
             }
 
-            EpdFontProperties props = epd_font_properties_default();
-            EpdRect rect = epd_get_string_rect(loaded_font, text, 0, 0, 0, &props);
-
-            struct Surface surface;
-            surface.width = rect.width;
-            surface.height = rect.height;
-            surface.buffer = malloc(rect.width * rect.height * BPP);
-            memset(surface.buffer, 0, rect.width * rect.height * BPP);
-            int text_x = 0;
-            int text_y = loaded_font->ascender;
-            enum EpdDrawError res = epd_write_default(loaded_font, text, &text_x, &text_y, &surface);
-            free(text);
-            if (res != EPD_DRAW_SUCCESS) {
-                fprintf(stderr, "Failed to draw text. Error code: %i\n", res);
+            if (!init_glyph_run(item, loaded_font, text, arena)) {
+                fprintf(stderr, "Failed to lay out text.\n");
+                init_invalid_item(item);
                 return;
             }
-
-            item->primitive = Image;
-            item->width = surface.width;
-            item->height = surface.height;
-            item->brcolor = 0;
-            //FIXME: surface buffer leak
-            item->data.image_data.pix = surface.buffer;
+            item->brcolor = brcolor;
+            item->data.glyph_run_data.fgcolor = fgcolor;
 #else
             fprintf(stderr, "unsupported font: ");
             term_display(stderr, font, ctx);
@@ -237,40 +710,177 @@ static void init_item(BaseDisplayItem *item, term req, Context *ctx)
 #endif
         }
 
+    } else if (cmd == display_atoms.scroll_area) {
+        item->primitive = ScrollArea;
+        // it has no pixels, so it is neither drawn nor damaged
+        item->x = 0;
+        item->y = 0;
+        item->width = 0;
+        item->height = 0;
+        item->brcolor = 0;
+        item->data.scroll_area_data.top = term_to_int(term_get_tuple_element(req, 1));
+        item->data.scroll_area_data.height = term_to_int(term_get_tuple_element(req, 2));
+        item->data.scroll_area_data.offset = term_to_int(term_get_tuple_element(req, 3));
+
     } else {
         fprintf(stderr, "unexpected display list command: ");
         term_display(stderr, req, ctx);
         fprintf(stderr, "\n");
 
-        item->primitive = Invalid;
-        item->x = -1;
-        item->y = -1;
-        item->width = 1;
-        item->height = 1;
+        init_invalid_item(item);
     }
 }
 
-static void destroy_items(BaseDisplayItem *items, int items_count)
+// Compares display list terms that belong to different messages. Big binaries are shared by
+// messages, so they are compared by identity, and pixel data is never compared byte by byte.
+// Small binaries are compared by content only when allow_memcmp is true: items that keep pointers
+// into their binaries must not be retained from a binary of the previous message, since it is
+// going to be disposed.
+#define ITEM_TERM_MAX_MEMCMP_SIZE 64
+
+static bool item_terms_equal(term a, term b, bool allow_memcmp)
 {
-    for (int i = 0; i < items_count; i++) {
-        BaseDisplayItem *item = &items[i];
+    if (a == b) {
+        return true;
+    }
 
-        switch (item->primitive) {
-            case Image:
-                break;
+    if (term_is_tuple(a)) {
+        int arity = term_get_tuple_arity(a);
+        if (!term_is_tuple(b) || (term_get_tuple_arity(b) != arity)) {
+            return false;
+        }
+        for (int i = 0; i < arity; i++) {
+            if (!item_terms_equal(term_get_tuple_element(a, i), term_get_tuple_element(b, i), allow_memcmp)) {
+                return false;
+            }
+        }
+        return true;
 
-            case Rect:
-                break;
+    } else if (term_is_binary(a)) {
+        if (!term_is_binary(b) || (term_binary_size(a) != term_binary_size(b))) {
+            return false;
+        }
+        size_t size = term_binary_size(a);
+        const char *a_data = term_binary_data(a);
+        const char *b_data = term_binary_data(b);
+        return (a_data == b_data)
+            || (allow_memcmp && (size <= ITEM_TERM_MAX_MEMCMP_SIZE) && !memcmp(a_data, b_data, size));
+
+    } else if (term_is_nonempty_list(a)) {
+        while (term_is_nonempty_list(a) && term_is_nonempty_list(b)) {
+            if (!item_terms_equal(term_get_list_head(a), term_get_list_head(b), allow_memcmp)) {
+                return false;
+            }
+            a = term_get_list_tail(a);
+            b = term_get_list_tail(b);
+        }
+        return item_terms_equal(a, b, allow_memcmp);
+    }
 
-            case Text:
-                free((char *) item->data.text_data.text);
-                break;
+    return false;
+}
 
-            default: {
-                break;
+// Image pixels (and full palettes) are not copied into the arena, they point into the binaries of
+// the display list. Text and glyphs are copied when an item is retained.
+static inline bool item_references_term_data(const BaseDisplayItem *item)
+{
+    return (item->primitive == Image) || (item->primitive == ScaledCroppedImage);
+}
+
+// Copies an item of the previous display list, together with the memory it owns, since the
+// arena of the previous display list is going to be reset.
+static bool retain_item(BaseDisplayItem *item, const BaseDisplayItem *prev, term source, struct FrameArena *arena)
+{
+    *item = *prev;
+    item->source = source;
+
+    if (item->primitive == Text) {
+        size_t size = strlen(prev->data.text_data.text) + 1;
+        char *text = frame_arena_alloc(arena, size);
+        if (IS_NULL_PTR(text)) {
+            return false;
+        }
+        memcpy(text, prev->data.text_data.text, size);
+        item->data.text_data.text = text;
+
+    } else if (item->primitive == GlyphRun) {
+        size_t size = sizeof(struct PlacedGlyph) * prev->data.glyph_run_data.glyphs_count;
+        struct PlacedGlyph *glyphs = frame_arena_alloc(arena, size);
+        if (IS_NULL_PTR(glyphs) && size) {
+            return false;
+        }
+        memcpy(glyphs, prev->data.glyph_run_data.glyphs, size);
+        item->data.glyph_run_data.glyphs = glyphs;
+
+    } else if (item->owned_pix_size) {
+        char *pix = frame_arena_alloc(arena, item->owned_pix_size);
+        if (IS_NULL_PTR(pix)) {
+            return false;
+        }
+        memcpy(pix, prev->data.image_data.pix, item->owned_pix_size);
+        item->data.image_data.pix = pix;
+    }
+
+    if (item->owned_aux_size) {
+        void *aux = frame_arena_alloc(arena, item->owned_aux_size);
+        if (IS_NULL_PTR(aux)) {
+            return false;
+        }
+        if (item->primitive == Image) {
+            memcpy(aux, prev->data.image_data.aux, item->owned_aux_size);
+            item->data.image_data.aux = aux;
+        } else {
+            memcpy(aux, prev->data.image_data_with_size.aux, item->owned_aux_size);
+            item->data.image_data_with_size.aux = aux;
+        }
+    }
+
+    return true;
+}
+
+// Builds all items of display_list. When prev_items is not NULL, items that did not change since
+// the previous display list are copied from it instead of being parsed (and rasterized) again.
+// Unchanged items are looked up in order, and a single inserted or removed item is tolerated.
+static inline BaseDisplayItem *init_items(term display_list, int *items_len, const BaseDisplayItem *prev_items,
+    int prev_items_len, Context *ctx, struct FrameArena *arena)
+{
+    int proper;
+    int len = term_list_length(display_list, &proper);
+
+    BaseDisplayItem *items = frame_arena_alloc(arena, sizeof(BaseDisplayItem) * len);
+    if (IS_NULL_PTR(items)) {
+        *items_len = 0;
+        return NULL;
+    }
+
+    int j = 0;
+    term t = display_list;
+    for (int i = 0; i < len; i++) {
+        term req = term_get_list_head(t);
+        t = term_get_list_tail(t);
+
+        bool retained = false;
+        if (prev_items) {
+            for (int k = j; (k < prev_items_len) && (k <= j + 1); k++) {
+                // invalid items are parsed again, since they might be valid now (such as image
+                // refs to images that have been cached in the meantime)
+                if (prev_items[k].primitive == Invalid) {
+                    continue;
+                }
+                bool allow_memcmp = !item_references_term_data(&prev_items[k]);
+                if (item_terms_equal(req, prev_items[k].source, allow_memcmp)) {
+                    retained = retain_item(&items[i], &prev_items[k], req, arena);
+                    j = k + 1;
+                    break;
+                }
             }
         }
+
+        if (!retained) {
+            init_item(&items[i], req, ctx, arena);
+        }
     }
 
-    free(items);
+    *items_len = len;
+    return items;
 }
@@ -0,0 +1,234 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Queue between the port native handler and the display task.
+//
+// When update coalescing is enabled an update that is followed by another one in the queue is
+// never rendered: it is just acknowledged, so only the latest display list is drawn. Messages
+// are never reordered, so an update is not coalesced across other requests (e.g. draw_buffer).
+//
+// display_items.h must be included before this file.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include <context.h>
+#include <defaultatoms.h>
+#include <globalcontext.h>
+#include <interop.h>
+#include <mailbox.h>
+#include <port.h>
+#include <term.h>
+
+#include "display_stats.h"
+
+#define DISPLAY_MESSAGES_QUEUE_LEN 32
+
+static QueueHandle_t display_messages_queue;
+static GlobalContext *display_messages_global;
+static bool display_messages_coalesce_updates;
+
+// dropped is updated by the native handler, while coalesced only by the display task
+static atomic_uint display_messages_dropped;
+static unsigned int display_messages_coalesced;
+
+static bool display_messages_init(term opts, GlobalContext *global)
+{
+    display_messages_queue = xQueueCreate(DISPLAY_MESSAGES_QUEUE_LEN, sizeof(Message *));
+    display_messages_global = global;
+    atomic_init(&display_messages_dropped, 0);
+    display_messages_coalesced = 0;
+
+    term coalesce = interop_kv_get_value_default(opts, ATOM_STR("\x10", "coalesce_updates"), FALSE_ATOM, global);
+    display_messages_coalesce_updates = (coalesce == TRUE_ATOM);
+
+    return (coalesce == TRUE_ATOM) || (coalesce == FALSE_ATOM);
+}
+
+static void display_messages_dispose(Message *message, GlobalContext *global)
+{
+    BEGIN_WITH_STACK_HEAP(1, temp_heap);
+    mailbox_message_dispose(&message->base, &temp_heap);
+    END_WITH_STACK_HEAP(temp_heap, global);
+}
+
+static void display_messages_send(term pid, term message, GlobalContext *global)
+{
+    int local_process_id = term_to_local_process_id(pid);
+    globalcontext_send_message(global, local_process_id, message);
+}
+
+static void display_messages_enqueue(Message *message)
+{
+    if (xQueueSend(display_messages_queue, &message, 1) != pdTRUE) {
+        // the sender will never get a reply, but at least the message is not leaked
+        atomic_fetch_add(&display_messages_dropped, 1);
+        display_messages_dispose(message, display_messages_global);
+    }
+}
+
+static bool display_messages_is_update(Message *message)
+{
+    GenMessage gen_message;
+    if (port_parse_gen_message(message->message, &gen_message) != GenCallMessage) {
+        return false;
+    }
+
+    term req = gen_message.req;
+    return term_is_tuple(req) && (term_get_tuple_arity(req) >= 2)
+        && (term_get_tuple_element(req, 0) == display_atoms.update);
+}
+
+static void display_messages_reply_ok(Message *message, GlobalContext *global)
+{
+    GenMessage gen_message;
+    port_parse_gen_message(message->message, &gen_message);
+
+    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(2) + REF_SIZE, heap);
+    term return_tuple = term_alloc_tuple(2, &heap);
+    term_put_tuple_element(return_tuple, 0, gen_message.ref);
+    term_put_tuple_element(return_tuple, 1, OK_ATOM);
+
+    display_messages_send(gen_message.pid, return_tuple, global);
+    END_WITH_STACK_HEAP(heap, global);
+}
+
+// Blocks until a message is available, or returns NULL once timeout ticks have elapsed.
+// Superseded updates are acknowledged and disposed here.
+static Message *display_messages_receive_timeout(TickType_t timeout)
+{
+    GlobalContext *global = display_messages_global;
+
+    Message *message;
+    if (xQueueReceive(display_messages_queue, &message, timeout) != pdTRUE) {
+        return NULL;
+    }
+    DISPLAY_STATS_MAX(max_queue_depth, uxQueueMessagesWaiting(display_messages_queue) + 1);
+
+    if (!display_messages_coalesce_updates || !display_messages_is_update(message)) {
+        return message;
+    }
+
+    Message *next;
+    while ((xQueuePeek(display_messages_queue, &next, 0) == pdTRUE)
+        && display_messages_is_update(next)) {
+        xQueueReceive(display_messages_queue, &next, 0);
+        display_messages_reply_ok(message, global);
+        display_messages_dispose(message, global);
+        display_messages_coalesced++;
+        message = next;
+    }
+
+    return message;
+}
+
+static Message *display_messages_receive(void)
+{
+    return display_messages_receive_timeout(portMAX_DELAY);
+}
+
+static term display_messages_prepend_stat(term stats, AtomString name, int64_t value, Heap *heap,
+    GlobalContext *global)
+{
+    term stat = term_alloc_tuple(2, heap);
+    term_put_tuple_element(stat, 0, globalcontext_make_atom(global, name));
+    term_put_tuple_element(stat, 1, term_make_maybe_boxed_int64(value, heap));
+
+    return term_list_prepend(stat, stats, heap);
+}
+
+#define DISPLAY_MESSAGES_STATS_SIZE \
+    (TUPLE_SIZE(2) + REF_SIZE + (2 + DISPLAY_STATS_TERMS) * (CONS_SIZE + TUPLE_SIZE(2) + BOXED_INT64_SIZE))
+
+// Replies to a get_stats call with a proplist. Frame stats are included only when they have been
+// compiled in.
+static void display_messages_send_stats(const GenMessage *gen_message, GlobalContext *global)
+{
+    BEGIN_WITH_STACK_HEAP(DISPLAY_MESSAGES_STATS_SIZE, heap);
+    term stats = term_nil();
+
+#if DISPLAY_STATS
+    stats = display_messages_prepend_stat(stats, ATOM_STR("\xF", "max_queue_depth"), display_stats.max_queue_depth, &heap, global);
+    stats = display_messages_prepend_stat(stats, ATOM_STR("\xD", "skipped_lines"), display_stats.skipped_lines, &heap, global);
+    stats = display_messages_prepend_stat(stats, ATOM_STR("\xA", "bytes_sent"), display_stats.bytes_sent, &heap, global);
+    stats = display_messages_prepend_stat(stats, ATOM_STR("\x10", "transfer_wait_us"), display_stats.transfer_wait_us, &heap, global);
+    stats = display_messages_prepend_stat(stats, ATOM_STR("\x9", "raster_us"), display_stats.raster_us, &heap, global);
+    stats = display_messages_prepend_stat(stats, ATOM_STR("\x8", "parse_us"), display_stats.parse_us, &heap, global);
+    stats = display_messages_prepend_stat(stats, ATOM_STR("\x6", "frames"), display_stats.frames, &heap, global);
+#endif
+    stats = display_messages_prepend_stat(stats, ATOM_STR("\x9", "coalesced"), display_messages_coalesced, &heap, global);
+    stats = display_messages_prepend_stat(stats, ATOM_STR("\x7", "dropped"), atomic_load(&display_messages_dropped), &heap, global);
+
+    term return_tuple = term_alloc_tuple(2, &heap);
+    term_put_tuple_element(return_tuple, 0, gen_message->ref);
+    term_put_tuple_element(return_tuple, 1, stats);
+
+    display_messages_send(gen_message->pid, return_tuple, global);
+    END_WITH_STACK_HEAP(heap, global);
+}
+
+// Handles a reset_stats call, drivers reset their own counters (such as SPI ones) too.
+static void display_messages_reset_stats(void)
+{
+    atomic_store(&display_messages_dropped, 0);
+    display_messages_coalesced = 0;
+    display_stats_reset();
+}
+
+// Replies to a call with an immediate term, such as an atom.
+static void display_messages_send_reply(const GenMessage *gen_message, term value, GlobalContext *global)
+{
+    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(2) + REF_SIZE, heap);
+    term return_tuple = term_alloc_tuple(2, &heap);
+    term_put_tuple_element(return_tuple, 0, gen_message->ref);
+    term_put_tuple_element(return_tuple, 1, value);
+
+    display_messages_send(gen_message->pid, return_tuple, global);
+    END_WITH_STACK_HEAP(heap, global);
+}
+
+// Tells a draw_dma_buffer caller that the buffer at addr_low, addr_high (as they have been
+// received) has been sent, so it can be reused.
+static void display_messages_send_dma_buffer_done(term pid, term addr_low, term addr_high, GlobalContext *global)
+{
+    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(3), heap);
+    term done_tuple = term_alloc_tuple(3, &heap);
+    term_put_tuple_element(done_tuple, 0, globalcontext_make_atom(global, ATOM_STR("\xF", "dma_buffer_done")));
+    term_put_tuple_element(done_tuple, 1, addr_low);
+    term_put_tuple_element(done_tuple, 2, addr_high);
+
+    display_messages_send(pid, done_tuple, global);
+    END_WITH_STACK_HEAP(heap, global);
+}
+
+// Replies to a cache_stats call with a proplist.
+static void display_messages_send_image_cache_stats(const GenMessage *gen_message, GlobalContext *global)
+{
+    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(2) + REF_SIZE + IMAGE_CACHE_STATS_SIZE, heap);
+    term return_tuple = term_alloc_tuple(2, &heap);
+    term_put_tuple_element(return_tuple, 0, gen_message->ref);
+    term_put_tuple_element(return_tuple, 1, image_cache_stats(&heap, global));
+
+    display_messages_send(gen_message->pid, return_tuple, global);
+    END_WITH_STACK_HEAP(heap, global);
+}
@@ -0,0 +1,342 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Pipelined mode: the renderer task fills bands and a transmitter task, usually pinned to the
+// other core, sends them. The two tasks communicate through a couple of lock-free single producer
+// single consumer rings: one for commands (renderer -> transmitter) and one for free bands
+// (transmitter -> renderer). Task notifications are used only for sleeping when a ring is full or
+// empty.
+//
+// The driver must define the following before including this file:
+// - struct SPI, with a struct SPIDisplay spi_disp field
+// - void begin_ram_write(struct SPI *spi, int x, int y, int width, int height): sets the paint
+//   area and starts a memory write
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <globalcontext.h>
+#include <interop.h>
+#include <term.h>
+
+#include "spi_display.h"
+
+// it must be a power of 2
+#define PIPELINE_RING_SIZE 16
+
+enum PipelineCommandType
+{
+    PipelineWindow,
+    PipelineBand,
+    PipelineEndWindow,
+    PipelineSync
+};
+
+struct PipelineCommand
+{
+    enum PipelineCommandType type;
+    int x;
+    int y;
+    int width;
+    int height;
+    uint16_t *band;
+    int len;
+};
+
+struct PipelineConfig
+{
+    bool enabled;
+    BaseType_t renderer_core;
+    UBaseType_t renderer_priority;
+    BaseType_t transmitter_core;
+    UBaseType_t transmitter_priority;
+};
+
+struct SPSCRing
+{
+    struct PipelineCommand slots[PIPELINE_RING_SIZE];
+    // head is written only by the producer, tail only by the consumer
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+};
+
+struct DisplayPipeline
+{
+    struct SPSCRing commands;
+    struct SPSCRing free_bands;
+    TaskHandle_t renderer;
+    TaskHandle_t transmitter;
+    atomic_bool synced;
+};
+
+static bool pipeline_core_from_opts(term opts, AtomString key, BaseType_t *core, GlobalContext *glb)
+{
+    term value = interop_kv_get_value(opts, key, glb);
+    if (value == term_invalid_term()) {
+        return true;
+    }
+    if (!term_is_integer(value) || (term_to_int(value) < 0) || (term_to_int(value) >= portNUM_PROCESSORS)) {
+        return false;
+    }
+    *core = term_to_int(value);
+
+    return true;
+}
+
+static bool pipeline_priority_from_opts(term opts, AtomString key, UBaseType_t *priority, GlobalContext *glb)
+{
+    term value = interop_kv_get_value(opts, key, glb);
+    if (value == term_invalid_term()) {
+        return true;
+    }
+    if (!term_is_integer(value) || (term_to_int(value) < 1) || (term_to_int(value) >= configMAX_PRIORITIES)) {
+        return false;
+    }
+    *priority = term_to_int(value);
+
+    return true;
+}
+
+// Defaults keep the previous behaviour: a single unpinned task with priority 1.
+static bool pipeline_parse_config(struct PipelineConfig *config, term opts, GlobalContext *glb)
+{
+    term pipelined = interop_kv_get_value_default(opts, ATOM_STR("\x9", "pipelined"), FALSE_ATOM, glb);
+    if ((pipelined != TRUE_ATOM) && (pipelined != FALSE_ATOM)) {
+        return false;
+    }
+    config->enabled = (pipelined == TRUE_ATOM);
+    // single core chips, such as ESP32-S2 and ESP32-C3, have no core 1
+    config->renderer_core = (config->enabled && (portNUM_PROCESSORS > 1)) ? 1 : tskNO_AFFINITY;
+    config->renderer_priority = 1;
+    config->transmitter_core = 0;
+    config->transmitter_priority = 2;
+
+    return pipeline_core_from_opts(opts, ATOM_STR("\xD", "renderer_core"), &config->renderer_core, glb)
+        && pipeline_priority_from_opts(opts, ATOM_STR("\x11", "renderer_priority"), &config->renderer_priority, glb)
+        && pipeline_core_from_opts(opts, ATOM_STR("\x10", "transmitter_core"), &config->transmitter_core, glb)
+        && pipeline_priority_from_opts(opts, ATOM_STR("\x14", "transmitter_priority"), &config->transmitter_priority, glb);
+}
+
+static bool spsc_ring_push(struct SPSCRing *ring, const struct PipelineCommand *command)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == PIPELINE_RING_SIZE) {
+        return false;
+    }
+
+    ring->slots[head & (PIPELINE_RING_SIZE - 1)] = *command;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    return true;
+}
+
+static bool spsc_ring_pop(struct SPSCRing *ring, struct PipelineCommand *command)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) {
+        return false;
+    }
+
+    *command = ring->slots[tail & (PIPELINE_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+// Notifications are sticky, so a wake up that happens between a failed attempt and
+// ulTaskNotifyTake is not lost. Spurious wake ups just cause another attempt.
+static void spsc_ring_push_wait(struct SPSCRing *ring, const struct PipelineCommand *command, TaskHandle_t consumer)
+{
+    while (!spsc_ring_push(ring, command)) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    xTaskNotifyGive(consumer);
+}
+
+static void spsc_ring_pop_wait(struct SPSCRing *ring, struct PipelineCommand *command, TaskHandle_t producer)
+{
+    while (!spsc_ring_pop(ring, command)) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    xTaskNotifyGive(producer);
+}
+
+static void pipeline_release_band(struct DisplayPipeline *pipeline, const void *band)
+{
+    struct PipelineCommand command = {
+        .type = PipelineBand,
+        .band = (uint16_t *) band
+    };
+    spsc_ring_push_wait(&pipeline->free_bands, &command, pipeline->renderer);
+}
+
+struct PipelineTransmitterArgs
+{
+    struct SPI *spi;
+    struct DisplayPipeline *pipeline;
+};
+
+static void pipeline_transmitter_task(void *arg)
+{
+    struct PipelineTransmitterArgs *args = arg;
+    struct SPI *spi = args->spi;
+    struct DisplayPipeline *pipeline = args->pipeline;
+    free(args);
+
+    struct SPIDisplay *spi_disp = &spi->spi_disp;
+
+    while (true) {
+        struct PipelineCommand command;
+        spsc_ring_pop_wait(&pipeline->commands, &command, pipeline->renderer);
+
+        switch (command.type) {
+            case PipelineWindow:
+                begin_ram_write(spi, command.x, command.y, command.width, command.height);
+                spi_device_acquire_bus(spi_disp->handle, portMAX_DELAY);
+                break;
+
+            case PipelineBand:
+                if (spi_disp->pending_transactions == spi_disp->queue_size) {
+                    pipeline_release_band(pipeline, spi_display_wait_oldest(spi_disp));
+                }
+                spi_display_queue_dmawrite(spi_disp, command.len, command.band);
+                break;
+
+            case PipelineEndWindow:
+                while (spi_disp->pending_transactions > 0) {
+                    pipeline_release_band(pipeline, spi_display_wait_oldest(spi_disp));
+                }
+                spi_device_release_bus(spi_disp->handle);
+                break;
+
+            case PipelineSync:
+                atomic_store(&pipeline->synced, true);
+                xTaskNotifyGive(pipeline->renderer);
+                break;
+        }
+    }
+}
+
+// bands must be allocated by the caller, they are owned by the pipeline from now on
+static struct DisplayPipeline *pipeline_new(struct SPI *spi, uint16_t **bands, int bands_count,
+    const struct PipelineConfig *config)
+{
+    struct DisplayPipeline *pipeline = malloc(sizeof(struct DisplayPipeline));
+    struct PipelineTransmitterArgs *args = malloc(sizeof(struct PipelineTransmitterArgs));
+    if (IS_NULL_PTR(pipeline) || IS_NULL_PTR(args)) {
+        free(pipeline);
+        free(args);
+        return NULL;
+    }
+
+    atomic_init(&pipeline->commands.head, 0);
+    atomic_init(&pipeline->commands.tail, 0);
+    atomic_init(&pipeline->free_bands.head, 0);
+    atomic_init(&pipeline->free_bands.tail, 0);
+    atomic_init(&pipeline->synced, true);
+    // it is set by the renderer task when it starts
+    pipeline->renderer = NULL;
+
+    for (int i = 0; i < bands_count; i++) {
+        struct PipelineCommand command = {
+            .type = PipelineBand,
+            .band = bands[i]
+        };
+        spsc_ring_push(&pipeline->free_bands, &command);
+    }
+
+    args->spi = spi;
+    args->pipeline = pipeline;
+    if (xTaskCreatePinnedToCore(pipeline_transmitter_task, "display_tx", 4096, args, config->transmitter_priority,
+            &pipeline->transmitter, config->transmitter_core)
+        != pdPASS) {
+        free(pipeline);
+        free(args);
+        return NULL;
+    }
+
+    return pipeline;
+}
+
+// Following functions must be called only by the renderer task
+
+static inline void pipeline_set_renderer(struct DisplayPipeline *pipeline)
+{
+    pipeline->renderer = xTaskGetCurrentTaskHandle();
+}
+
+static void pipeline_begin_window(struct DisplayPipeline *pipeline, int x, int y, int width, int height)
+{
+    struct PipelineCommand command = {
+        .type = PipelineWindow,
+        .x = x,
+        .y = y,
+        .width = width,
+        .height = height
+    };
+    spsc_ring_push_wait(&pipeline->commands, &command, pipeline->transmitter);
+}
+
+static uint16_t *pipeline_take_band(struct DisplayPipeline *pipeline)
+{
+    struct PipelineCommand command;
+    spsc_ring_pop_wait(&pipeline->free_bands, &command, pipeline->transmitter);
+
+    return command.band;
+}
+
+static void pipeline_send_band(struct DisplayPipeline *pipeline, uint16_t *band, int len)
+{
+    struct PipelineCommand command = {
+        .type = PipelineBand,
+        .band = band,
+        .len = len
+    };
+    spsc_ring_push_wait(&pipeline->commands, &command, pipeline->transmitter);
+}
+
+static void pipeline_end_window(struct DisplayPipeline *pipeline)
+{
+    struct PipelineCommand command = {
+        .type = PipelineEndWindow
+    };
+    spsc_ring_push_wait(&pipeline->commands, &command, pipeline->transmitter);
+}
+
+// Waits until all previous commands have been executed, such as before using the bus directly.
+static void pipeline_sync(struct DisplayPipeline *pipeline)
+{
+    atomic_store(&pipeline->synced, false);
+
+    struct PipelineCommand command = {
+        .type = PipelineSync
+    };
+    spsc_ring_push_wait(&pipeline->commands, &command, pipeline->transmitter);
+
+    while (!atomic_load(&pipeline->synced)) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Frame timing and counters, that are reported by get_stats. They are compiled in only when
+// DISPLAY_STATS is 1, otherwise all following macros are no-ops, so hot paths do not pay for
+// them. Times are in microseconds, and they are measured with esp_timer_get_time.
+//
+// SPI transfers are accounted by spi_display (see struct SPIDisplay), drivers copy its counters
+// with DISPLAY_STATS_COLLECT_SPI before reporting them.
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef DISPLAY_STATS
+#define DISPLAY_STATS 0
+#endif
+
+#if DISPLAY_STATS
+#include <esp_timer.h>
+
+struct DisplayStats
+{
+    unsigned int frames;
+    // init_items, including damage tracking
+    int64_t parse_us;
+    // draw_x loops
+    int64_t raster_us;
+    // time spent waiting for transfers to complete
+    int64_t transfer_wait_us;
+    uint64_t bytes_sent;
+    // rows that have not been drawn, since they did not change
+    unsigned int skipped_lines;
+    // max number of messages in the display queue, including the one that is being received
+    unsigned int max_queue_depth;
+};
+
+#define DISPLAY_STATS_TERMS 7
+
+static struct DisplayStats display_stats;
+
+#define DISPLAY_STATS_START(name) int64_t name = esp_timer_get_time()
+#define DISPLAY_STATS_ADD_ELAPSED(field, start) (display_stats.field += esp_timer_get_time() - (start))
+#define DISPLAY_STATS_ADD(field, value) (display_stats.field += (value))
+#define DISPLAY_STATS_MAX(field, value)                                                   \
+    do {                                                                                  \
+        if ((unsigned int) (value) > display_stats.field) {                               \
+            display_stats.field = (value);                                                \
+        }                                                                                 \
+    } while (0)
+#define DISPLAY_STATS_COLLECT_SPI(spi_disp)                                               \
+    do {                                                                                  \
+        display_stats.bytes_sent = (spi_disp)->bytes_sent;                                \
+        display_stats.transfer_wait_us = (spi_disp)->transfer_wait_us;                    \
+    } while (0)
+#define DISPLAY_STATS_RESET_SPI(spi_disp)                                                 \
+    do {                                                                                  \
+        (spi_disp)->bytes_sent = 0;                                                       \
+        (spi_disp)->transfer_wait_us = 0;                                                 \
+    } while (0)
+
+static inline void display_stats_reset(void)
+{
+    memset(&display_stats, 0, sizeof(display_stats));
+}
+
+#else
+
+#define DISPLAY_STATS_TERMS 0
+
+#define DISPLAY_STATS_START(name)
+#define DISPLAY_STATS_ADD_ELAPSED(field, start) ((void) 0)
+#define DISPLAY_STATS_ADD(field, value) ((void) 0)
+#define DISPLAY_STATS_MAX(field, value) ((void) 0)
+#define DISPLAY_STATS_COLLECT_SPI(spi_disp) ((void) (spi_disp))
+#define DISPLAY_STATS_RESET_SPI(spi_disp) ((void) (spi_disp))
+
+static inline void display_stats_reset(void)
+{
+}
+
+#endif
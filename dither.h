@@ -0,0 +1,160 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Error diffusion for panels with few colors. Quantization errors are carried to next pixels
+// through 3 rows of per channel errors (current row and the 2 rows below it), that are rotated
+// when a new row begins, so no full frame buffer is needed.
+//
+// Pixels must be dithered in raster order, which is the order draw_x writes them with: a row that
+// does not follow the previous one (such as the first row of a new frame) clears all errors.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <globalcontext.h>
+#include <interop.h>
+#include <term.h>
+#include <utils.h>
+
+enum dither_mode
+{
+    // 4x4 Bayer matrix, it is stateless, so it is the default one
+    DitherOrdered = 0,
+    DitherFloydSteinberg,
+    DitherAtkinson
+};
+
+// pixels of padding before and after each row, Atkinson spreads errors up to x + 2
+#define ERROR_DIFFUSION_PADDING 2
+
+struct ErrorDiffusion
+{
+    enum dither_mode mode;
+    int width;
+    int channels;
+    // row that errors of rows[0] belong to
+    int ypos;
+    int16_t *buf;
+    int16_t *rows[3];
+};
+
+// Parses the dither option: ordered (the default), floyd_steinberg or atkinson.
+static bool dither_mode_from_opts(term opts, enum dither_mode *mode, GlobalContext *glb)
+{
+    term ordered = globalcontext_make_atom(glb, ATOM_STR("\x7", "ordered"));
+    term value = interop_kv_get_value_default(opts, ATOM_STR("\x6", "dither"), ordered, glb);
+
+    if (value == ordered) {
+        *mode = DitherOrdered;
+    } else if (value == globalcontext_make_atom(glb, ATOM_STR("\xF", "floyd_steinberg"))) {
+        *mode = DitherFloydSteinberg;
+    } else if (value == globalcontext_make_atom(glb, ATOM_STR("\x8", "atkinson"))) {
+        *mode = DitherAtkinson;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static inline size_t error_diffusion_row_size(const struct ErrorDiffusion *diffusion)
+{
+    return (diffusion->width + 2 * ERROR_DIFFUSION_PADDING) * diffusion->channels;
+}
+
+// Error buffers are allocated only when an error diffusion mode is selected.
+static bool error_diffusion_init(struct ErrorDiffusion *diffusion, enum dither_mode mode, int width, int channels)
+{
+    diffusion->mode = mode;
+    diffusion->width = width;
+    diffusion->channels = channels;
+    diffusion->ypos = -1;
+    diffusion->buf = NULL;
+
+    if (mode == DitherOrdered) {
+        return true;
+    }
+
+    size_t row_size = error_diffusion_row_size(diffusion);
+    diffusion->buf = calloc(3 * row_size, sizeof(int16_t));
+    if (IS_NULL_PTR(diffusion->buf)) {
+        return false;
+    }
+    for (int i = 0; i < 3; i++) {
+        diffusion->rows[i] = diffusion->buf + i * row_size + ERROR_DIFFUSION_PADDING * channels;
+    }
+
+    return true;
+}
+
+// Makes ypos the current row, it must be called before dithering each pixel.
+static inline void error_diffusion_seek(struct ErrorDiffusion *diffusion, int ypos)
+{
+    if (LIKELY(ypos == diffusion->ypos)) {
+        return;
+    }
+
+    size_t row_size = error_diffusion_row_size(diffusion);
+    if (ypos == diffusion->ypos + 1) {
+        int16_t *done = diffusion->rows[0];
+        diffusion->rows[0] = diffusion->rows[1];
+        diffusion->rows[1] = diffusion->rows[2];
+        diffusion->rows[2] = done;
+        memset(done - ERROR_DIFFUSION_PADDING * diffusion->channels, 0, row_size * sizeof(int16_t));
+    } else {
+        memset(diffusion->buf, 0, 3 * row_size * sizeof(int16_t));
+    }
+    diffusion->ypos = ypos;
+}
+
+// Returns value plus the error that has been carried to pixel x, clamped to 0 - 255.
+static inline int error_diffusion_apply(const struct ErrorDiffusion *diffusion, int x, int channel, int value)
+{
+    value += diffusion->rows[0][x * diffusion->channels + channel];
+
+    return (value < 0) ? 0 : ((value > 255) ? 255 : value);
+}
+
+// Spreads the quantization error of pixel x to the pixels that have not been dithered yet.
+static inline void error_diffusion_spread(struct ErrorDiffusion *diffusion, int x, int channel, int error)
+{
+    int c = diffusion->channels;
+    int16_t *row0 = diffusion->rows[0] + x * c + channel;
+    int16_t *row1 = diffusion->rows[1] + x * c + channel;
+
+    if (diffusion->mode == DitherFloydSteinberg) {
+        row0[c] += (error * 7) / 16;
+        row1[-c] += (error * 3) / 16;
+        row1[0] += (error * 5) / 16;
+        row1[c] += error / 16;
+    } else {
+        // Atkinson spreads just 3/4 of the error, so flat areas stay clean
+        int eighth = error / 8;
+        int16_t *row2 = diffusion->rows[2] + x * c + channel;
+        row0[c] += eighth;
+        row0[2 * c] += eighth;
+        row1[-c] += eighth;
+        row1[0] += eighth;
+        row1[c] += eighth;
+        row2[0] += eighth;
+    }
+}
@@ -1,7 +1,7 @@
 /*
  * This file is part of AtomGL.
  *
- * Copyright 2020-2022 Davide Bettio <davide@uninstall.it>
+ * Copyright 2020-2024 Davide Bettio <davide@uninstall.it>
  *
  * Licensed under the Apache License, Version 2.0 (the "License");
  * you may not use this file except in compliance with the License.
@@ -20,42 +20,736 @@
 
 #include <context.h>
 #include <stdint.h>
+#include <stdlib.h>
 
-static int draw_image_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item);
-static int draw_scaled_cropped_img_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item);
-static int draw_rect_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item);
-static int draw_text_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item);
+#include <utils.h>
 
-static int find_max_line_len(BaseDisplayItem *items, int count, int xpos, int ypos)
+// Pixel format back end, each driver defines the following before including this file:
+// - SurfaceColor: a color that is ready to be written to the line buffer
+// - SurfaceColor uint32_color_to_surface(uint32_t color): converts a RGBA8888 color
+// - void draw_pixel_x(uint8_t *line_buf, int xpos, int ypos, SurfaceColor color)
+// - SURFACE_ALPHA_BLEND: when set to 1, image pixels that are not fully opaque are blended with
+//   the item background using SurfaceColor alpha_blend_to_surface(uint32_t fg, uint32_t bg,
+//   uint8_t alpha), otherwise any pixel that is not fully transparent is drawn as opaque.
+// - SURFACE_SPAN_FUNCTIONS: when set to 1 the back end provides optimized span kernels:
+//   void fill_span_x(uint8_t *line_buf, int xpos, int ypos, int len, SurfaceColor color) and
+//   void rgba8888_span_to_surface_x(uint8_t *line_buf, int xpos, int ypos, const uint32_t *pixels, int len) and
+//   void rgb565_span_to_surface_x(uint8_t *line_buf, int xpos, int ypos, const uint8_t *pixels, int len),
+//   otherwise generic ones, based on draw_pixel_x, are used.
+#ifndef SURFACE_ALPHA_BLEND
+#define SURFACE_ALPHA_BLEND 0
+#endif
+
+#ifndef SURFACE_SPAN_FUNCTIONS
+#define SURFACE_SPAN_FUNCTIONS 0
+#endif
+
+static inline uint8_t rgba8888_get_alpha(uint32_t color)
 {
-    int line_len = DISPLAY_WIDTH - xpos;
+    return color & 0xFF;
+}
 
-    for (int i = 0; i < count; i++) {
-        BaseDisplayItem *item = &items[i];
+// Opaque pixels can be converted without taking into account the background
+static inline bool alpha_is_opaque(uint8_t alpha)
+{
+#if SURFACE_ALPHA_BLEND
+    return alpha == 0xFF;
+#else
+    return alpha != 0;
+#endif
+}
 
-        if ((xpos < item->x) && (ypos >= item->y) && (ypos < item->y + item->height)) {
-            int len_to_item = item->x - xpos;
-            line_len = (line_len > len_to_item) ? len_to_item : line_len;
+static inline uint32_t rgb565_be_to_rgba8888(const uint8_t *pix)
+{
+    uint16_t color16 = (pix[0] << 8) | pix[1];
+
+    uint32_t r = (color16 >> 11) & 0x1F;
+    uint32_t g = (color16 >> 5) & 0x3F;
+    uint32_t b = color16 & 0x1F;
+
+    r = (r << 3) | (r >> 2);
+    g = (g << 2) | (g >> 4);
+    b = (b << 3) | (b >> 2);
+
+    return (r << 24) | (g << 16) | (b << 8) | 0xFF;
+}
+
+#if !SURFACE_SPAN_FUNCTIONS
+static inline void fill_span_x(uint8_t *line_buf, int xpos, int ypos, int len, SurfaceColor color)
+{
+    for (int i = 0; i < len; i++) {
+        draw_pixel_x(line_buf, xpos + i, ypos, color);
+    }
+}
+
+static inline void rgba8888_span_to_surface_x(uint8_t *line_buf, int xpos, int ypos, const uint32_t *pixels, int len)
+{
+    for (int i = 0; i < len; i++) {
+        draw_pixel_x(line_buf, xpos + i, ypos, uint32_color_to_surface(READ_32_UNALIGNED(pixels + i)));
+    }
+}
+
+static inline void rgb565_span_to_surface_x(uint8_t *line_buf, int xpos, int ypos, const uint8_t *pixels, int len)
+{
+    for (int i = 0; i < len; i++) {
+        draw_pixel_x(line_buf, xpos + i, ypos, uint32_color_to_surface(rgb565_be_to_rgba8888(pixels + i * 2)));
+    }
+}
+#endif
+
+static inline uint32_t indexed8_get_pixel(const char *data, const void *palette, int index)
+{
+    return READ_32_UNALIGNED(((const uint32_t *) palette) + (uint8_t) data[index]);
+}
+
+// Following helpers hide the source image format, index is the pixel index inside the image
+// and plane_size is the number of pixels of the image. Run length encoded images are not
+// randomly accessible, so they are handled by draw_rle565_image_x.
+static inline uint8_t image_get_alpha(const char *data, const void *aux, enum image_format format,
+    int plane_size, int index)
+{
+    switch (format) {
+        case FormatRGB565BE:
+            return 0xFF;
+        case FormatRGB565A8:
+            return data[plane_size * 2 + index];
+        case FormatIndexed8:
+            return rgba8888_get_alpha(indexed8_get_pixel(data, aux, index));
+        default:
+            return data[index * 4 + 3];
+    }
+}
+
+static inline uint32_t image_get_pixel(const char *data, const void *aux, enum image_format format,
+    int plane_size, int index)
+{
+    switch (format) {
+        case FormatIndexed8:
+            return indexed8_get_pixel(data, aux, index);
+        case FormatRGB565BE:
+            return rgb565_be_to_rgba8888((const uint8_t *) data + index * 2);
+        case FormatRGB565A8:
+            return (rgb565_be_to_rgba8888((const uint8_t *) data + index * 2) & 0xFFFFFF00)
+                | (uint8_t) data[plane_size * 2 + index];
+        default:
+            return READ_32_UNALIGNED(((const uint32_t *) data) + index);
+    }
+}
+
+// Draws a run of opaque pixels
+static inline void image_span_to_surface_x(uint8_t *line_buf, int xpos, int ypos,
+    const char *data, const void *aux, enum image_format format, int index, int len)
+{
+    if (format == FormatRGBA8888) {
+        rgba8888_span_to_surface_x(line_buf, xpos, ypos, ((const uint32_t *) data) + index, len);
+    } else if (format == FormatIndexed8) {
+        for (int i = 0; i < len; i++) {
+            draw_pixel_x(line_buf, xpos + i, ypos, uint32_color_to_surface(indexed8_get_pixel(data, aux, index + i)));
         }
+    } else {
+        rgb565_span_to_surface_x(line_buf, xpos, ypos, (const uint8_t *) data + index * 2, len);
     }
+}
 
-    return line_len;
+// Returns false when the pixel is transparent, that is when items below have to be drawn.
+static inline bool image_pixel_to_surface(uint32_t img_pixel, const BaseDisplayItem *item,
+    bool visible_bg, SurfaceColor bgcolor, SurfaceColor *color)
+{
+    uint8_t alpha = rgba8888_get_alpha(img_pixel);
+
+#if SURFACE_ALPHA_BLEND
+    UNUSED(bgcolor);
+    if (alpha == 0xFF) {
+        *color = uint32_color_to_surface(img_pixel);
+    } else if (visible_bg) {
+        *color = alpha_blend_to_surface(img_pixel, item->brcolor, alpha);
+    } else {
+        return false;
+    }
+#else
+    if (alpha != 0) {
+        *color = uint32_color_to_surface(img_pixel);
+    } else if (visible_bg) {
+        *color = bgcolor;
+    } else {
+        return false;
+    }
+#endif
+
+    return true;
 }
 
-static int draw_x(uint8_t *line_buf, int xpos, int ypos, BaseDisplayItem *items, int items_count)
+// Packets before xpos are skipped, then each packet is drawn as a whole span: fill packets map
+// directly onto fill_span_x, while for transparent packets without a visible background their
+// negated length is returned, so items below can be drawn for the whole run.
+static int draw_rle565_image_x(uint8_t *line_buf, int xpos, int ypos, int len, BaseDisplayItem *item,
+    bool visible_bg, SurfaceColor bgcolor)
 {
-    bool below = false;
+    const uint8_t *data = (const uint8_t *) item->data.image_data.pix;
+    const uint32_t *rows = item->data.image_data.aux;
+    const uint8_t *packet = data + rows[ypos - item->y];
+    int skip = xpos - item->x;
+
+    int drawn_pixels = 0;
+
+    while (drawn_pixels < len) {
+        uint8_t header = *packet;
+        int kind = header >> 6;
+        int count = (header & 0x3F) + 1;
+        const uint8_t *pixels = packet + 1;
+        packet += 1 + ((kind == RLE565_LITERAL) ? count * 2 : ((kind == RLE565_FILL) ? 2 : 0));
+
+        if (skip >= count) {
+            skip -= count;
+            continue;
+        }
+        pixels += (kind == RLE565_LITERAL) ? skip * 2 : 0;
+        count -= skip;
+        skip = 0;
+        if (count > len - drawn_pixels) {
+            count = len - drawn_pixels;
+        }
+
+        if (kind == RLE565_LITERAL) {
+            rgb565_span_to_surface_x(line_buf, xpos + drawn_pixels, ypos, pixels, count);
+        } else if (kind == RLE565_FILL) {
+            fill_span_x(line_buf, xpos + drawn_pixels, ypos, count, uint32_color_to_surface(rgb565_be_to_rgba8888(pixels)));
+        } else if (visible_bg) {
+            fill_span_x(line_buf, xpos + drawn_pixels, ypos, count, bgcolor);
+        } else {
+            return (drawn_pixels > 0) ? drawn_pixels : -count;
+        }
+        drawn_pixels += count;
+    }
+
+    return drawn_pixels;
+}
+
+static int draw_image_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+{
+    int x = item->x;
+    int y = item->y;
+
+    SurfaceColor bgcolor = 0;
+    bool visible_bg;
+    if (item->brcolor != 0) {
+        bgcolor = uint32_color_to_surface(item->brcolor);
+        visible_bg = true;
+    } else {
+        visible_bg = false;
+    }
+
+    int width = item->width;
+    const char *data = item->data.image_data.pix;
+    enum image_format format = item->data.image_data.format;
+    const void *aux = item->data.image_data.aux;
+    int plane_size = width * item->height;
+
+    int index = (ypos - y) * width + (xpos - x);
+
+    if (width > xpos - x + max_line_len) {
+        width = xpos - x + max_line_len;
+    }
+    int len = width - (xpos - x);
+
+    if (format == FormatRLE565) {
+        return draw_rle565_image_x(line_buf, xpos, ypos, len, item, visible_bg, bgcolor);
+    }
+
+    if (format == FormatRGB565BE) {
+        // there is no alpha channel, so the whole span is opaque
+        image_span_to_surface_x(line_buf, xpos, ypos, data, aux, format, index, len);
+        return len;
+    }
+
+    int drawn_pixels = 0;
+
+    while (drawn_pixels < len) {
+        // runs of opaque pixels are found first, so they can be converted in bulk
+        int run = 0;
+        while ((drawn_pixels + run < len)
+            && alpha_is_opaque(image_get_alpha(data, aux, format, plane_size, index + drawn_pixels + run))) {
+            run++;
+        }
+        if (run > 0) {
+            image_span_to_surface_x(line_buf, xpos + drawn_pixels, ypos, data, aux, format, index + drawn_pixels, run);
+            drawn_pixels += run;
+            continue;
+        }
+
+        uint32_t img_pixel = image_get_pixel(data, aux, format, plane_size, index + drawn_pixels);
+        SurfaceColor color;
+        if (!image_pixel_to_surface(img_pixel, item, visible_bg, bgcolor, &color)) {
+            return drawn_pixels;
+        }
+        draw_pixel_x(line_buf, xpos + drawn_pixels, ypos, color);
+        drawn_pixels++;
+    }
+
+    return drawn_pixels;
+}
+
+// Interpolates each 8 bit channel, weight is in the 0 - 256 range, two channels at a time
+static inline uint32_t rgba8888_lerp(uint32_t a, uint32_t b, uint32_t weight)
+{
+    uint32_t even = (((a & 0x00FF00FF) * (256 - weight) + (b & 0x00FF00FF) * weight) >> 8) & 0x00FF00FF;
+    uint32_t odd = ((((a >> 8) & 0x00FF00FF) * (256 - weight) + ((b >> 8) & 0x00FF00FF) * weight) >> 8) & 0x00FF00FF;
+
+    return even | (odd << 8);
+}
 
+static inline int int_clamp(int value, int min, int max)
+{
+    return (value < min) ? min : ((value > max) ? max : value);
+}
+
+// Source coordinates are stepped in 16.16 fixed point, so there is no division in the inner loop.
+// Nearest sampling is aligned to the top left corner, so integer factors replicate pixels exactly,
+// while bilinear sampling is aligned to pixel centers. Bilinear neighbours are clamped to the
+// cropped area, so pixels outside of it (such as other sprites of a sheet) never bleed in.
+static int draw_scaled_cropped_img_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+{
+    int x = item->x;
+    int y = item->y;
+
+    SurfaceColor bgcolor = 0;
+    bool visible_bg;
+    if (item->brcolor != 0) {
+        bgcolor = uint32_color_to_surface(item->brcolor);
+        visible_bg = true;
+    } else {
+        visible_bg = false;
+    }
+
+    int width = item->width;
+    const char *data = item->data.image_data_with_size.pix;
+    enum image_format format = item->data.image_data_with_size.format;
+    const void *aux = item->data.image_data_with_size.aux;
+
+    int drawn_pixels = 0;
+
+    int32_t x_step = item->x_step;
+    int32_t y_step = item->y_step;
+    int img_width = item->data.image_data_with_size.width;
+    int img_height = item->data.image_data_with_size.height;
+    int plane_size = img_width * img_height;
+
+    int source_x = item->source_x;
+    int source_y = item->source_y;
+
+    if (width > xpos - x + max_line_len) {
+        width = xpos - x + max_line_len;
+    }
+
+    int j = xpos - x;
+
+    if (item->filter == FilterNearest) {
+        int src_y = source_y + (int) (((int64_t) (ypos - y) * y_step) >> 16);
+        if ((src_y < 0) || (src_y >= img_height)) {
+            return 0;
+        }
+        int row_index = src_y * img_width;
+
+        int64_t pos = (int64_t) j * x_step;
+        for (; j < width; j++) {
+            int src_x = source_x + (int) (pos >> 16);
+            if ((src_x < 0) || (src_x >= img_width)) {
+                return drawn_pixels;
+            }
+            uint32_t img_pixel = image_get_pixel(data, aux, format, plane_size, row_index + src_x);
+            SurfaceColor color;
+            if (!image_pixel_to_surface(img_pixel, item, visible_bg, bgcolor, &color)) {
+                return drawn_pixels;
+            }
+            draw_pixel_x(line_buf, xpos + drawn_pixels, ypos, color);
+            drawn_pixels++;
+            pos += x_step;
+        }
+
+        return drawn_pixels;
+    }
+
+    // last source pixels that belong to the cropped area
+    int last_x = source_x + (int) (((int64_t) (item->width - 1) * x_step) >> 16);
+    int last_y = source_y + (int) (((int64_t) (item->height - 1) * y_step) >> 16);
+    last_x = (last_x < img_width) ? last_x : img_width - 1;
+    last_y = (last_y < img_height) ? last_y : img_height - 1;
+    if ((source_x < 0) || (source_y < 0) || (source_x > last_x) || (source_y > last_y)) {
+        return 0;
+    }
+
+    int64_t pos_y = (int64_t) (ypos - y) * y_step + y_step / 2 - 0x8000;
+    if (pos_y < 0) {
+        pos_y = 0;
+    }
+    int src_y0 = int_clamp(source_y + (int) (pos_y >> 16), source_y, last_y);
+    int src_y1 = int_clamp(src_y0 + 1, source_y, last_y);
+    uint32_t weight_y = (pos_y >> 8) & 0xFF;
+    int row0 = src_y0 * img_width;
+    int row1 = src_y1 * img_width;
+
+    int64_t pos = (int64_t) j * x_step + x_step / 2 - 0x8000;
+    for (; j < width; j++) {
+        int64_t clamped_pos = (pos < 0) ? 0 : pos;
+        int src_x0 = source_x + (int) (clamped_pos >> 16);
+        if (src_x0 > last_x) {
+            return drawn_pixels;
+        }
+        int src_x1 = (src_x0 < last_x) ? src_x0 + 1 : last_x;
+        uint32_t weight_x = (clamped_pos >> 8) & 0xFF;
+
+        uint32_t top = rgba8888_lerp(image_get_pixel(data, aux, format, plane_size, row0 + src_x0),
+            image_get_pixel(data, aux, format, plane_size, row0 + src_x1), weight_x);
+        uint32_t bottom = rgba8888_lerp(image_get_pixel(data, aux, format, plane_size, row1 + src_x0),
+            image_get_pixel(data, aux, format, plane_size, row1 + src_x1), weight_x);
+        uint32_t img_pixel = rgba8888_lerp(top, bottom, weight_y);
+
+        SurfaceColor color;
+        if (!image_pixel_to_surface(img_pixel, item, visible_bg, bgcolor, &color)) {
+            return drawn_pixels;
+        }
+        draw_pixel_x(line_buf, xpos + drawn_pixels, ypos, color);
+        drawn_pixels++;
+        pos += x_step;
+    }
+
+    return drawn_pixels;
+}
+
+static int draw_rect_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+{
+    int x = item->x;
+    int width = item->width;
+    SurfaceColor color = uint32_color_to_surface(item->brcolor);
+
+    if (width > xpos - x + max_line_len) {
+        width = xpos - x + max_line_len;
+    }
+
+    int drawn_pixels = width - (xpos - x);
+    fill_span_x(line_buf, xpos, ypos, drawn_pixels, color);
+
+    return drawn_pixels;
+}
+
+// Number of leading set bits of a glyph row
+static const uint8_t glyph_row_leading_ones[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 7, 8,
+};
+
+// Returns the length of the run of pixels, starting from pixel k of a glyph row, that have the
+// same value of pixel k.
+static inline int glyph_row_run_len(unsigned char row, int k)
+{
+    unsigned char bits = row << k;
+    if (!(row & (0x80 >> k))) {
+        bits = ~bits;
+    }
+    int len = glyph_row_leading_ones[bits];
+
+    return (len > CHAR_WIDTH - k) ? CHAR_WIDTH - k : len;
+}
+
+// The built-in font rows are 8 pixels wide, so each iteration handles a whole glyph row. When the
+// background is transparent, runs of foreground pixels are drawn, while for runs of background
+// pixels their negated length is returned, so items below can be drawn for the whole run.
+static int draw_text_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+{
+    int x = item->x;
+    int y = item->y;
+    SurfaceColor colors[2];
+    colors[1] = uint32_color_to_surface(item->data.text_data.fgcolor);
+    bool visible_bg;
+    if (item->brcolor != 0) {
+        colors[0] = uint32_color_to_surface(item->brcolor);
+        visible_bg = true;
+    } else {
+        colors[0] = 0;
+        visible_bg = false;
+    }
+
+    const unsigned char *text = (const unsigned char *) item->data.text_data.text;
+    const unsigned char *glyph_rows = fontdata + (ypos - y);
+
+    int width = item->width;
+    if (width > xpos - x + max_line_len) {
+        width = xpos - x + max_line_len;
+    }
+
+    int j = xpos - x;
+    int char_index = j / CHAR_WIDTH;
+    int k = j % CHAR_WIDTH;
+
+    if (visible_bg) {
+        int drawn_pixels = 0;
+        while (j < width) {
+            unsigned char row = glyph_rows[text[char_index] * 16];
+            int end = (width - j < CHAR_WIDTH - k) ? k + width - j : CHAR_WIDTH;
+            j += end - k;
+            for (; k < end; k++) {
+                draw_pixel_x(line_buf, xpos + drawn_pixels, ypos, colors[(row >> (7 - k)) & 1]);
+                drawn_pixels++;
+            }
+            char_index++;
+            k = 0;
+        }
+        return drawn_pixels;
+    }
+
+    bool opaque = glyph_rows[text[char_index] * 16] & (0x80 >> k);
+    int run_len = 0;
+    while (j < width) {
+        unsigned char row = glyph_rows[text[char_index] * 16];
+        bool pixel_opaque = row & (0x80 >> k);
+        if (pixel_opaque != opaque) {
+            break;
+        }
+        int len = glyph_row_run_len(row, k);
+        if (len > width - j) {
+            len = width - j;
+        }
+        if (opaque) {
+            fill_span_x(line_buf, xpos + run_len, ypos, len, colors[1]);
+        }
+        run_len += len;
+        j += len;
+        k += len;
+        if (k == CHAR_WIDTH) {
+            char_index++;
+            k = 0;
+        } else {
+            break;
+        }
+    }
+
+    return opaque ? run_len : -run_len;
+}
+
+static int draw_glyph_run_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+{
+    int x = item->x;
+    int y = item->y;
+    const struct GlyphRunData *run = &item->data.glyph_run_data;
+    uint32_t fg = run->fgcolor;
+    SurfaceColor fgcolor = uint32_color_to_surface(fg);
+    SurfaceColor bgcolor = 0;
+    bool visible_bg;
+    if (item->brcolor != 0) {
+        bgcolor = uint32_color_to_surface(item->brcolor);
+        visible_bg = true;
+    } else {
+        visible_bg = false;
+    }
+
+    int width = item->width;
+    if (width > xpos - x + max_line_len) {
+        width = xpos - x + max_line_len;
+    }
+
+    int row = ypos - y;
+    int first_glyph = 0;
+    int drawn_pixels = 0;
+
+    for (int j = xpos - x; j < width; j++) {
+        // glyphs are sorted by x, so glyphs that end before j can be skipped for good
+        while ((first_glyph < run->glyphs_count) && (run->glyphs[first_glyph].x + run->max_glyph_width <= j)) {
+            first_glyph++;
+        }
+
+        // glyphs might overlap, such as with italic fonts
+        uint8_t coverage = 0;
+        for (int i = first_glyph; (i < run->glyphs_count) && (run->glyphs[i].x <= j); i++) {
+            const struct PlacedGlyph *glyph = &run->glyphs[i];
+            if ((j >= glyph->x + glyph->width) || (row < glyph->y) || (row >= glyph->y + glyph->height)) {
+                continue;
+            }
+            uint8_t c = glyph->coverage[(row - glyph->y) * glyph->width + (j - glyph->x)];
+            coverage = (c > coverage) ? c : coverage;
+        }
+
+        SurfaceColor color;
+#if SURFACE_ALPHA_BLEND
+        // blending with a transparent background would need pixels of items below
+        if (visible_bg && (coverage != 0xFF)) {
+            color = (coverage == 0) ? bgcolor : alpha_blend_to_surface(fg, item->brcolor, coverage);
+        } else if (coverage >= 0x80) {
+            color = fgcolor;
+        } else {
+            return drawn_pixels;
+        }
+#else
+        if (coverage >= 0x80) {
+            color = fgcolor;
+        } else if (visible_bg) {
+            color = bgcolor;
+        } else {
+            return drawn_pixels;
+        }
+#endif
+        draw_pixel_x(line_buf, xpos + drawn_pixels, ypos, color);
+        drawn_pixels++;
+    }
+
+    return drawn_pixels;
+}
+
+// Scanline index: it is built once for each update, so each row only considers the items that
+// intersect it, instead of walking the whole display list for each span.
+struct ScanlineIndex
+{
+    BaseDisplayItem *items;
+    int items_count;
+    int width;
+
+    // indices of all visible items, sorted by their first row
+    int *sorted;
+    int next_sorted;
+
+    // indices of items that intersect current row, sorted from the topmost item to the bottom one
+    int *active;
+    int active_count;
+
+    int ypos;
+};
+
+// The index is allocated from the same arena of the items, and it is released with them.
+static void scanline_index_init(struct ScanlineIndex *index, BaseDisplayItem *items, int items_count, int width,
+    struct FrameArena *arena)
+{
+    index->items = items;
+    index->items_count = 0;
+    index->width = width;
+    index->sorted = frame_arena_alloc(arena, sizeof(int) * items_count * 2);
+    index->active = NULL;
+    index->next_sorted = 0;
+    index->active_count = 0;
+    index->ypos = -1;
+    if (IS_NULL_PTR(index->sorted)) {
+        // nothing but the background is drawn
+        return;
+    }
+    index->active = index->sorted + items_count;
+
+    // display lists are rather short, and they are usually almost sorted, so insertion sort is fine
     for (int i = 0; i < items_count; i++) {
         BaseDisplayItem *item = &items[i];
-        if ((xpos < item->x) || (xpos >= item->x + item->width) || (ypos < item->y) || (ypos >= item->y + item->height)) {
+        if ((item->width <= 0) || (item->height <= 0)) {
+            continue;
+        }
+
+        int j = index->items_count;
+        while ((j > 0) && (items[index->sorted[j - 1]].y > item->y)) {
+            index->sorted[j] = index->sorted[j - 1];
+            j--;
+        }
+        index->sorted[j] = i;
+        index->items_count++;
+    }
+}
+
+// Rows can be drawn from different threads, each one with its own fork: sorted items are shared,
+// while active ones are not. The fork is allocated from the same arena of the items.
+static inline bool scanline_index_fork(struct ScanlineIndex *fork, const struct ScanlineIndex *index,
+    struct FrameArena *arena)
+{
+    *fork = *index;
+    fork->next_sorted = 0;
+    fork->active_count = 0;
+    fork->ypos = -1;
+    if (IS_NULL_PTR(index->sorted) || (index->items_count == 0)) {
+        return true;
+    }
+
+    fork->active = frame_arena_alloc(arena, sizeof(int) * index->items_count);
+
+    return !IS_NULL_PTR(fork->active);
+}
+
+static void scanline_index_seek(struct ScanlineIndex *index, int ypos)
+{
+    if (ypos == index->ypos) {
+        return;
+    }
+
+    BaseDisplayItem *items = index->items;
+
+    if (ypos < index->ypos) {
+        // going back, such as when drawing the next damaged rectangle
+        index->next_sorted = 0;
+        index->active_count = 0;
+    }
+    index->ypos = ypos;
+
+    int count = 0;
+    for (int i = 0; i < index->active_count; i++) {
+        BaseDisplayItem *item = &items[index->active[i]];
+        if (ypos < item->y + item->height) {
+            index->active[count] = index->active[i];
+            count++;
+        }
+    }
+    index->active_count = count;
+
+    while ((index->next_sorted < index->items_count) && (items[index->sorted[index->next_sorted]].y <= ypos)) {
+        int item_index = index->sorted[index->next_sorted];
+        index->next_sorted++;
+
+        BaseDisplayItem *item = &items[item_index];
+        if (ypos >= item->y + item->height) {
             continue;
         }
 
-        int max_line_len = below ? 1 : find_max_line_len(items, i, xpos, ypos);
+        int j = index->active_count;
+        while ((j > 0) && (index->active[j - 1] > item_index)) {
+            index->active[j] = index->active[j - 1];
+            j--;
+        }
+        index->active[j] = item_index;
+        index->active_count++;
+    }
+}
+
+static int draw_x(uint8_t *line_buf, int xpos, int ypos, struct ScanlineIndex *index)
+{
+    scanline_index_seek(index, ypos);
+
+    bool below = false;
+    // items above the one that is going to be drawn, that start on the right of xpos
+    int line_len = index->width - xpos;
+    // pixels that are transparent for all the items above the one that is going to be drawn
+    int below_len = line_len;
+
+    for (int i = 0; i < index->active_count; i++) {
+        BaseDisplayItem *item = &index->items[index->active[i]];
+        if (xpos < item->x) {
+            int len_to_item = item->x - xpos;
+            line_len = (line_len > len_to_item) ? len_to_item : line_len;
+            continue;
+        }
+        if (xpos >= item->x + item->width) {
+            continue;
+        }
+
+        // items above that start on the right of xpos limit the run even below transparent pixels
+        int max_line_len = (below && (below_len < line_len)) ? below_len : line_len;
 
         int drawn_pixels = 0;
-        switch (items[i].primitive) {
+        switch (item->primitive) {
             case Image:
                 //fprintf(stderr, "Image\n");
                 drawn_pixels = draw_image_x(line_buf, xpos, ypos, max_line_len, item);
@@ -76,15 +770,23 @@ static int draw_x(uint8_t *line_buf, int xpos, int ypos, BaseDisplayItem *items,
                 drawn_pixels = draw_text_x(line_buf, xpos, ypos, max_line_len, item);
                 break;
 
+            case GlyphRun:
+                drawn_pixels = draw_glyph_run_x(line_buf, xpos, ypos, max_line_len, item);
+                break;
+
             default: {
                 fprintf(stderr, "unexpected display list command.\n");
             }
         }
 
-        if (drawn_pixels != 0) {
+        if (drawn_pixels > 0) {
             return drawn_pixels;
         }
 
+        // a negative value is the length of a transparent run, otherwise only this pixel is known
+        // to be transparent
+        int transparent_len = (drawn_pixels < 0) ? -drawn_pixels : 1;
+        below_len = (below_len > transparent_len) ? transparent_len : below_len;
         below = true;
     }
 
@@ -0,0 +1,101 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Bump allocator for everything that lives as long as a display list: items, their strings and
+// rasterized surfaces. Nothing is freed one by one, the whole arena is reset at once.
+//
+// When a frame needs more memory than available, allocations fall back to the heap and the
+// arena is grown to the high-water mark on next reset, so steady-state frames do not touch the
+// heap at all.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <utils.h>
+
+#define FRAME_ARENA_ALIGNMENT 8
+
+struct FrameArenaBlock
+{
+    struct FrameArenaBlock *next;
+    uint64_t data[];
+};
+
+struct FrameArena
+{
+    uint8_t *buffer;
+    size_t capacity;
+    size_t used;
+    // biggest amount of memory required by a single frame so far
+    size_t high_water;
+    // heap allocations made since last reset, when the arena was too small
+    struct FrameArenaBlock *overflow;
+};
+
+static inline void frame_arena_init(struct FrameArena *arena)
+{
+    arena->buffer = NULL;
+    arena->capacity = 0;
+    arena->used = 0;
+    arena->high_water = 0;
+    arena->overflow = NULL;
+}
+
+static void *frame_arena_alloc(struct FrameArena *arena, size_t size)
+{
+    size = (size + FRAME_ARENA_ALIGNMENT - 1) & ~((size_t) FRAME_ARENA_ALIGNMENT - 1);
+
+    size_t offset = arena->used;
+    arena->used += size;
+    if (arena->used <= arena->capacity) {
+        return arena->buffer + offset;
+    }
+
+    struct FrameArenaBlock *block = malloc(sizeof(struct FrameArenaBlock) + size);
+    if (IS_NULL_PTR(block)) {
+        return NULL;
+    }
+    block->next = arena->overflow;
+    arena->overflow = block;
+
+    return block->data;
+}
+
+// Releases everything that has been allocated, all pointers returned so far become invalid.
+static void frame_arena_reset(struct FrameArena *arena)
+{
+    while (arena->overflow) {
+        struct FrameArenaBlock *next = arena->overflow->next;
+        free(arena->overflow);
+        arena->overflow = next;
+    }
+
+    if (arena->used > arena->high_water) {
+        arena->high_water = arena->used;
+    }
+    arena->used = 0;
+
+    if (arena->high_water > arena->capacity) {
+        free(arena->buffer);
+        arena->buffer = malloc(arena->high_water);
+        arena->capacity = arena->buffer ? arena->high_water : 0;
+    }
+}
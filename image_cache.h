@@ -0,0 +1,238 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Port level cache of decoded images, display lists reference them with {image_ref, Handle}
+// instead of carrying pixel binaries. Entries are kept in LRU order, and the least recently used
+// ones are evicted when the byte budget would be exceeded. Caches hold a few dozens of icons,
+// so entries are just looked up in a list.
+//
+// Items keep pointers to cached pixels: when an entry is evicted or replaced, the previous display
+// list must be forgotten, so it is never compared against new entries.
+//
+// enum image_format must be defined before including this file.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef ESP_PLATFORM
+#include <esp_heap_caps.h>
+#endif
+
+#include <globalcontext.h>
+#include <interop.h>
+#include <term.h>
+#include <utils.h>
+
+struct ImageCacheEntry
+{
+    struct ImageCacheEntry *prev;
+    struct ImageCacheEntry *next;
+    term handle;
+    enum image_format format;
+    int width;
+    int height;
+    size_t size;
+    uint64_t pix[];
+};
+
+struct ImageCache
+{
+    // most recently used entry is the head
+    struct ImageCacheEntry *head;
+    struct ImageCacheEntry *tail;
+    size_t budget;
+    size_t used;
+#ifdef ESP_PLATFORM
+    uint32_t caps;
+#endif
+
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int evictions;
+};
+
+// a budget of 0 bytes (the default) disables the cache
+static struct ImageCache image_cache;
+
+// Parses image_cache_size (bytes) and, on ESP32, image_cache_memory (internal or psram).
+static inline bool image_cache_init(term opts, GlobalContext *glb)
+{
+    image_cache.head = NULL;
+    image_cache.tail = NULL;
+    image_cache.used = 0;
+    image_cache.hits = 0;
+    image_cache.misses = 0;
+    image_cache.evictions = 0;
+
+    term size = interop_kv_get_value_default(opts, ATOM_STR("\x10", "image_cache_size"), term_from_int(0), glb);
+    if (!term_is_integer(size) || (term_to_int(size) < 0)) {
+        return false;
+    }
+    image_cache.budget = term_to_int(size);
+
+#ifdef ESP_PLATFORM
+    term memory = interop_kv_get_value_default(opts, ATOM_STR("\x12", "image_cache_memory"),
+        globalcontext_make_atom(glb, ATOM_STR("\x8", "internal")), glb);
+    if (memory == globalcontext_make_atom(glb, ATOM_STR("\x8", "internal"))) {
+        image_cache.caps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+    } else if (memory == globalcontext_make_atom(glb, ATOM_STR("\x5", "psram"))) {
+        image_cache.caps = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+    } else {
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+static void image_cache_unlink(struct ImageCacheEntry *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        image_cache.head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        image_cache.tail = entry->prev;
+    }
+}
+
+static void image_cache_link_head(struct ImageCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = image_cache.head;
+    if (image_cache.head) {
+        image_cache.head->prev = entry;
+    } else {
+        image_cache.tail = entry;
+    }
+    image_cache.head = entry;
+}
+
+static void image_cache_remove(struct ImageCacheEntry *entry)
+{
+    image_cache_unlink(entry);
+    image_cache.used -= entry->size;
+    free(entry);
+}
+
+// Used by display lists: entry becomes the most recently used one, stats are not updated.
+static struct ImageCacheEntry *image_cache_find(term handle)
+{
+    for (struct ImageCacheEntry *entry = image_cache.head; entry; entry = entry->next) {
+        if (entry->handle == handle) {
+            if (entry != image_cache.head) {
+                image_cache_unlink(entry);
+                image_cache_link_head(entry);
+            }
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Used by requests that would otherwise decode or copy the image, so they are counted.
+static struct ImageCacheEntry *image_cache_lookup(term handle)
+{
+    struct ImageCacheEntry *entry = image_cache_find(handle);
+    if (entry) {
+        image_cache.hits++;
+    } else {
+        image_cache.misses++;
+    }
+
+    return entry;
+}
+
+// Returns a new entry, that must be filled with size bytes of pixels, or NULL when the image does
+// not fit. *evicted is set when any existing entry has been evicted or replaced.
+// Handles outlive messages, so only atoms and small integers are accepted.
+static struct ImageCacheEntry *image_cache_alloc(term handle, enum image_format format, int width, int height,
+    size_t size, bool *evicted)
+{
+    *evicted = false;
+    if (!term_is_atom(handle) && !term_is_integer(handle)) {
+        return NULL;
+    }
+
+    struct ImageCacheEntry *old = image_cache_find(handle);
+    if (old) {
+        image_cache_remove(old);
+        *evicted = true;
+    }
+
+    if (size > image_cache.budget) {
+        return NULL;
+    }
+    while (image_cache.used + size > image_cache.budget) {
+        image_cache_remove(image_cache.tail);
+        image_cache.evictions++;
+        *evicted = true;
+    }
+
+#ifdef ESP_PLATFORM
+    struct ImageCacheEntry *entry = heap_caps_malloc(sizeof(struct ImageCacheEntry) + size, image_cache.caps);
+#else
+    struct ImageCacheEntry *entry = malloc(sizeof(struct ImageCacheEntry) + size);
+#endif
+    if (IS_NULL_PTR(entry)) {
+        return NULL;
+    }
+    entry->handle = handle;
+    entry->format = format;
+    entry->width = width;
+    entry->height = height;
+    entry->size = size;
+
+    image_cache_link_head(entry);
+    image_cache.used += size;
+
+    return entry;
+}
+
+#define IMAGE_CACHE_STATS_TERMS 5
+#define IMAGE_CACHE_STATS_SIZE (IMAGE_CACHE_STATS_TERMS * (CONS_SIZE + TUPLE_SIZE(2)))
+
+static term image_cache_stat(term stats, AtomString name, unsigned int value, Heap *heap, GlobalContext *glb)
+{
+    term stat = term_alloc_tuple(2, heap);
+    term_put_tuple_element(stat, 0, globalcontext_make_atom(glb, name));
+    term_put_tuple_element(stat, 1, term_from_int(value));
+
+    return term_list_prepend(stat, stats, heap);
+}
+
+// Returns a proplist, heap must have IMAGE_CACHE_STATS_SIZE free terms.
+static inline term image_cache_stats(Heap *heap, GlobalContext *glb)
+{
+    term stats = term_nil();
+    stats = image_cache_stat(stats, ATOM_STR("\x6", "budget"), image_cache.budget, heap, glb);
+    stats = image_cache_stat(stats, ATOM_STR("\x4", "used"), image_cache.used, heap, glb);
+    stats = image_cache_stat(stats, ATOM_STR("\x9", "evictions"), image_cache.evictions, heap, glb);
+    stats = image_cache_stat(stats, ATOM_STR("\x6", "misses"), image_cache.misses, heap, glb);
+    stats = image_cache_stat(stats, ATOM_STR("\x4", "hits"), image_cache.hits, heap, glb);
+
+    return stats;
+}
@@ -20,36 +20,253 @@
 
 #include "image_helpers.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+#include <defaultatoms.h>
+#include <globalcontext.h>
+#include <interop.h>
+
 #include "spng.h"
 
+bool image_png_get_size(const void *png, size_t png_size, int *width, int *height)
+{
+    spng_ctx *png_ctx = spng_ctx_new(0);
+    if (!png_ctx) {
+        return false;
+    }
+    spng_set_png_buffer(png_ctx, png, png_size);
+
+    struct spng_ihdr ihdr;
+    int ret = spng_get_ihdr(png_ctx, &ihdr);
+    spng_ctx_free(png_ctx);
+    if (ret != SPNG_OK) {
+        return false;
+    }
+    *width = ihdr.width;
+    *height = ihdr.height;
+
+    return true;
+}
+
+// Interlaced rows are decoded one pass at a time, so rows are complete only at the end
+static bool decode_interlaced_rows(spng_ctx *png_ctx, int width, int height, image_row_callback_t row_callback,
+    void *user_data)
+{
+    size_t out_size;
+    if (spng_decoded_image_size(png_ctx, SPNG_FMT_RGBA8, &out_size) != SPNG_OK) {
+        return false;
+    }
+    uint8_t *out = malloc(out_size);
+    if (!out) {
+        fprintf(stderr, "Failed to allocate %i bytes for interlaced image.\n", (int) out_size);
+        return false;
+    }
+
+    bool ok = (spng_decode_image(png_ctx, out, out_size, SPNG_FMT_RGBA8, SPNG_DECODE_TRNS) == SPNG_OK);
+    for (int row = 0; ok && (row < height); row++) {
+        ok = row_callback(out + row * width * 4, row, width, user_data);
+    }
+    free(out);
+
+    return ok;
+}
+
+bool image_png_decode_rows(const void *png, size_t png_size, image_row_callback_t row_callback, void *user_data)
+{
+    spng_ctx *png_ctx = spng_ctx_new(0);
+    if (!png_ctx) {
+        return false;
+    }
+    spng_set_png_buffer(png_ctx, png, png_size);
+
+    uint8_t *row_buf = NULL;
+    bool ok = false;
+
+    struct spng_ihdr ihdr;
+    if (spng_get_ihdr(png_ctx, &ihdr) != SPNG_OK) {
+        goto cleanup;
+    }
+    int width = ihdr.width;
+    int height = ihdr.height;
+
+    if (ihdr.interlace_method != 0) {
+        ok = decode_interlaced_rows(png_ctx, width, height, row_callback, user_data);
+        goto cleanup;
+    }
+
+    if (spng_decode_image(png_ctx, NULL, 0, SPNG_FMT_RGBA8, SPNG_DECODE_PROGRESSIVE | SPNG_DECODE_TRNS) != SPNG_OK) {
+        goto cleanup;
+    }
+
+    size_t row_size = width * 4;
+    row_buf = malloc(row_size);
+    if (!row_buf) {
+        goto cleanup;
+    }
+
+    int ret;
+    do {
+        struct spng_row_info row_info;
+        ret = spng_get_row_info(png_ctx, &row_info);
+        if (ret != SPNG_OK) {
+            break;
+        }
+        ret = spng_decode_row(png_ctx, row_buf, row_size);
+        if ((ret != SPNG_OK) && (ret != SPNG_EOI)) {
+            break;
+        }
+        if (!row_callback(row_buf, row_info.row_num, width, user_data)) {
+            goto cleanup;
+        }
+    } while (ret == SPNG_OK);
+    ok = (ret == SPNG_EOI);
+
+cleanup:
+    free(row_buf);
+    spng_ctx_free(png_ctx);
+
+    return ok;
+}
+
+int png_output_bytes_per_pixel(enum png_output_format format)
+{
+    switch (format) {
+        case PngRGB565BE:
+            return 2;
+        case PngRGB565A8:
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+struct LoadImageRows
+{
+    uint8_t *out;
+    int width;
+    int height;
+    enum png_output_format format;
+};
+
+// Rows are converted straight into the output binary
+static bool load_image_row(const uint8_t *rgba_row, int row, int width, void *user_data)
+{
+    struct LoadImageRows *dest = user_data;
+
+    switch (dest->format) {
+        case PngRGBA8888:
+            memcpy(dest->out + row * width * 4, rgba_row, width * 4);
+            break;
+
+        case PngRGB565BE:
+        case PngRGB565A8: {
+            uint8_t *out = dest->out + row * width * 2;
+            for (int i = 0; i < width; i++) {
+                const uint8_t *pix = rgba_row + i * 4;
+                out[i * 2] = (pix[0] & 0xF8) | (pix[1] >> 5);
+                out[i * 2 + 1] = ((pix[1] & 0x1C) << 3) | (pix[2] >> 3);
+            }
+            if (dest->format == PngRGB565A8) {
+                uint8_t *alpha = dest->out + dest->width * dest->height * 2 + row * width;
+                for (int i = 0; i < width; i++) {
+                    alpha[i] = rgba_row[i * 4 + 3];
+                }
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool image_png_decode_into(const void *png, size_t png_size, enum png_output_format format, uint8_t *out)
+{
+    struct LoadImageRows dest;
+    if (!image_png_get_size(png, png_size, &dest.width, &dest.height)) {
+        return false;
+    }
+    dest.out = out;
+    dest.format = format;
+
+    return image_png_decode_rows(png, png_size, load_image_row, &dest);
+}
+
+static void send_load_image_reply(term ref, term value, term pid, Context *ctx)
+{
+    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(2), heap);
+    term return_tuple = term_alloc_tuple(2, &heap);
+    term_put_tuple_element(return_tuple, 0, ref);
+    term_put_tuple_element(return_tuple, 1, value);
+
+    int local_process_id = term_to_local_process_id(pid);
+    globalcontext_send_message(ctx->global, local_process_id, return_tuple);
+    END_WITH_STACK_HEAP(heap, ctx->global);
+}
+
+// {load_image, Png} replies with a RGBA8888 binary, while {load_image, Png, Opts} replies with an
+// image tuple, in the format that is selected by the format option.
 void handle_load_image(term req, term ref, term pid, Context *ctx)
 {
+    GlobalContext *glb = ctx->global;
+
     term image_bin = term_get_tuple_element(req, 1);
     const void *buf = term_binary_data(image_bin);
     size_t buf_size = term_binary_size(image_bin);
 
-    spng_ctx *png_ctx = spng_ctx_new(0);
-    spng_set_png_buffer(png_ctx, buf, buf_size);
+    bool reply_tuple = (term_get_tuple_arity(req) >= 3);
+    term format_atom = globalcontext_make_atom(glb, ATOM_STR("\x8", "rgba8888"));
+    if (reply_tuple) {
+        format_atom = interop_kv_get_value_default(term_get_tuple_element(req, 2), ATOM_STR("\x6", "format"), format_atom, glb);
+    }
 
-    size_t out_size;
-    spng_decoded_image_size(png_ctx, SPNG_FMT_RGBA8, &out_size);
+    struct LoadImageRows dest;
+    if (format_atom == globalcontext_make_atom(glb, ATOM_STR("\x8", "rgba8888"))) {
+        dest.format = PngRGBA8888;
+    } else if (format_atom == globalcontext_make_atom(glb, ATOM_STR("\x9", "rgb565_be"))) {
+        dest.format = PngRGB565BE;
+    } else if (format_atom == globalcontext_make_atom(glb, ATOM_STR("\x8", "rgb565a8"))) {
+        dest.format = PngRGB565A8;
+    } else {
+        fprintf(stderr, "unsupported image format.\n");
+        send_load_image_reply(ref, ERROR_ATOM, pid, ctx);
+        return;
+    }
 
-    void *out = malloc(out_size);
-    spng_decode_image(png_ctx, out, out_size, SPNG_FMT_RGBA8, 0);
-
-    spng_ctx_free(png_ctx);
+    if (!image_png_get_size(buf, buf_size, &dest.width, &dest.height)) {
+        fprintf(stderr, "invalid PNG image.\n");
+        send_load_image_reply(ref, ERROR_ATOM, pid, ctx);
+        return;
+    }
+    size_t out_size = dest.width * dest.height * png_output_bytes_per_pixel(dest.format);
 
     // term_binary_heap_size(out_size) is usually less than 100 bytes
-    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(3) + term_binary_heap_size(out_size), heap);
+    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(2) + TUPLE_SIZE(4) + term_binary_heap_size(out_size), heap);
+
+    // rows are decoded into the binary, so the image is never copied
+    term out_bin = term_create_uninitialized_binary(out_size, &heap, glb);
+    dest.out = (uint8_t *) term_binary_data(out_bin);
+
+    term value;
+    if (!image_png_decode_rows(buf, buf_size, load_image_row, &dest)) {
+        fprintf(stderr, "failed to decode PNG image.\n");
+        value = ERROR_ATOM;
+    } else if (reply_tuple) {
+        value = term_alloc_tuple(4, &heap);
+        term_put_tuple_element(value, 0, format_atom);
+        term_put_tuple_element(value, 1, term_from_int(dest.width));
+        term_put_tuple_element(value, 2, term_from_int(dest.height));
+        term_put_tuple_element(value, 3, out_bin);
+    } else {
+        value = out_bin;
+    }
 
     term return_tuple = term_alloc_tuple(2, &heap);
     term_put_tuple_element(return_tuple, 0, ref);
-    term_put_tuple_element(return_tuple, 1, term_from_literal_binary(out, out_size, &heap, ctx->global));
-
-    free(out);
+    term_put_tuple_element(return_tuple, 1, value);
 
     int local_process_id = term_to_local_process_id(pid);
-    globalcontext_send_message(ctx->global, local_process_id, return_tuple);
+    globalcontext_send_message(glb, local_process_id, return_tuple);
 
-    END_WITH_STACK_HEAP(heap, ctx->global)
+    END_WITH_STACK_HEAP(heap, glb)
 }
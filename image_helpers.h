@@ -21,9 +21,41 @@
 #ifndef IMAGE_HELPERS_H_
 #define IMAGE_HELPERS_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include <context.h>
 #include <term.h>
 
+// Called for each decoded row, rgba_row holds width RGBA8888 pixels (R, G, B, A bytes),
+// returning false stops decoding.
+typedef bool (*image_row_callback_t)(const uint8_t *rgba_row, int row, int width, void *user_data);
+
+bool image_png_get_size(const void *png, size_t png_size, int *width, int *height);
+
+/**
+ * Decodes a PNG one row at a time, so the whole RGBA8888 image is never allocated (but for
+ * interlaced images): rows are passed to row_callback, that can convert them or send them
+ * to a display as soon as they are ready. Returns false when the image cannot be decoded.
+ */
+bool image_png_decode_rows(const void *png, size_t png_size, image_row_callback_t row_callback, void *user_data);
+
+enum png_output_format
+{
+    PngRGBA8888,
+    PngRGB565BE,
+    PngRGB565A8
+};
+
+int png_output_bytes_per_pixel(enum png_output_format format);
+
+/**
+ * Decodes a PNG into out, that must hold width * height * png_output_bytes_per_pixel(format)
+ * bytes. Returns false when the image cannot be decoded.
+ */
+bool image_png_decode_into(const void *png, size_t png_size, enum png_output_format format, uint8_t *out);
+
 void handle_load_image(term req, term ref, term pid, Context *ctx);
 
 #endif
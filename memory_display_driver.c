@@ -21,6 +21,7 @@
 #include <string.h>
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <freertos/task.h>
 
 #include <driver/spi_master.h>
@@ -57,6 +58,15 @@
 
 #define DISPLAY_WIDTH 400
 
+#define MEMORY_LCD_LINE_BYTES (DISPLAY_WIDTH / 8)
+// line address, line pixels and a dummy byte
+#define MEMORY_LCD_LINE_SIZE (1 + MEMORY_LCD_LINE_BYTES + 1)
+// changed lines are sent using multi-line write commands, up to this number of lines each
+#define MEMORY_LCD_BATCH_LINES 16
+// command byte, lines and the trailing dummy byte
+#define MEMORY_LCD_BATCH_SIZE (1 + MEMORY_LCD_BATCH_LINES * MEMORY_LCD_LINE_SIZE + 1)
+#define MEMORY_LCD_VCOM_PERIOD_MS 1000
+
 #define CHECK_OVERFLOW 1
 #define REPORT_UNEXPECTED_MSGS 0
 
@@ -66,11 +76,16 @@ struct SPI
 {
     struct SPIDisplay spi_disp;
     Context *ctx;
+
+    // taken by updates and by VCOM inversion, that are sent from different tasks
+    SemaphoreHandle_t lock;
+    uint8_t *vcom_buf;
 };
 
 #include "display_items.h"
-#include "draw_common.h"
+#include "display_messages.h"
 #include "monochrome.h"
+#include "draw_common.h"
 
 // This struct is just for compatibility reasons with the SDL display driver
 // so it is possible to easily copy & paste code from there.
@@ -78,9 +93,17 @@ struct Screen
 {
     int w;
     int h;
+    // batch that is being rendered and batch that is being sent
     uint8_t *pixels;
     uint8_t *dma_out;
     // keep double buffer disabled for now: uint16_t *pixels_out;
+
+    // 1-bit lines that have been sent, so unchanged ones are skipped
+    uint8_t *prev_lines;
+    bool prev_lines_valid;
+
+    // display list items are released all at once after each update
+    struct FrameArena arena;
 };
 
 static struct Screen *screen;
@@ -91,91 +114,119 @@ struct PendingReply
     term pending_call_pid;
 };
 
-static QueueHandle_t display_messages_queue;
-
 static NativeHandlerResult display_driver_consume_mailbox(Context *ctx);
 static void display_init(Context *ctx, term opts);
 
-int vcom = 0x0;
-static inline int get_vcom()
+// VCOM bit of commands, it is inverted only by vcom_task, while lock is taken
+static int vcom = 0x0;
+
+// VCOM must be periodically inverted even when nothing is drawn, otherwise a DC bias builds up
+// in the panel, so it is done on a timer rather than on updates.
+static void vcom_task(void *arg)
 {
-    int current_vcom = vcom;
-    if (!vcom) {
-        vcom = 0x2;
-    } else {
-        vcom = 0;
-    }
+    struct SPI *spi = arg;
 
-    return current_vcom;
+    TickType_t last_wake = xTaskGetTickCount();
+    while (true) {
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(MEMORY_LCD_VCOM_PERIOD_MS));
+
+        xSemaphoreTake(spi->lock, portMAX_DELAY);
+        vcom ^= 0x2;
+        // display mode command, it just carries the VCOM bit
+        spi->vcom_buf[0] = vcom;
+        spi->vcom_buf[1] = 0;
+
+        spi_device_acquire_bus(spi->spi_disp.handle, portMAX_DELAY);
+        spi_display_dmawrite(&spi->spi_disp, 2, spi->vcom_buf);
+        spi_display_wait_dmawrite(&spi->spi_disp);
+        spi_device_release_bus(spi->spi_disp.handle);
+        xSemaphoreGive(spi->lock);
+    }
 }
 
-static void do_update(Context *ctx, term display_list)
+// Sends the batch that has been rendered into screen->pixels as a single multi-line write
+// command, while next lines are rendered into the other buffer.
+static void send_batch(struct SPI *spi, int batch_lines, bool *transaction_in_progress)
 {
-    int proper;
-    int len = term_list_length(display_list, &proper);
+    uint8_t *batch = screen->pixels;
+    int batch_size = 1 + batch_lines * MEMORY_LCD_LINE_SIZE + 1;
+    batch[0] = 0x1 | vcom;
+    batch[batch_size - 1] = 0;
 
-    BaseDisplayItem *items = malloc(sizeof(BaseDisplayItem) * len);
-
-    term t = display_list;
-    for (int i = 0; i < len; i++) {
-        init_item(&items[i], term_get_list_head(t), ctx);
-        t = term_get_list_tail(t);
+    if (*transaction_in_progress) {
+        spi_display_wait_dmawrite(&spi->spi_disp);
     }
+    screen->pixels = screen->dma_out;
+    screen->dma_out = batch;
+
+    spi_display_dmawrite(&spi->spi_disp, batch_size, batch);
+    *transaction_in_progress = true;
+}
+
+// All lines are rendered, since dithering needs all of them, but only lines that differ from
+// what the panel already shows are sent.
+static void do_update(Context *ctx, term display_list)
+{
+    DISPLAY_STATS_START(parse_start);
+    int len;
+    BaseDisplayItem *items = init_items(display_list, &len, NULL, 0, ctx, &screen->arena);
 
     int screen_width = screen->w;
     int screen_height = screen->h;
     struct SPI *spi = ctx->platform_data;
 
-    int memsize = 2 + 400 / 8 + 2;
-    uint8_t *buf = screen->pixels;
+    struct ScanlineIndex index;
+    scanline_index_init(&index, items, len, screen_width, &screen->arena);
+    DISPLAY_STATS_ADD_ELAPSED(parse_us, parse_start);
+    DISPLAY_STATS_ADD(frames, 1);
 
+    xSemaphoreTake(spi->lock, portMAX_DELAY);
     spi_device_acquire_bus(spi->spi_disp.handle, portMAX_DELAY);
     bool transaction_in_progress = false;
+    int batch_lines = 0;
 
     for (int ypos = 0; ypos < screen_height; ypos++) {
-        if (!screen->dma_out && transaction_in_progress) {
-            spi_transaction_t *trans = NULL;
-            spi_device_get_trans_result(spi->spi_disp.handle, &trans, portMAX_DELAY);
-        }
-
-        memset(buf + 2, 0xFF, DISPLAY_WIDTH / 8);
+        uint8_t *line = screen->pixels + 1 + batch_lines * MEMORY_LCD_LINE_SIZE;
+        uint8_t *line_pixels = line + 1;
+        memset(line_pixels, 0xFF, MEMORY_LCD_LINE_BYTES);
 
+        DISPLAY_STATS_START(raster_start);
         int xpos = 0;
         while (xpos < screen_width) {
-            int drawn_pixels = draw_x(buf + 2, xpos, ypos, items, len);
+            int drawn_pixels = draw_x(line_pixels, xpos, ypos, &index);
             xpos += drawn_pixels;
         }
+        DISPLAY_STATS_ADD_ELAPSED(raster_us, raster_start);
 
-        buf[0] = 0x1 | get_vcom();
-        buf[1] = ypos + 1;
-        buf[2 + DISPLAY_WIDTH / 8] = 0;
-        buf[2 + DISPLAY_WIDTH / 8 + 1] = 0;
-
-        if (screen->dma_out) {
-            if (transaction_in_progress) {
-                spi_transaction_t *trans = NULL;
-                spi_device_get_trans_result(spi->spi_disp.handle, &trans, portMAX_DELAY);
-            }
-            void *tmp = screen->pixels;
-            screen->pixels = screen->dma_out;
-            buf = screen->pixels;
-            screen->dma_out = tmp;
-
-            spi_display_dmawrite(&spi->spi_disp, memsize, screen->dma_out);
-        } else {
-            spi_display_dmawrite(&spi->spi_disp, memsize, buf);
+        uint8_t *prev_line = screen->prev_lines + ypos * MEMORY_LCD_LINE_BYTES;
+        if (screen->prev_lines_valid && !memcmp(prev_line, line_pixels, MEMORY_LCD_LINE_BYTES)) {
+            DISPLAY_STATS_ADD(skipped_lines, 1);
+            continue;
         }
+        memcpy(prev_line, line_pixels, MEMORY_LCD_LINE_BYTES);
+
+        line[0] = ypos + 1;
+        line[1 + MEMORY_LCD_LINE_BYTES] = 0;
+        batch_lines++;
+
+        if (batch_lines == MEMORY_LCD_BATCH_LINES) {
+            send_batch(spi, batch_lines, &transaction_in_progress);
+            batch_lines = 0;
+        }
+    }
 
-        transaction_in_progress = true;
+    if (batch_lines > 0) {
+        send_batch(spi, batch_lines, &transaction_in_progress);
     }
 
     if (transaction_in_progress) {
-        spi_transaction_t *trans;
-        spi_device_get_trans_result(spi->spi_disp.handle, &trans, portMAX_DELAY);
+        spi_display_wait_dmawrite(&spi->spi_disp);
     }
+    screen->prev_lines_valid = true;
 
     spi_device_release_bus(spi->spi_disp.handle);
-    destroy_items(items, len);
+    xSemaphoreGive(spi->lock);
+    frame_arena_reset(&screen->arena);
 }
 
 static void send_message(term pid, term message, GlobalContext *global);
@@ -194,11 +245,31 @@ static void process_message(Message *message, Context *ctx)
     }
     term cmd = term_get_tuple_element(req, 0);
 
+    struct SPI *spi = ctx->platform_data;
+
     if (cmd == context_make_atom(ctx, "\x6"
                                       "update")) {
         term display_list = term_get_tuple_element(req, 1);
         do_update(ctx, display_list);
 
+    } else if (cmd == context_make_atom(ctx, "\x9"
+                                             "get_stats")) {
+        // SPI counters are updated by vcom_task too
+        xSemaphoreTake(spi->lock, portMAX_DELAY);
+        DISPLAY_STATS_COLLECT_SPI(&spi->spi_disp);
+        xSemaphoreGive(spi->lock);
+        display_messages_send_stats(&gen_message, ctx->global);
+        return;
+
+    } else if (cmd == context_make_atom(ctx, "\xB"
+                                             "reset_stats")) {
+        display_messages_reset_stats();
+        xSemaphoreTake(spi->lock, portMAX_DELAY);
+        DISPLAY_STATS_RESET_SPI(&spi->spi_disp);
+        xSemaphoreGive(spi->lock);
+        display_messages_send_reply(&gen_message, OK_ATOM, ctx->global);
+        return;
+
     } else {
 #if REPORT_UNEXPECTED_MSGS
         fprintf(stderr, "display: ");
@@ -221,13 +292,9 @@ static void process_messages(void *arg)
     struct SPI *args = arg;
 
     while (true) {
-        Message *message;
-        xQueueReceive(display_messages_queue, &message, portMAX_DELAY);
+        Message *message = display_messages_receive();
         process_message(message, args->ctx);
-
-        BEGIN_WITH_STACK_HEAP(1, temp_heap);
-        mailbox_message_dispose(&message->base, &temp_heap);
-        END_WITH_STACK_HEAP(temp_heap, args->ctx->global);
+        display_messages_dispose(message, args->ctx->global);
     }
 }
 
@@ -236,7 +303,7 @@ static NativeHandlerResult display_driver_consume_mailbox(Context *ctx)
     MailboxMessage *mbox_msg = mailbox_take_message(&ctx->mailbox);
     Message *msg = CONTAINER_OF(mbox_msg, Message, base);
 
-    xQueueSend(display_messages_queue, &msg, 1);
+    display_messages_enqueue(msg);
 
     return NativeContinue;
 }
@@ -257,25 +324,43 @@ static void send_message(term pid, term message, GlobalContext *global)
 
 static void display_init(Context *ctx, term opts)
 {
+    display_atoms_init(ctx->global);
+
     screen = malloc(sizeof(struct Screen));
     // FIXME: hardcoded width and height
     screen->w = 400;
     screen->h = 240;
-    int memsize = 2 + 400 / 8 + 2;
+    frame_arena_init(&screen->arena);
 
-    screen->pixels = heap_caps_malloc(memsize, MALLOC_CAP_DMA);
+    screen->pixels = heap_caps_malloc(MEMORY_LCD_BATCH_SIZE, MALLOC_CAP_DMA);
     if (UNLIKELY(!screen->pixels)) {
         fprintf(stderr, "failed to allocate buf!\n");
         abort();
     }
 
-    screen->dma_out = heap_caps_malloc(memsize, MALLOC_CAP_DMA);
+    screen->dma_out = heap_caps_malloc(MEMORY_LCD_BATCH_SIZE, MALLOC_CAP_DMA);
     if (UNLIKELY(!screen->dma_out)) {
         fprintf(stderr, "failed to allocate buf!\n");
         abort();
     }
 
-    display_messages_queue = xQueueCreate(32, sizeof(Message *));
+    // panel content is unknown until the first update has been sent
+    screen->prev_lines = malloc(MEMORY_LCD_LINE_BYTES * screen->h);
+    if (UNLIKELY(!screen->prev_lines)) {
+        fprintf(stderr, "failed to allocate buf!\n");
+        abort();
+    }
+    screen->prev_lines_valid = false;
+
+    if (!display_messages_init(opts, ctx->global)) {
+        fprintf(stderr, "invalid coalesce_updates option!\n");
+        return;
+    }
+
+    if (!monochrome_dither_init(opts, screen->w, ctx->global)) {
+        fprintf(stderr, "invalid dither option!\n");
+        return;
+    }
 
     GlobalContext *glb = ctx->global;
 
@@ -283,6 +368,12 @@ static void display_init(Context *ctx, term opts)
     ctx->platform_data = spi;
 
     spi->ctx = ctx;
+    spi->lock = xSemaphoreCreateMutex();
+    spi->vcom_buf = heap_caps_malloc(2, MALLOC_CAP_DMA);
+    if (UNLIKELY(!spi->lock || !spi->vcom_buf)) {
+        fprintf(stderr, "failed to allocate buf!\n");
+        abort();
+    }
 
     struct SPIDisplayConfig spi_config;
     spi_display_init_config(&spi_config);
@@ -304,4 +395,5 @@ static void display_init(Context *ctx, term opts)
     }
 
     xTaskCreate(process_messages, "display", 10000, spi, 1, NULL);
+    xTaskCreate(vcom_task, "display_vcom", 2048, spi, 1, NULL);
 }
@@ -45,14 +45,14 @@
 
 #include <math.h>
 
+#include "display_messages.h"
+
 struct PendingReply
 {
     uint64_t pending_call_ref_ticks;
     term pending_call_pid;
 };
 
-static QueueHandle_t display_messages_queue;
-
 static NativeHandlerResult display_driver_consume_mailbox(Context *ctx);
 
 static void send_message(term pid, term message, GlobalContext *global);
@@ -76,6 +76,17 @@ static void process_message(Message *message, Context *ctx)
         term display_list = term_get_tuple_element(req, 1);
         do_update(ctx, display_list);
 
+    } else if (cmd == context_make_atom(ctx, "\x9"
+                                             "get_stats")) {
+        display_messages_send_stats(&gen_message, ctx->global);
+        return;
+
+    } else if (cmd == context_make_atom(ctx, "\xB"
+                                             "reset_stats")) {
+        display_messages_reset_stats();
+        display_messages_send_reply(&gen_message, OK_ATOM, ctx->global);
+        return;
+
     } else {
 #if REPORT_UNEXPECTED_MSGS
         fprintf(stderr, "display: ");
@@ -98,13 +109,9 @@ static void process_messages(void *arg)
     struct SPI *args = arg;
 
     while (true) {
-        Message *message;
-        xQueueReceive(display_messages_queue, &message, portMAX_DELAY);
+        Message *message = display_messages_receive();
         process_message(message, args->ctx);
-
-        BEGIN_WITH_STACK_HEAP(1, temp_heap);
-        mailbox_message_dispose(&message->base, &temp_heap);
-        END_WITH_STACK_HEAP(temp_heap, args->ctx->global);
+        display_messages_dispose(message, args->ctx->global);
     }
 }
 
@@ -113,7 +120,7 @@ static NativeHandlerResult display_driver_consume_mailbox(Context *ctx)
     MailboxMessage *mbox_msg = mailbox_take_message(&ctx->mailbox);
     Message *msg = CONTAINER_OF(mbox_msg, Message, base);
 
-    xQueueSend(display_messages_queue, &msg, 1);
+    display_messages_enqueue(msg);
 
     return NativeContinue;
 }
@@ -21,8 +21,36 @@
 #include <string.h>
 #include <math.h>
 
+#include "dither.h"
+
+// it is allocated only when an error diffusion mode is selected with the dither option
+static struct ErrorDiffusion monochrome_diffusion;
+
+static bool monochrome_dither_init(term opts, int width, GlobalContext *glb)
+{
+    enum dither_mode mode;
+    if (!dither_mode_from_opts(opts, &mode, glb)) {
+        return false;
+    }
+
+    return error_diffusion_init(&monochrome_diffusion, mode, width, 1);
+}
+
 static int get_color(int x, int y, uint8_t r, uint8_t g, uint8_t b)
 {
+    // get closest
+    // float yval = 0.2126 * r + 0.7152 * g + 0.0722 * b;
+    // the following is a fast formula
+    int yval = ((r << 1) + r + (g << 2) + b) >> 3;
+
+    if (monochrome_diffusion.mode != DitherOrdered) {
+        error_diffusion_seek(&monochrome_diffusion, y);
+        yval = error_diffusion_apply(&monochrome_diffusion, x, 0, yval);
+        int c = yval >= 128;
+        error_diffusion_spread(&monochrome_diffusion, x, 0, yval - (c ? 255 : 0));
+        return c;
+    }
+
     // dither
 
     /*
@@ -35,29 +63,29 @@ static int get_color(int x, int y, uint8_t r, uint8_t g, uint8_t b)
      *   The following is calculated applying the following code element by element
      *   r = 255 / values / 4
      *   roundf(63.75 * ((float) m[x % 4][y % 4] * 0.0625 - 0.5));
+     *
+     * The same offset is added to all channels, so it is added to the luma.
      */
-    const int m[4][4] = {
+    static const int8_t m[4][4] = {
         { -32, 0, -24, 8 },
         { 16, -16, 24, -8 },
         { -20, 12, -28, 4 },
         { 28, -4, 20, -12 }
     };
-
-    int v = m[x % 4][y % 4];
-    int out_r = r + v;
-    int out_g = g + v;
-    int out_b = b + v;
     // end of dither
 
-    // get closest
-    // float yval = 0.2126 * out_r + 0.7152 * out_g + 0.0722 * out_b;
-    // the following is a fast formula
-    int yval = ((out_r << 1) + out_r + (out_g << 2) + out_b) >> 3;
+    return yval + m[x & 3][y & 3] >= 128;
+}
+
+typedef uint32_t SurfaceColor;
 
-    return yval >= 128;
+// colors are kept as RGBA8888, since they are dithered when they are written
+static inline SurfaceColor uint32_color_to_surface(uint32_t color)
+{
+    return color;
 }
 
-static inline void draw_pixel_x(uint8_t *line_buf, int xpos, int color)
+static inline void draw_pixel_x(uint8_t *line_buf, int xpos, int ypos, SurfaceColor color)
 {
 #if CHECK_OVERFLOW
     if (xpos > DISPLAY_WIDTH) {
@@ -66,223 +94,11 @@ static inline void draw_pixel_x(uint8_t *line_buf, int xpos, int color)
     }
 #endif
 
-    int bpos = (xpos % 8);
-    line_buf[xpos / 8] = (line_buf[xpos / 8] & ~(0x1 << bpos)) | (color << bpos);
-}
-
-static int draw_image_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
-{
-    int x = item->x;
-    int y = item->y;
-
-    int bgcolor_r;
-    int bgcolor_g;
-    int bgcolor_b;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor_r = (item->brcolor >> 24) & 0xFF;
-        bgcolor_g = (item->brcolor >> 16) & 0xFF;
-        bgcolor_b = (item->brcolor >> 8) & 0xFF;
-        visible_bg = true;
-    } else {
-        bgcolor_r = 0;
-        bgcolor_g = 0;
-        bgcolor_b = 0;
-        visible_bg = false;
-    }
-
-    int width = item->width;
-    const char *data = item->data.image_data.pix;
-
-    int drawn_pixels = 0;
-
-    uint32_t *pixels = ((uint32_t *) data) + (ypos - y) * width + (xpos - x);
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        if ((*pixels >> 24) & 0xFF) {
-            uint8_t r = img_pixel >> 24;
-            uint8_t g = (img_pixel >> 16) & 0xFF;
-            uint8_t b = (img_pixel >> 8) & 0xFF;
-
-            uint8_t c = get_color(xpos + drawn_pixels, ypos, r, g, b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else if (visible_bg) {
-            uint8_t c = get_color(xpos + drawn_pixels, ypos, bgcolor_r, bgcolor_g, bgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        pixels++;
-    }
-
-    return drawn_pixels;
-}
-
-static int draw_scaled_cropped_img_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
-{
-    int x = item->x;
-    int y = item->y;
-
-    int bgcolor_r;
-    int bgcolor_g;
-    int bgcolor_b;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor_r = (item->brcolor >> 24) & 0xFF;
-        bgcolor_g = (item->brcolor >> 16) & 0xFF;
-        bgcolor_b = (item->brcolor >> 8) & 0xFF;
-        visible_bg = true;
-    } else {
-        bgcolor_r = 0;
-        bgcolor_g = 0;
-        bgcolor_b = 0;
-        visible_bg = false;
-    }
-
-    int width = item->width;
-    const char *data = item->data.image_data_with_size.pix;
-
-    int drawn_pixels = 0;
-
-    int y_scale = item->y_scale;
-    int x_scale = item->x_scale;
-    int img_width = item->data.image_data_with_size.width;
+    uint8_t r = color >> 24;
+    uint8_t g = (color >> 16) & 0xFF;
+    uint8_t b = (color >> 8) & 0xFF;
+    int c = get_color(xpos, ypos, r, g, b);
 
-    int source_x = item->source_x;
-    int source_y = item->source_y;
-
-    uint32_t *pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + ((xpos - x) / x_scale);
-
-    if (source_x + (width / x_scale) > img_width) {
-        width = (img_width - source_x) * x_scale;
-    }
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        if ((*pixels >> 24) & 0xFF) {
-            uint8_t r = img_pixel >> 24;
-            uint8_t g = (img_pixel >> 16) & 0xFF;
-            uint8_t b = (img_pixel >> 8) & 0xFF;
-
-            uint8_t c = get_color(xpos + drawn_pixels, ypos, r, g, b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else if (visible_bg) {
-            uint8_t c = get_color(xpos + drawn_pixels, ypos, bgcolor_r, bgcolor_g, bgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        //TODO: optimize here
-        pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + (j / x_scale);
-    }
-
-    return drawn_pixels;
-}
-
-static int draw_rect_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
-{
-    int x = item->x;
-    int width = item->width;
-
-    uint8_t r = (item->brcolor >> 24) & 0xFF;
-    uint8_t g = (item->brcolor >> 16) & 0xFF;
-    uint8_t b = (item->brcolor >> 8) & 0xFF;
-
-    int drawn_pixels = 0;
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint8_t c = get_color(xpos + drawn_pixels, ypos, r, g, b);
-        draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        drawn_pixels++;
-    }
-
-    return drawn_pixels;
-}
-
-static int draw_text_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
-{
-    int x = item->x;
-    int y = item->y;
-    bool visible_bg;
-
-    int fgcolor_r = (item->data.text_data.fgcolor >> 24) & 0xFF;
-    int fgcolor_g = (item->data.text_data.fgcolor >> 16) & 0xFF;
-    int fgcolor_b = (item->data.text_data.fgcolor >> 8) & 0xFF;
-
-    int bgcolor_r;
-    int bgcolor_g;
-    int bgcolor_b;
-
-    if (item->brcolor != 0) {
-        bgcolor_r = (item->brcolor >> 24) & 0xFF;
-        bgcolor_g = (item->brcolor >> 16) & 0xFF;
-        bgcolor_b = (item->brcolor >> 8) & 0xFF;
-        visible_bg = true;
-    } else {
-        bgcolor_r = 0;
-        bgcolor_g = 0;
-        bgcolor_b = 0;
-        visible_bg = false;
-    }
-
-    char *text = (char *) item->data.text_data.text;
-
-    int width = item->width;
-
-    int drawn_pixels = 0;
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        int char_index = j / CHAR_WIDTH;
-        char c = text[char_index];
-        unsigned const char *glyph = fontdata + ((unsigned char) c) * 16;
-
-        unsigned char row = glyph[ypos - y];
-
-        bool opaque;
-        int k = j % CHAR_WIDTH;
-        if (row & (1 << (7 - k))) {
-            opaque = true;
-        } else {
-            opaque = false;
-        }
-
-        if (opaque) {
-            uint8_t c = get_color(xpos + drawn_pixels, ypos, fgcolor_r, fgcolor_g, fgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else if (visible_bg) {
-            uint8_t c = get_color(xpos + drawn_pixels, ypos, bgcolor_r, bgcolor_g, bgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-    }
-
-    return drawn_pixels;
+    int bpos = (xpos % 8);
+    line_buf[xpos / 8] = (line_buf[xpos / 8] & ~(0x1 << bpos)) | (c << bpos);
 }
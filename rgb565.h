@@ -0,0 +1,151 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2020-2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// RGB565 pixel format back end for draw_common.h, pixels are stored in the line buffer with
+// the same byte order that is expected by the panel.
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include <driver/spi_master.h>
+#else
+// host builds, such as the rasterizer benchmark, same as the ESP-IDF macro
+#define SPI_SWAP_DATA_TX(data, len) __builtin_bswap32((uint32_t) (data) << (32 - (len)))
+#endif
+
+#include <utils.h>
+
+#define SURFACE_ALPHA_BLEND 1
+#define SURFACE_SPAN_FUNCTIONS 1
+
+typedef uint16_t SurfaceColor;
+
+// This functions is taken from:
+// https://stackoverflow.com/questions/18937701/combining-two-16-bits-rgb-colors-with-alpha-blending
+static inline uint16_t alpha_blend_rgb565(uint32_t fg, uint32_t bg, uint8_t alpha)
+{
+    alpha = (alpha + 4) >> 3;
+    bg = (bg | (bg << 16)) & 0b00000111111000001111100000011111;
+    fg = (fg | (fg << 16)) & 0b00000111111000001111100000011111;
+    uint32_t result = ((((fg - bg) * alpha) >> 5) + bg) & 0b00000111111000001111100000011111;
+    return (uint16_t)((result >> 16) | result);
+}
+
+static inline uint16_t rgba8888_color_to_rgb565(uint32_t color)
+{
+    uint8_t r = color >> 24;
+    uint8_t g = (color >> 16) & 0xFF;
+    uint8_t b = (color >> 8) & 0xFF;
+
+    return (((uint16_t)(r >> 3)) << 11) | (((uint16_t)(g >> 2)) << 5) | ((uint16_t) b >> 3);
+}
+
+static inline SurfaceColor rgb565_color_to_surface(uint16_t color16)
+{
+    return (uint16_t) SPI_SWAP_DATA_TX(color16, 16);
+}
+
+static inline SurfaceColor uint32_color_to_surface(uint32_t color)
+{
+    uint16_t color16 = rgba8888_color_to_rgb565(color);
+
+    return rgb565_color_to_surface(color16);
+}
+
+static inline SurfaceColor alpha_blend_to_surface(uint32_t fg, uint32_t bg, uint8_t alpha)
+{
+    uint16_t blended = alpha_blend_rgb565(rgba8888_color_to_rgb565(fg), rgba8888_color_to_rgb565(bg), alpha);
+
+    return rgb565_color_to_surface(blended);
+}
+
+static inline void draw_pixel_x(uint8_t *line_buf, int xpos, int ypos, SurfaceColor color)
+{
+    UNUSED(ypos);
+
+    uint16_t *pixmem16 = (uint16_t *) line_buf;
+    pixmem16[xpos] = color;
+}
+
+// Line buffers are 32 bit aligned, so after an odd leading pixel two pixels are stored at once.
+static inline void fill_span_x(uint8_t *line_buf, int xpos, int ypos, int len, SurfaceColor color)
+{
+    UNUSED(ypos);
+
+    uint16_t *pixmem16 = ((uint16_t *) line_buf) + xpos;
+
+    if ((xpos & 1) && (len > 0)) {
+        *pixmem16 = color;
+        pixmem16++;
+        len--;
+    }
+
+    uint32_t *pixmem32 = (uint32_t *) pixmem16;
+    uint32_t color32 = ((uint32_t) color << 16) | color;
+    int words = len / 2;
+
+    int i = 0;
+    for (; i + 4 <= words; i += 4) {
+        pixmem32[i] = color32;
+        pixmem32[i + 1] = color32;
+        pixmem32[i + 2] = color32;
+        pixmem32[i + 3] = color32;
+    }
+    for (; i < words; i++) {
+        pixmem32[i] = color32;
+    }
+
+    if (len & 1) {
+        pixmem16[len - 1] = color;
+    }
+}
+
+static inline void rgba8888_span_to_surface_x(uint8_t *line_buf, int xpos, int ypos, const uint32_t *pixels, int len)
+{
+    UNUSED(ypos);
+
+    uint16_t *pixmem16 = ((uint16_t *) line_buf) + xpos;
+
+    int i = 0;
+    if ((xpos & 1) && (len > 0)) {
+        pixmem16[0] = uint32_color_to_surface(READ_32_UNALIGNED(pixels));
+        i = 1;
+    }
+
+    for (; i + 1 < len; i += 2) {
+        uint32_t c0 = uint32_color_to_surface(READ_32_UNALIGNED(pixels + i));
+        uint32_t c1 = uint32_color_to_surface(READ_32_UNALIGNED(pixels + i + 1));
+        // ESP32 is little endian: the first pixel goes into the lower half
+        *((uint32_t *) (pixmem16 + i)) = c0 | (c1 << 16);
+    }
+
+    if (i < len) {
+        pixmem16[i] = uint32_color_to_surface(READ_32_UNALIGNED(pixels + i));
+    }
+}
+
+// Source pixels are big endian, that is the same byte order of the line buffer
+static inline void rgb565_span_to_surface_x(uint8_t *line_buf, int xpos, int ypos, const uint8_t *pixels, int len)
+{
+    UNUSED(ypos);
+
+    memcpy(line_buf + xpos * sizeof(uint16_t), pixels, len * sizeof(uint16_t));
+}
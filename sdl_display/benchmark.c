@@ -0,0 +1,394 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Host benchmark of the shared rasterizer: synthetic display lists are rendered with the same
+// RGB565 back end that is used by ILI934x and ST7789 drivers, one line at a time through draw_x.
+// Items are built directly, so display list parsing is not measured.
+//
+// For each scenario ns/pixel, frames/s and a checksum of the rendered frame are printed, the
+// checksum must not change when a rasterizer optimization is expected to be pixel exact.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <context.h>
+#include <utils.h>
+
+#define CHAR_WIDTH 8
+#include "../display_items.h"
+#include "../font.c"
+#include "../rgb565.h"
+#include "../draw_common.h"
+
+#define BENCH_WIDTH 320
+#define BENCH_HEIGHT 240
+#define BENCH_MAX_ITEMS 256
+#define BENCH_DEFAULT_FRAMES 200
+
+#define ICON_SIZE 24
+#define ALPHA_IMAGE_SIZE 64
+#define SPRITE_SIZE 32
+#define SPRITE_SHEET_SIZE (SPRITE_SIZE * 4)
+
+static uint16_t frame[BENCH_WIDTH * BENCH_HEIGHT];
+
+static BaseDisplayItem items[BENCH_MAX_ITEMS];
+static int items_count;
+
+// text items point to these strings, one for each row of text
+static char text_lines[BENCH_HEIGHT / 16][BENCH_WIDTH / CHAR_WIDTH + 1];
+static char dashboard_strings[32][16];
+
+static uint8_t alpha_image[ALPHA_IMAGE_SIZE * ALPHA_IMAGE_SIZE * 4];
+static uint8_t icon_image[ICON_SIZE * ICON_SIZE * 3];
+static uint8_t sprite_sheet[SPRITE_SHEET_SIZE * SPRITE_SHEET_SIZE * 4];
+
+static uint32_t random_state;
+
+// xorshift32, so scenarios are the same on every host
+static uint32_t next_random(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+
+    return random_state;
+}
+
+static int random_range(int min, int max)
+{
+    return min + (int) (next_random() % (uint32_t) (max - min + 1));
+}
+
+// Colors are RGB888, as in display lists
+static BaseDisplayItem *add_item(enum primitive primitive, int x, int y, int width, int height, uint32_t bgcolor)
+{
+    if (items_count == BENCH_MAX_ITEMS) {
+        fprintf(stderr, "too many items.\n");
+        abort();
+    }
+
+    BaseDisplayItem *item = &items[items_count];
+    items_count++;
+    memset(item, 0, sizeof(BaseDisplayItem));
+    item->primitive = primitive;
+    item->x = x;
+    item->y = y;
+    item->width = width;
+    item->height = height;
+    item->brcolor = bgcolor << 8 | 0xFF;
+
+    return item;
+}
+
+static void add_rect(int x, int y, int width, int height, uint32_t color)
+{
+    add_item(Rect, x, y, width, height, color);
+}
+
+static void add_text(int x, int y, const char *text, uint32_t fgcolor, bool transparent, uint32_t bgcolor)
+{
+    BaseDisplayItem *item = add_item(Text, x, y, strlen(text) * CHAR_WIDTH, 16, bgcolor);
+    if (transparent) {
+        item->brcolor = 0;
+    }
+    item->data.text_data.fgcolor = fgcolor << 8 | 0xFF;
+    item->data.text_data.text = text;
+}
+
+static void add_image(int x, int y, int width, int height, const void *pix, enum image_format format,
+    bool transparent, uint32_t bgcolor)
+{
+    BaseDisplayItem *item = add_item(Image, x, y, width, height, bgcolor);
+    if (transparent) {
+        item->brcolor = 0;
+    }
+    item->data.image_data.pix = pix;
+    item->data.image_data.format = format;
+}
+
+// scale is in 1/4 units, source is a sprite of the sheet
+static void add_sprite(int x, int y, int sprite, int scale, enum scale_filter filter)
+{
+    int size = SPRITE_SIZE * scale / 4;
+    BaseDisplayItem *item = add_item(ScaledCroppedImage, x, y, size, size, 0);
+    item->brcolor = 0;
+    item->data.image_data_with_size.width = SPRITE_SHEET_SIZE;
+    item->data.image_data_with_size.height = SPRITE_SHEET_SIZE;
+    item->data.image_data_with_size.pix = (const char *) sprite_sheet;
+    item->data.image_data_with_size.format = FormatRGBA8888;
+    item->source_x = (sprite % 4) * SPRITE_SIZE;
+    item->source_y = (sprite / 4) * SPRITE_SIZE;
+    // same rounding of parse_scale_factor
+    item->x_step = (65536 * 4 + scale - 1) / scale;
+    item->y_step = item->x_step;
+    item->filter = filter;
+}
+
+static void put_rgba(uint8_t *pixel, uint32_t rgb, uint8_t alpha)
+{
+    pixel[0] = rgb >> 16;
+    pixel[1] = (rgb >> 8) & 0xFF;
+    pixel[2] = rgb & 0xFF;
+    pixel[3] = alpha;
+}
+
+static void init_images(void)
+{
+    // a disc that fades out, with a fully transparent corner
+    int center = ALPHA_IMAGE_SIZE / 2;
+    for (int y = 0; y < ALPHA_IMAGE_SIZE; y++) {
+        for (int x = 0; x < ALPHA_IMAGE_SIZE; x++) {
+            int d2 = (x - center) * (x - center) + (y - center) * (y - center);
+            int alpha = 255 - (d2 * 255) / (center * center);
+            alpha = (alpha < 0) ? 0 : ((d2 < (center * center) / 4) ? 255 : alpha);
+            uint32_t rgb = ((x * 4) << 16) | ((y * 4) << 8) | 0x80;
+            put_rgba(alpha_image + (y * ALPHA_IMAGE_SIZE + x) * 4, rgb, alpha);
+        }
+    }
+
+    // rgb565a8 icon: a square frame with antialiased edges
+    int plane_size = ICON_SIZE * ICON_SIZE;
+    for (int i = 0; i < plane_size; i++) {
+        int x = i % ICON_SIZE;
+        int y = i / ICON_SIZE;
+        uint16_t color = ((x * 31 / ICON_SIZE) << 11) | ((y * 63 / ICON_SIZE) << 5) | 0x10;
+        icon_image[i * 2] = color >> 8;
+        icon_image[i * 2 + 1] = color & 0xFF;
+        bool edge = (x == 0) || (y == 0) || (x == ICON_SIZE - 1) || (y == ICON_SIZE - 1);
+        bool inside = (x > 3) && (y > 3) && (x < ICON_SIZE - 4) && (y < ICON_SIZE - 4);
+        icon_image[plane_size * 2 + i] = edge ? 0x80 : (inside ? 0 : 0xFF);
+    }
+
+    // each sprite is a diamond on a transparent background
+    for (int y = 0; y < SPRITE_SHEET_SIZE; y++) {
+        for (int x = 0; x < SPRITE_SHEET_SIZE; x++) {
+            int sprite = (y / SPRITE_SIZE) * 4 + (x / SPRITE_SIZE);
+            int dx = abs(x % SPRITE_SIZE - SPRITE_SIZE / 2);
+            int dy = abs(y % SPRITE_SIZE - SPRITE_SIZE / 2);
+            bool opaque = dx + dy < SPRITE_SIZE / 2;
+            uint32_t rgb = ((sprite * 16) << 16) | ((255 - sprite * 16) << 8) | ((dx + dy) * 16);
+            put_rgba(sprite_sheet + (y * SPRITE_SHEET_SIZE + x) * 4, rgb, opaque ? 0xFF : 0);
+        }
+    }
+}
+
+// Every scenario ends with a full screen rect, as display lists usually do: pixels that are not
+// covered by any item are not written at all.
+
+static void build_overlapping_rects(void)
+{
+    for (int i = 0; i < 200; i++) {
+        int width = random_range(16, 128);
+        int height = random_range(16, 128);
+        add_rect(random_range(-16, BENCH_WIDTH - 16), random_range(-16, BENCH_HEIGHT - 16), width, height,
+            next_random() & 0xFFFFFF);
+    }
+    add_rect(0, 0, BENCH_WIDTH, BENCH_HEIGHT, 0x000000);
+}
+
+static void build_dense_text(void)
+{
+    int rows = BENCH_HEIGHT / 16;
+    int columns = BENCH_WIDTH / CHAR_WIDTH;
+    for (int row = 0; row < rows; row++) {
+        for (int i = 0; i < columns; i++) {
+            text_lines[row][i] = 0x21 + (row * columns + i) % 94;
+        }
+        text_lines[row][columns] = '\0';
+        // half of the rows have a transparent background, so rects below are drawn between glyphs
+        add_text(0, row * 16, text_lines[row], 0xFFFFFF, row & 1, 0x202020);
+    }
+    for (int i = 0; i < 8; i++) {
+        add_rect(i * (BENCH_WIDTH / 8), 0, BENCH_WIDTH / 8, BENCH_HEIGHT, 0x101010 * (i + 1));
+    }
+}
+
+static void build_alpha_images(void)
+{
+    for (int i = 0; i < 12; i++) {
+        int x = (i % 6) * 52;
+        int y = (i / 6) * 88 + 24;
+        // blended with their own background, or drawn over items below where not opaque
+        add_image(x, y, ALPHA_IMAGE_SIZE, ALPHA_IMAGE_SIZE, alpha_image, FormatRGBA8888, i & 1, 0x4060A0);
+    }
+    for (int i = 0; i < 12; i++) {
+        add_image(i * 26 + 4, 4, ICON_SIZE, ICON_SIZE, icon_image, FormatRGB565A8, i & 1, 0x203040);
+    }
+    for (int i = 0; i < 4; i++) {
+        add_rect(0, i * (BENCH_HEIGHT / 4), BENCH_WIDTH, BENCH_HEIGHT / 4, 0x305070 + i * 0x101010);
+    }
+}
+
+static void build_scaled_sprites(void)
+{
+    for (int i = 0; i < 24; i++) {
+        int scale = 4 + (i % 9);
+        enum scale_filter filter = (i & 1) ? FilterBilinear : FilterNearest;
+        add_sprite(random_range(-16, BENCH_WIDTH - 48), random_range(-16, BENCH_HEIGHT - 48), i % 16, scale, filter);
+    }
+    add_rect(0, 0, BENCH_WIDTH, BENCH_HEIGHT, 0x204020);
+}
+
+// 60 items: a header, 10 cards made of 5 items each, a footer and the background
+static void build_dashboard(void)
+{
+    int next_string = 0;
+
+    add_text(4, 4, "Dashboard", 0xFFFFFF, true, 0);
+    add_text(BENCH_WIDTH - 44, 4, "12:34", 0xFFFF00, true, 0);
+    add_rect(0, 0, BENCH_WIDTH, 24, 0x102040);
+
+    for (int i = 0; i < 10; i++) {
+        int x = 4 + (i % 2) * 160;
+        int y = 28 + (i / 2) * 40;
+
+        char *title = dashboard_strings[next_string++];
+        char *value = dashboard_strings[next_string++];
+        snprintf(title, sizeof(dashboard_strings[0]), "Sensor %d", i);
+        snprintf(value, sizeof(dashboard_strings[0]), "%d", 1000 + i * 137);
+
+        add_text(x + 4, y + 2, title, 0xC0C0C0, true, 0);
+        add_text(x + 4, y + 20, value, 0xFFFFFF, false, 0x303030);
+        add_image(x + 128, y + 7, ICON_SIZE, ICON_SIZE, icon_image, FormatRGB565A8, true, 0);
+        add_rect(x + 48, y + 26, 8 + i * 7, 6, 0x00C040);
+        add_rect(x, y, 152, 38, 0x303030);
+    }
+
+    for (int i = 0; i < 5; i++) {
+        add_rect(4 + i * 20, 230, 16, 8, (i & 1) ? 0xC00000 : 0x00C000);
+    }
+    add_rect(0, 228, BENCH_WIDTH, 12, 0x102040);
+    add_rect(0, 0, BENCH_WIDTH, BENCH_HEIGHT, 0x000000);
+}
+
+struct Scenario
+{
+    const char *name;
+    void (*build)(void);
+};
+
+static const struct Scenario scenarios[] = {
+    { "overlapping_rects", build_overlapping_rects },
+    { "dense_text", build_dense_text },
+    { "alpha_images", build_alpha_images },
+    { "scaled_sprites", build_scaled_sprites },
+    { "dashboard", build_dashboard },
+};
+
+// Renders the whole frame, the scanline index is built on every frame, as drivers do.
+static void render_frame(struct FrameArena *arena)
+{
+    struct ScanlineIndex index;
+    scanline_index_init(&index, items, items_count, BENCH_WIDTH, arena);
+
+    for (int ypos = 0; ypos < BENCH_HEIGHT; ypos++) {
+        uint8_t *line_buf = (uint8_t *) (frame + ypos * BENCH_WIDTH);
+        int xpos = 0;
+        while (xpos < BENCH_WIDTH) {
+            int drawn_pixels = draw_x(line_buf, xpos, ypos, &index);
+            xpos += drawn_pixels;
+        }
+    }
+
+    frame_arena_reset(arena);
+}
+
+// FNV-1a of the frame, with pixels in the byte order they are sent to the panel
+static uint32_t frame_checksum(void)
+{
+    const uint8_t *bytes = (const uint8_t *) frame;
+    uint32_t hash = 2166136261;
+    for (size_t i = 0; i < sizeof(frame); i++) {
+        hash = (hash ^ bytes[i]) * 16777619;
+    }
+
+    return hash;
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+    int frames = BENCH_DEFAULT_FRAMES;
+    const char *only = NULL;
+    if (argc > 1) {
+        frames = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        only = argv[2];
+    }
+    if ((argc > 3) || (frames <= 0)) {
+        fprintf(stderr, "usage: %s [frames] [scenario]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    init_images();
+
+    struct FrameArena arena;
+    frame_arena_init(&arena);
+
+    printf("%-18s %8s %10s %10s %10s %6s\n", "scenario", "items", "frames/s", "ns/pixel", "checksum", "frames");
+
+    bool found = false;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        const struct Scenario *scenario = &scenarios[i];
+        if (only && strcmp(only, scenario->name)) {
+            continue;
+        }
+        found = true;
+
+        random_state = 0x12345678 + i;
+        items_count = 0;
+        scenario->build();
+
+        // first frame grows the arena to its steady state size
+        render_frame(&arena);
+
+        struct timespec start;
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int j = 0; j < frames; j++) {
+            render_frame(&arena);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double ns = elapsed_ns(&start, &end);
+        double ns_per_pixel = ns / ((double) frames * BENCH_WIDTH * BENCH_HEIGHT);
+        double fps = frames * 1e9 / ns;
+
+        printf("%-18s %8d %10.1f %10.2f 0x%08X %6d\n", scenario->name, items_count, fps, ns_per_pixel,
+            (unsigned int) frame_checksum(), frames);
+    }
+
+    if (!found) {
+        fprintf(stderr, "unknown scenario: %s\n", only);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
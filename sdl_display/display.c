@@ -40,6 +40,7 @@
 
 #define CHAR_WIDTH 8
 #include "../display_items.h"
+#include "../damage_tracking.h"
 #include "../font.c"
 #include "../image_helpers.h"
 
@@ -64,15 +65,6 @@ struct MouseEvent
     int y;
 };
 
-struct Rectangle
-{
-    int x;
-    int y;
-    int width;
-    int height;
-    bool valid;
-};
-
 static term keyboard_pid;
 static struct timespec ts0;
 Context *the_ctx;
@@ -100,6 +92,13 @@ Message *prev_message = NULL;
 BaseDisplayItem *prev_items = NULL;
 int prev_items_len = 0;
 
+// previous display list is kept until next one has been built, so arenas are used in turn:
+// prev_items always lives in arenas[next_arena ^ 1]
+static struct FrameArena arenas[2];
+static int next_arena = 0;
+// unchanged items are copied from previous display list instead of being parsed again
+static bool retain_items = false;
+
 static void destroy_message(Message *m, GlobalContext *global)
 {
     BEGIN_WITH_STACK_HEAP(1, temp_heap);
@@ -107,412 +106,340 @@ static void destroy_message(Message *m, GlobalContext *global)
     END_WITH_STACK_HEAP(temp_heap, global);
 }
 
-static inline int int_min(int a, int b)
+typedef Uint32 SurfaceColor;
+
+static inline SurfaceColor uint32_color_to_surface(uint32_t color)
 {
-    return (a > b) ? b : a;
+    return SDL_MapRGB(screen->format, (color >> 24) & 0xFF, (color >> 16) & 0xFF, (color >> 8) & 0xFF);
 }
 
-static inline int int_max(int a, int b)
+static inline void draw_pixel_x(uint8_t *line_buf, int xpos, int ypos, SurfaceColor color)
 {
-    return (a > b) ? a : b;
+    Uint32 *pixmem32 = (Uint32 *) line_buf;
+    pixmem32[xpos] = color;
 }
 
-static bool cmp_display_item(BaseDisplayItem *a, BaseDisplayItem *b)
-{
-    if (a->primitive != b->primitive || a->x != b->x || a->y != b->y ||
-            a->width != b->width || a->height != b->height || a->brcolor != b->brcolor) {
-        return false;
-    }
+#include "../draw_common.h"
 
-    switch (a->primitive) {
-        case Image:
-            return a->data.image_data.pix == b->data.image_data.pix;
+// Damaged rectangles are split into bands of rows, that are rendered and scaled up by a pool of
+// worker threads (AVM_SDL_DISPLAY_THREADS, including the display one). Rectangles are disjoint,
+// so bands never share pixels, and each worker seeks rows with its own scanline index fork.
+#define RENDER_BAND_ROWS 16
+#define RENDER_MAX_THREADS 16
 
-        case Rect:
-            return true;
+struct RenderBand
+{
+    int x;
+    int width;
+    int y0;
+    int y1;
+};
 
-        case Text:
-            return (a->data.text_data.fgcolor == b->data.text_data.fgcolor) &&
-                !strcmp(a->data.text_data.text, b->data.text_data.text);
+struct RenderPool
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    unsigned int generation;
+
+    const struct RenderBand *bands;
+    int bands_count;
+    int next_band;
+    // bands that have not been completed yet, including the ones that are being rendered
+    int pending_bands;
+
+    int workers_count;
+    struct ScanlineIndex indexes[RENDER_MAX_THREADS - 1];
+};
 
-        case ScaledCroppedImage:
-            return (a->data.image_data.pix == b->data.image_data.pix) &&
-                (a->x_scale == b->x_scale) && (a->y_scale == b->y_scale) &&
-                (a->source_x == b->source_x) && (a->source_y == b->source_y);
+static struct RenderPool render_pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
 
-        default: {
-            return true;
+static void render_band(const struct RenderBand *band, struct ScanlineIndex *index)
+{
+    for (int ypos = band->y0; ypos < band->y1; ypos++) {
+        uint8_t *line_buf = ((uint8_t *) screen->pixels) + screen->w * ypos * BPP;
+        int xpos = band->x;
+        while (xpos < band->x + band->width) {
+            int drawn_pixels = draw_x(line_buf, xpos, ypos, index);
+            xpos += drawn_pixels;
         }
     }
-}
 
-static void update_damaged_area(struct Rectangle *area, const struct Rectangle *damage)
-{
-    if (area->valid) {
-        area->x = int_min(area->x, damage->x);
-        area->y = int_min(area->y, damage->y);
-        area->width = int_max(area->x + area->width, damage->x + damage->width) - area->x;
-        area->height = int_max(area->y + area->height, damage->y + damage->height) - area->y;
-    } else {
-        area->x = damage->x;
-        area->y = damage->y;
-        area->width = damage->width;
-        area->height = damage->height;
-        area->valid = true;
+    // Copy and scale up
+    int scale = screen->scale;
+    for (int ypos = band->y0 * scale; ypos < band->y1 * scale; ypos++) {
+        const Uint32 *srcpix = (const Uint32 *) (((uint8_t *) screen->pixels) + screen->w * (ypos / scale) * BPP);
+        Uint32 *destpix = (Uint32 *) (((uint8_t *) surface->pixels) + surface->w * ypos * BPP);
+        for (int xpos = band->x * scale; xpos < (band->x + band->width) * scale; xpos++) {
+            destpix[xpos] = srcpix[xpos / scale];
+        }
     }
 }
 
-static void clip_rectangle(struct Rectangle *rectangle, const struct Rectangle *clip_region)
+// Called with the mutex held, that is held again on return
+static void render_pool_run_bands(struct ScanlineIndex *index)
 {
-    rectangle->x = int_max(rectangle->x, clip_region->x);
-    rectangle->y = int_max(rectangle->y, clip_region->y);
-    rectangle->width = int_min(rectangle->x + rectangle->width, clip_region->x + clip_region->width) - rectangle->x;
-    rectangle->height = int_min(rectangle->y + rectangle->height, clip_region->y + clip_region->height) - rectangle->y;
-}
+    while (render_pool.next_band < render_pool.bands_count) {
+        const struct RenderBand *band = &render_pool.bands[render_pool.next_band];
+        render_pool.next_band++;
 
-static void dumb_diff(BaseDisplayItem *orig, int orig_len, BaseDisplayItem *new, int new_len, struct Rectangle *damaged)
-{
-    if (orig_len == 0) {
-        for (int i = 0; i < new_len; i++) {
-            struct Rectangle irect = {
-                .x = new[i].x,
-                .y = new[i].y,
-                .width = new[i].width,
-                .height = new[i].height,
-                .valid = true
-            };
-            update_damaged_area(damaged, &irect);
-        }
-        return;
-    }
-
-    int j = 0;
+        pthread_mutex_unlock(&render_pool.mutex);
+        render_band(band, index);
+        pthread_mutex_lock(&render_pool.mutex);
 
-    for (int i = 0; i < new_len; i++) {
-        if (cmp_display_item(&new[i], &orig[j])) {
-            j++;
-        } else {
-            bool found = false;
-            for (int k = j + 1; k < orig_len; k++) {
-                if (cmp_display_item(&new[i], &orig[k])) {
-                    for (int l = k - j; l < k; l++) {
-                        struct Rectangle irect = {
-                            .x = orig[l].x,
-                            .y = orig[l].y,
-                            .width = orig[l].width,
-                            .height = orig[l].height,
-                            .valid = true
-                        };
-                        update_damaged_area(damaged, &irect);
-                    }
-
-                    j = k + 1;
-                    found = true;
-                    break;
-                }
-            }
-            if (!found) {
-                struct Rectangle irect = {
-                    .x = new[i].x,
-                    .y = new[i].y,
-                    .width = new[i].width,
-                    .height = new[i].height,
-                    .valid = true
-                };
-                update_damaged_area(damaged, &irect);
-            }
+        render_pool.pending_bands--;
+        if (render_pool.pending_bands == 0) {
+            pthread_cond_signal(&render_pool.done);
         }
     }
 }
 
-static inline Uint32 uint32_color_to_surface(struct Screen *screen, uint32_t color)
-{
-    return SDL_MapRGB(screen->format, (color >> 24) & 0xFF, (color >> 16) & 0xFF, (color >> 8) & 0xFF);
-}
-
-struct Surface
-{
-    int width;
-    int height;
-    void *buffer;
-};
-
-void epd_draw_pixel(int xpos, int ypos, uint8_t color, void *buffer)
+static void *render_worker(void *arg)
 {
-    struct Surface *surface = buffer;
+    struct ScanlineIndex *index = arg;
 
-    if (xpos < 0 || ypos < 0 || xpos >= surface->width || ypos >= surface->height) {
-        return;
+    pthread_mutex_lock(&render_pool.mutex);
+    unsigned int generation = render_pool.generation;
+    while (true) {
+        while (render_pool.generation == generation) {
+            pthread_cond_wait(&render_pool.work, &render_pool.mutex);
+        }
+        generation = render_pool.generation;
+        render_pool_run_bands(index);
     }
 
-    Uint32 *pixmem32b = (Uint32 *) (((uint8_t *) surface->buffer) + surface->width * ypos * BPP + xpos * BPP);
-
-    //TODO: handle other colors than black
-    UNUSED(color);
-    *pixmem32b = 0xFF000000;
+    return NULL;
 }
 
-static int draw_image_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static int get_render_threads()
 {
-    int x = item->x;
-    int y = item->y;
-
-    Uint32 bgcolor;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor = uint32_color_to_surface(screen, item->brcolor);
-        visible_bg = true;
-    } else {
-        visible_bg = false;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *threads_str = getenv("AVM_SDL_DISPLAY_THREADS");
+    if (threads_str && (strlen(threads_str) > 0)) {
+        char *first_invalid;
+        threads = strtol(threads_str, &first_invalid, 10);
+        if (*first_invalid != '\0') {
+            threads = 1;
+        }
     }
 
-    int width = item->width;
-    const char *data = item->data.image_data.pix;
-
-    int drawn_pixels = 0;
-
-    uint32_t *pixels = ((uint32_t *) data) + (ypos - y) * width + (xpos - x);
-    Uint32 *pixmem32 = (Uint32 *) (((uint8_t *) screen->pixels) + screen->w * ypos * BPP + xpos * BPP);
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
+    if (threads < 1) {
+        return 1;
     }
+    return (threads > RENDER_MAX_THREADS) ? RENDER_MAX_THREADS : threads;
+}
 
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        if ((*pixels >> 24) & 0xFF) {
-            Uint32 color = uint32_color_to_surface(screen, img_pixel);
-            pixmem32[drawn_pixels] = color;
-        } else if (visible_bg) {
-            pixmem32[drawn_pixels] = bgcolor;
-        } else {
-            return drawn_pixels;
+static void render_pool_init(int threads)
+{
+    render_pool.workers_count = 0;
+    for (int i = 0; i < threads - 1; i++) {
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, NULL, render_worker, &render_pool.indexes[i]) != 0) {
+            fprintf(stderr, "Warning: failed to start render worker, using %i threads\n", i + 1);
+            break;
         }
-        drawn_pixels++;
-        pixels++;
+        pthread_detach(thread_id);
+        render_pool.workers_count++;
     }
-
-    return drawn_pixels;
 }
 
-static int draw_scaled_cropped_img_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+// Blocks until all damaged rectangles have been rendered, the display thread renders bands too.
+static void render_pool_draw(const struct DamageList *damaged, struct ScanlineIndex *index, struct FrameArena *arena)
 {
-    int x = item->x;
-    int y = item->y;
-
-    Uint32 bgcolor;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor = uint32_color_to_surface(screen, item->brcolor);
-        visible_bg = true;
-    } else {
-        visible_bg = false;
+    int bands_count = 0;
+    for (int i = 0; i < damaged->count; i++) {
+        bands_count += (damaged->rectangles[i].height + RENDER_BAND_ROWS - 1) / RENDER_BAND_ROWS;
     }
-
-    int width = item->width;
-    const char *data = item->data.image_data_with_size.pix;
-
-    int drawn_pixels = 0;
-
-    int y_scale = item->y_scale;
-    int x_scale = item->x_scale;
-    int img_width = item->data.image_data_with_size.width;
-
-    int source_x = item->source_x;
-    int source_y = item->source_y;
-
-    uint32_t *pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + ((xpos - x) / x_scale);
-    Uint32 *pixmem32 = (Uint32 *) (((uint8_t *) screen->pixels) + screen->w * ypos * BPP + xpos * BPP);
-
-    if (source_x + (width / x_scale) > img_width) {
-        width = (img_width - source_x) * x_scale;
+    if (bands_count == 0) {
+        return;
     }
 
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
+    struct RenderBand *bands = frame_arena_alloc(arena, sizeof(struct RenderBand) * bands_count);
+    if (IS_NULL_PTR(bands)) {
+        fprintf(stderr, "Failed to allocate render bands\n");
+        return;
     }
 
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        if ((*pixels >> 24) & 0xFF) {
-            Uint32 color = uint32_color_to_surface(screen, img_pixel);
-            pixmem32[drawn_pixels] = color;
-        } else if (visible_bg) {
-            pixmem32[drawn_pixels] = bgcolor;
-        } else {
-            return drawn_pixels;
+    int band_index = 0;
+    for (int i = 0; i < damaged->count; i++) {
+        const struct Rectangle *rect = &damaged->rectangles[i];
+        for (int y = rect->y; y < rect->y + rect->height; y += RENDER_BAND_ROWS) {
+            struct RenderBand *band = &bands[band_index];
+            band->x = rect->x;
+            band->width = rect->width;
+            band->y0 = y;
+            band->y1 = int_min(y + RENDER_BAND_ROWS, rect->y + rect->height);
+            band_index++;
         }
-        drawn_pixels++;
-        pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + (j / x_scale);
     }
 
-    return drawn_pixels;
-}
-
-static int draw_rect_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
-{
-    int x = item->x;
-    int width = item->width;
-    uint32_t color = uint32_color_to_surface(screen, item->brcolor);
-
-    int drawn_pixels = 0;
-
-    Uint32 *pixmem32 = (Uint32 *) (((uint8_t *) screen->pixels) + screen->w * ypos * BPP + xpos * BPP);
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
+    // workers do not take bands here, so their indexes can be replaced
+    bool parallel = (render_pool.workers_count > 0) && (bands_count > 1);
+    for (int i = 0; parallel && (i < render_pool.workers_count); i++) {
+        parallel = scanline_index_fork(&render_pool.indexes[i], index, arena);
     }
 
-    for (int j = xpos - x; j < width; j++) {
-        pixmem32[drawn_pixels] = color;
-        drawn_pixels++;
+    // pool state is left untouched, so workers that wake up late find no bands
+    if (!parallel) {
+        for (int i = 0; i < bands_count; i++) {
+            render_band(&bands[i], index);
+        }
+        return;
     }
 
-    return drawn_pixels;
+    pthread_mutex_lock(&render_pool.mutex);
+    render_pool.bands = bands;
+    render_pool.bands_count = bands_count;
+    render_pool.next_band = 0;
+    render_pool.pending_bands = bands_count;
+    render_pool.generation++;
+    pthread_cond_broadcast(&render_pool.work);
+
+    render_pool_run_bands(index);
+    while (render_pool.pending_bands > 0) {
+        pthread_cond_wait(&render_pool.done, &render_pool.mutex);
+    }
+    pthread_mutex_unlock(&render_pool.mutex);
 }
 
-static int draw_text_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+// Only damaged rectangles are pushed to the window
+static void update_surface_rects(const struct DamageList *damaged)
 {
-    int x = item->x;
-    int y = item->y;
-    Uint32 fgcolor = uint32_color_to_surface(screen, item->data.text_data.fgcolor);
-    Uint32 bgcolor;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor = uint32_color_to_surface(screen, item->brcolor);
-        visible_bg = true;
-    } else {
-        visible_bg = false;
+    int scale = screen->scale;
+    SDL_Rect rects[DAMAGE_MAX_RECTANGLES];
+    for (int i = 0; i < damaged->count; i++) {
+        const struct Rectangle *rect = &damaged->rectangles[i];
+        rects[i].x = rect->x * scale;
+        rects[i].y = rect->y * scale;
+        rects[i].w = rect->width * scale;
+        rects[i].h = rect->height * scale;
     }
 
-    char *text = (char *) item->data.text_data.text;
-
-    int width = item->width;
+    SDL_UpdateRects(surface, damaged->count, rects);
+}
 
-    int drawn_pixels = 0;
+struct Surface
+{
+    int width;
+    int height;
+    void *buffer;
+};
 
-    Uint32 *pixmem32 = (Uint32 *) (((uint8_t *) screen->pixels) + screen->w * ypos * BPP + xpos * BPP);
+void epd_draw_pixel(int xpos, int ypos, uint8_t color, void *buffer)
+{
+    struct Surface *surface = buffer;
 
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
+    if (xpos < 0 || ypos < 0 || xpos >= surface->width || ypos >= surface->height) {
+        return;
     }
 
-    for (int j = xpos - x; j < width; j++) {
-        int char_index = j / CHAR_WIDTH;
-        char c = text[char_index];
-        unsigned const char *glyph = fontdata + ((unsigned char) c) * 16;
-
-        unsigned char row = glyph[ypos - y];
-
-        bool opaque;
-        int k = j % CHAR_WIDTH;
-        if (row & (1 << (7 - k))) {
-            opaque = true;
-        } else {
-            opaque = false;
-        }
-
-        if (opaque) {
-            pixmem32[drawn_pixels] = fgcolor;
-        } else if (visible_bg) {
-            pixmem32[drawn_pixels] = bgcolor;
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-    }
+    Uint32 *pixmem32b = (Uint32 *) (((uint8_t *) surface->buffer) + surface->width * ypos * BPP + xpos * BPP);
 
-    return drawn_pixels;
+    //TODO: handle other colors than black
+    UNUSED(color);
+    *pixmem32b = 0xFF000000;
 }
 
-static int find_max_line_len(BaseDisplayItem *items, int count, int xpos, int ypos)
+static void forget_prev_display_list(GlobalContext *global)
 {
-    int line_len = screen->w;
-
-    for (int i = 0; i < count; i++) {
-        BaseDisplayItem *item = &items[i];
-
-        if ((xpos < item->x) && (ypos >= item->y) && (ypos < item->y + item->height)) {
-            int len_to_item = item->x - xpos;
-            line_len = (line_len > len_to_item) ? len_to_item : line_len;
-        }
+    if (prev_message) {
+        frame_arena_reset(&arenas[next_arena ^ 1]);
+        destroy_message(prev_message, global);
     }
-
-    return line_len;
+    prev_message = NULL;
+    prev_items = NULL;
+    prev_items_len = 0;
 }
 
-static int draw_x(int xpos, int ypos, BaseDisplayItem *items, int items_count)
+static void send_reply(const GenMessage *gen_message, term value, GlobalContext *global)
 {
-    bool below = false;
+    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(2), heap);
+    term return_tuple = term_alloc_tuple(2, &heap);
+    term_put_tuple_element(return_tuple, 0, gen_message->ref);
+    term_put_tuple_element(return_tuple, 1, value);
+
+    int local_process_id = term_to_local_process_id(gen_message->pid);
+    globalcontext_send_message(global, local_process_id, return_tuple);
+    END_WITH_STACK_HEAP(heap, global);
+}
 
-    for (int i = 0; i < items_count; i++) {
-        BaseDisplayItem *item = &items[i];
-        if ((xpos < item->x) || (xpos >= item->x + item->width) || (ypos < item->y) || (ypos >= item->y + item->height)) {
-            continue;
+// Images that are loaded with a handle are decoded only once: they are kept in the image cache
+// and the reply is an image_ref tuple, that can be used in display lists instead of the pixels.
+static void load_cached_image(term req, term handle, const GenMessage *gen_message, Context *ctx)
+{
+    GlobalContext *glb = ctx->global;
+    term png = term_get_tuple_element(req, 1);
+    term opts = term_get_tuple_element(req, 2);
+    bool ok = image_cache_lookup(handle) != NULL;
+
+    if (!ok) {
+        term format_atom = interop_kv_get_value_default(opts, ATOM_STR("\x6", "format"), display_atoms.rgba8888, glb);
+        enum image_format format;
+        enum png_output_format png_format;
+        int width;
+        int height;
+        if (format_atom == display_atoms.rgb565_be) {
+            format = FormatRGB565BE;
+            png_format = PngRGB565BE;
+        } else if (format_atom == display_atoms.rgb565a8) {
+            format = FormatRGB565A8;
+            png_format = PngRGB565A8;
+        } else {
+            format = FormatRGBA8888;
+            png_format = PngRGBA8888;
         }
 
-        int max_line_len = below ? 1 : find_max_line_len(items, i, xpos, ypos);
-
-        int drawn_pixels = 0;
-        switch (items[i].primitive) {
-            case Image:
-                drawn_pixels = draw_image_x(xpos, ypos, max_line_len, item);
-                break;
-
-            case ScaledCroppedImage:
-                drawn_pixels = draw_scaled_cropped_img_x(xpos, ypos, max_line_len, item);
-                break;
-
-            case Rect:
-                drawn_pixels = draw_rect_x(xpos, ypos, max_line_len, item);
-                break;
-
-            case Text:
-                drawn_pixels = draw_text_x(xpos, ypos, max_line_len, item);
-                break;
-
-            default: {
-                fprintf(stderr, "unexpected display list command.\n");
+        if (term_is_binary(png) && image_png_get_size(term_binary_data(png), term_binary_size(png), &width, &height)) {
+            size_t size = width * height * image_format_bytes_per_pixel(format);
+            bool evicted;
+            struct ImageCacheEntry *entry = image_cache_alloc(handle, format, width, height, size, &evicted);
+            // items of previous display list might point to evicted pixels
+            if (evicted) {
+                forget_prev_display_list(glb);
+            }
+            if (entry) {
+                ok = image_png_decode_into(term_binary_data(png), term_binary_size(png), png_format, (uint8_t *) entry->pix);
+                if (!ok) {
+                    image_cache_remove(entry);
+                }
             }
         }
-
-        if (drawn_pixels != 0) {
-            return drawn_pixels;
-        }
-
-        below = true;
     }
 
-    return 1;
+    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(2), heap);
+    term value = ERROR_ATOM;
+    if (ok) {
+        value = term_alloc_tuple(2, &heap);
+        term_put_tuple_element(value, 0, display_atoms.image_ref);
+        term_put_tuple_element(value, 1, handle);
+    }
+    send_reply(gen_message, value, glb);
+    END_WITH_STACK_HEAP(heap, glb);
 }
 
-static void do_update(Context *ctx, term display_list)
+static void do_update(Context *ctx, term display_list, struct DamageList *damaged)
 {
-    int proper;
-    int len = term_list_length(display_list, &proper);
-
-    BaseDisplayItem *items = malloc(sizeof(BaseDisplayItem) * len);
-
-    term t = display_list;
-    for (int i = 0; i < len; i++) {
-        init_item(&items[i], term_get_list_head(t), ctx);
-        t = term_get_list_tail(t);
+    int len;
+    struct FrameArena *arena = &arenas[next_arena];
+    BaseDisplayItem *items;
+    if (retain_items) {
+        items = init_items(display_list, &len, prev_items, prev_items_len, ctx, arena);
+    } else {
+        items = init_items(display_list, &len, NULL, 0, ctx, arena);
     }
 
-    struct Rectangle damaged;
-    damaged.valid = false;
-    dumb_diff(prev_items, prev_items_len, items, len, &damaged);
-    if (prev_items) {
-        destroy_items(prev_items, prev_items_len);
+    dumb_diff(prev_items, prev_items_len, items, len, damaged);
+    if (prev_message) {
+        frame_arena_reset(&arenas[next_arena ^ 1]);
         destroy_message(prev_message, ctx->global);
     }
     prev_items = items;
     prev_items_len = len;
-
-    if (!damaged.valid) {
-        // skip update
-        return;
-    }
+    next_arena ^= 1;
 
     struct Rectangle screen_rect = {
         .x = 0,
@@ -521,23 +448,12 @@ static void do_update(Context *ctx, term display_list)
         .height = screen->h,
         .valid = true
     };
-    clip_rectangle(&damaged, &screen_rect);
-
-    // BUG: damage area is not correct
-    // WORKAROUND: always damage the whole screen to force full redraw
-    damaged.x = 0;
-    damaged.y = 0;
-    damaged.height = screen->h;
-    damaged.width = screen->w;
-    // END OF WORKAROUND
-
-    for (int ypos = damaged.y; ypos < damaged.y + damaged.height; ypos++) {
-        int xpos = damaged.x;
-        while (xpos < damaged.x + damaged.width) {
-            int drawn_pixels = draw_x(xpos, ypos, items, len);
-            xpos += drawn_pixels;
-        }
-    }
+    damage_list_clip(damaged, &screen_rect);
+
+    struct ScanlineIndex index;
+    scanline_index_init(&index, items, len, screen->w, arena);
+
+    render_pool_draw(damaged, &index, arena);
 }
 
 static void process_message(Context *ctx)
@@ -557,6 +473,9 @@ static void process_message(Context *ctx)
 
     term cmd = term_get_tuple_element(req, 0);
 
+    struct DamageList damaged;
+    damage_list_init(&damaged);
+
     if (SDL_MUSTLOCK(surface)) {
         if (SDL_LockSurface(surface) < 0) {
             return;
@@ -566,19 +485,9 @@ static void process_message(Context *ctx)
     if (cmd == globalcontext_make_atom(ctx->global, "\x6"
                                       "update")) {
         term display_list = term_get_tuple_element(req, 1);
-        do_update(ctx, display_list);
+        do_update(ctx, display_list, &damaged);
         prev_message = message;
 
-        // Copy and scale up
-        int scale = screen->scale;
-        for (int ypos = 0; ypos < surface->h; ypos++) {
-            for (int xpos = 0; xpos < surface->w; xpos++) {
-                Uint32 *srcpix = (Uint32 *) (((uint8_t *) screen->pixels) + screen->w * (ypos / scale) * BPP + (xpos / scale) * BPP);
-                Uint32 *destpix = (Uint32 *) (((uint8_t *) surface->pixels) + surface->w * ypos * BPP + xpos * BPP);
-                *destpix = *srcpix;
-            }
-        }
-
     } else if (cmd == globalcontext_make_atom(ctx->global, "\xF"
                                              "subscribe_input")) {
         if (term_get_tuple_arity(req) != 2) {
@@ -592,8 +501,34 @@ static void process_message(Context *ctx)
         keyboard_pid = gen_message.pid;
 
     } else if (cmd == globalcontext_make_atom(ctx->global, "\xA" "load_image")) {
+        term handle = term_invalid_term();
+        if (term_get_tuple_arity(req) >= 3) {
+            handle = interop_kv_get_value(term_get_tuple_element(req, 2), ATOM_STR("\x6", "handle"), ctx->global);
+        }
 
-        handle_load_image(req, gen_message.ref, gen_message.pid, ctx);
+        if (handle == term_invalid_term()) {
+            handle_load_image(req, gen_message.ref, gen_message.pid, ctx);
+        } else {
+            load_cached_image(req, handle, &gen_message, ctx);
+        }
+
+        goto free_msg_and_exit;
+
+    } else if (cmd == globalcontext_make_atom(ctx->global, "\xB" "cache_image")) {
+        bool evicted = false;
+        bool cached = (term_get_tuple_arity(req) == 3)
+            && cache_image_tuple(term_get_tuple_element(req, 1), term_get_tuple_element(req, 2), ctx, &evicted);
+        if (evicted) {
+            forget_prev_display_list(ctx->global);
+        }
+        send_reply(&gen_message, cached ? OK_ATOM : ERROR_ATOM, ctx->global);
+
+        goto free_msg_and_exit;
+
+    } else if (cmd == globalcontext_make_atom(ctx->global, "\xB" "cache_stats")) {
+        BEGIN_WITH_STACK_HEAP(IMAGE_CACHE_STATS_SIZE, heap);
+        send_reply(&gen_message, image_cache_stats(&heap, ctx->global), ctx->global);
+        END_WITH_STACK_HEAP(heap, ctx->global);
 
         goto free_msg_and_exit;
 
@@ -616,7 +551,7 @@ static void process_message(Context *ctx)
         SDL_UnlockSurface(surface);
     }
 
-    SDL_Flip(surface);
+    update_surface_rects(&damaged);
 
     if (UNLIKELY(memory_ensure_free(ctx, TUPLE_SIZE(3)) != MEMORY_GC_OK)) {
         abort();
@@ -822,6 +757,8 @@ Context *display_create_port(GlobalContext *global, term opts)
     Context *ctx = context_new(global);
     ctx->native_handler = consume_display_mailbox;
 
+    display_atoms_init(global);
+
     term width_atom = globalcontext_make_atom(ctx->global, "\x5"
                                              "width");
     term height_atom = globalcontext_make_atom(ctx->global, "\x6"
@@ -833,6 +770,14 @@ Context *display_create_port(GlobalContext *global, term opts)
     avm_int_t width = term_to_int(width_term);
     avm_int_t height = term_to_int(height_term);
 
+    term retain_items_atom = globalcontext_make_atom(ctx->global, "\xC"
+                                                    "retain_items");
+    retain_items = interop_proplist_get_value_default(opts, retain_items_atom, FALSE_ATOM) == TRUE_ATOM;
+
+    if (!image_cache_init(opts, global)) {
+        fprintf(stderr, "invalid image_cache_size option.\n");
+    }
+
     struct DisplayOpts *disp_opts = malloc(sizeof(struct DisplayOpts));
     if (IS_NULL_PTR(disp_opts)) {
         abort();
@@ -911,6 +856,8 @@ void *display_loop(void *args)
 
     ufont_manager = ufont_manager_new();
 
+    render_pool_init(get_render_threads());
+
     if (SDL_MUSTLOCK(surface)) {
         SDL_UnlockSurface(surface);
     }
@@ -529,15 +529,31 @@ typedef struct
     EpdFont *font;
 } UFont;
 
+// it must be a power of 2
+#define UF_GLYPH_CACHE_BUCKETS 256
+
+struct UFGlyphCacheEntry
+{
+    struct UFGlyphCacheEntry *next;
+    const EpdFont *font;
+    uint32_t code_point;
+    UFontCachedGlyph glyph;
+    uint8_t coverage[];
+};
+
 struct UFontManager
 {
     struct UFListHead font_list;
+    struct UFGlyphCacheEntry *glyph_cache[UF_GLYPH_CACHE_BUCKETS];
 };
 
 UFontManager *ufont_manager_new()
 {
     UFontManager *ufont_manager = malloc(sizeof(UFontManager));
     uflist_init(&ufont_manager->font_list);
+    for (int i = 0; i < UF_GLYPH_CACHE_BUCKETS; i++) {
+        ufont_manager->glyph_cache[i] = NULL;
+    }
 
     return ufont_manager;
 }
@@ -563,6 +579,95 @@ EpdFont *ufont_manager_find_by_handle(UFontManager *ufont_manager, const char *h
     return NULL;
 }
 
+static unsigned int uf_glyph_cache_bucket(const EpdFont *font, uint32_t code_point)
+{
+    uintptr_t h = ((uintptr_t) font >> 4) ^ (code_point * 2654435761u);
+    return (h ^ (h >> 16)) & (UF_GLYPH_CACHE_BUCKETS - 1);
+}
+
+// 4 bit glyph bitmaps are expanded to 8 bit coverage, so they can be used as an alpha mask
+static struct UFGlyphCacheEntry *uf_rasterize_glyph(const EpdFont *font, const EpdGlyph *glyph)
+{
+    uint16_t width = glyph->width, height = glyph->height;
+    int byte_width = (width / 2 + width % 2);
+    unsigned long bitmap_size = byte_width * height;
+
+    struct UFGlyphCacheEntry *entry = malloc(sizeof(struct UFGlyphCacheEntry) + width * height);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->glyph.left = glyph->left;
+    entry->glyph.top = glyph->top;
+    entry->glyph.width = width;
+    entry->glyph.height = height;
+    entry->glyph.advance_x = glyph->advance_x;
+    entry->glyph.coverage = entry->coverage;
+
+    if (bitmap_size == 0) {
+        return entry;
+    }
+
+    const uint8_t *bitmap;
+    uint8_t *tmp_bitmap = NULL;
+    if (font->compressed) {
+        tmp_bitmap = malloc(bitmap_size);
+        if (tmp_bitmap == NULL) {
+            free(entry);
+            return NULL;
+        }
+        do_uncompress(tmp_bitmap, bitmap_size, &font->bitmap[glyph->data_offset], glyph->compressed_size);
+        bitmap = tmp_bitmap;
+    } else {
+        bitmap = &font->bitmap[glyph->data_offset];
+    }
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint8_t bm = bitmap[y * byte_width + x / 2];
+            bm = (x & 1) ? (bm >> 4) : (bm & 0xF);
+            entry->coverage[y * width + x] = bm * 17;
+        }
+    }
+
+    free(tmp_bitmap);
+
+    return entry;
+}
+
+const UFontCachedGlyph *ufont_manager_get_glyph(UFontManager *ufont_manager, const EpdFont *font,
+    uint32_t code_point)
+{
+    unsigned int bucket = uf_glyph_cache_bucket(font, code_point);
+
+    for (struct UFGlyphCacheEntry *entry = ufont_manager->glyph_cache[bucket]; entry; entry = entry->next) {
+        if (entry->font == font && entry->code_point == code_point) {
+            return &entry->glyph;
+        }
+    }
+
+    const EpdGlyph *glyph = epd_get_glyph(font, code_point);
+    if (!glyph) {
+        return NULL;
+    }
+
+    struct UFGlyphCacheEntry *entry = uf_rasterize_glyph(font, glyph);
+    if (entry == NULL) {
+        fprintf(stderr, "malloc failed.");
+        return NULL;
+    }
+    entry->font = font;
+    entry->code_point = code_point;
+    entry->next = ufont_manager->glyph_cache[bucket];
+    ufont_manager->glyph_cache[bucket] = entry;
+
+    return &entry->glyph;
+}
+
+uint32_t ufont_next_code_point(const char **string)
+{
+    return next_cp((const uint8_t **) string);
+}
+
 #ifdef __ORDER_LITTLE_ENDIAN__
     #ifdef __GNUC__
         #define UF_ENDIAN_SWAP_32(value) __builtin_bswap32(value)
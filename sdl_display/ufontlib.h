@@ -40,6 +40,16 @@ typedef struct __attribute__((__packed__)) {
   uint32_t data_offset;     ///< Pointer into EpdFont->bitmap
 } EpdGlyph;
 
+/// Glyph rasterized to 8 bit coverage, it is owned by the glyph cache
+typedef struct {
+  int16_t left;             ///< X dist from cursor pos to UL corner
+  int16_t top;              ///< Y dist from cursor pos to UL corner
+  uint16_t width;           ///< Bitmap dimensions in pixels
+  uint16_t height;          ///< Bitmap dimensions in pixels
+  uint16_t advance_x;       ///< Distance to advance cursor (x axis)
+  const uint8_t *coverage;  ///< width * height bytes, from 0 (transparent) to 255 (opaque)
+} UFontCachedGlyph;
+
 /// Glyph interval structure
 typedef struct __attribute__((__packed__))  {
   uint32_t first;  ///< The first unicode code point of the interval
@@ -195,6 +205,19 @@ UFontManager *ufont_manager_new();
 void ufont_manager_register(UFontManager *ufont_manager, const char *handle, EpdFont *font);
 EpdFont *ufont_manager_find_by_handle(UFontManager *ufont_manager, const char *handle);
 
+/**
+ * Get a glyph rasterized to 8 bit coverage, glyphs are rasterized only once and then they are
+ * kept in the glyph cache, until the manager is destroyed.
+ * Returns NULL when the font has no glyph for code_point.
+ */
+const UFontCachedGlyph *ufont_manager_get_glyph(UFontManager *ufont_manager, const EpdFont *font,
+        uint32_t code_point);
+
+/**
+ * Decode next code point from an UTF-8 string and move forward, 0 is returned at the end of it.
+ */
+uint32_t ufont_next_code_point(const char **string);
+
 EpdFont *ufont_parse(const void *iff_binary, int buf_size);
 
 #ifdef __cplusplus
@@ -20,9 +20,23 @@
 
 #include "spi_display.h"
 
+#include <stdlib.h>
 #include <string.h>
 
+#include <driver/gpio.h>
 #include <driver/spi_master.h>
+#include <esp_attr.h>
+#include <esp_idf_version.h>
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include <esp_memory_utils.h>
+#else
+#include <soc/soc_memory_layout.h>
+#endif
+#if DISPLAY_STATS
+#include <esp_timer.h>
+#endif
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 #include <globalcontext.h>
 #include <interop.h>
@@ -47,10 +61,91 @@ bool spi_display_dmawrite(struct SPIDisplay *spi_data, int data_len, const void
         fprintf(stderr, "spidmawrite: transmit error\n");
         return false;
     }
+#if DISPLAY_STATS
+    spi_data->bytes_sent += data_len;
+#endif
 
     return true;
 }
 
+// Up to queue_size transactions can be in flight, when the ring is full this function waits for
+// the oldest one, so its buffer can be reused as soon as this function returns.
+bool spi_display_queue_dmawrite(struct SPIDisplay *spi_data, int data_len, const void *data)
+{
+    if (spi_data->pending_transactions == spi_data->queue_size) {
+        spi_display_wait_oldest(spi_data);
+    }
+
+    spi_transaction_t *transaction = &spi_data->transactions[spi_data->next_transaction];
+    memset(transaction, 0, sizeof(spi_transaction_t));
+
+    transaction->flags = 0;
+    transaction->length = data_len * 8;
+    transaction->addr = 0;
+    transaction->tx_buffer = data;
+
+    int ret = spi_device_queue_trans(spi_data->handle, transaction, portMAX_DELAY);
+    if (UNLIKELY(ret != ESP_OK)) {
+        fprintf(stderr, "spidmawrite: transmit error\n");
+        return false;
+    }
+
+#if DISPLAY_STATS
+    spi_data->bytes_sent += data_len;
+#endif
+
+    spi_data->next_transaction = (spi_data->next_transaction + 1) % spi_data->queue_size;
+    spi_data->pending_transactions++;
+
+    return true;
+}
+
+// Returns the buffer of the oldest queued transaction once it has been sent, or NULL when no
+// transactions are queued.
+const void *spi_display_wait_oldest(struct SPIDisplay *spi_data)
+{
+    if (spi_data->pending_transactions == 0) {
+        return NULL;
+    }
+
+#if DISPLAY_STATS
+    int64_t start = esp_timer_get_time();
+#endif
+    spi_transaction_t *trans;
+    spi_device_get_trans_result(spi_data->handle, &trans, portMAX_DELAY);
+    spi_data->pending_transactions--;
+#if DISPLAY_STATS
+    spi_data->transfer_wait_us += esp_timer_get_time() - start;
+#endif
+
+    return trans->tx_buffer;
+}
+
+void spi_display_wait_queued(struct SPIDisplay *spi_data)
+{
+    while (spi_data->pending_transactions > 0) {
+        spi_display_wait_oldest(spi_data);
+    }
+}
+
+void spi_display_wait_dmawrite(struct SPIDisplay *spi_data)
+{
+#if DISPLAY_STATS
+    int64_t start = esp_timer_get_time();
+#endif
+    spi_transaction_t *trans;
+    spi_device_get_trans_result(spi_data->handle, &trans, portMAX_DELAY);
+#if DISPLAY_STATS
+    spi_data->transfer_wait_us += esp_timer_get_time() - start;
+#endif
+}
+
+bool spi_display_is_dma_capable(const void *data)
+{
+    // DMA transfers are done 32 bits at a time
+    return esp_ptr_dma_capable(data) && (((uintptr_t) data & 3) == 0);
+}
+
 bool spi_display_write(struct SPIDisplay *spi_data, int data_len, uint32_t data)
 {
     memset(&spi_data->transaction, 0, sizeof(spi_transaction_t));
@@ -71,6 +166,143 @@ bool spi_display_write(struct SPIDisplay *spi_data, int data_len, uint32_t data)
         fprintf(stderr, "spiwrite: transmit error\n");
         return false;
     }
+#if DISPLAY_STATS
+    spi_data->bytes_sent += data_len / 8;
+#endif
+
+    return true;
+}
+
+static bool polling_transmit(struct SPIDisplay *spi_data, spi_transaction_t *transaction)
+{
+    int ret = spi_device_polling_transmit(spi_data->handle, transaction);
+    if (UNLIKELY(ret != ESP_OK)) {
+        fprintf(stderr, "spiwrite: transmit error\n");
+        return false;
+    }
+#if DISPLAY_STATS
+    spi_data->bytes_sent += transaction->length / 8;
+#endif
+
+    return true;
+}
+
+// D/C cannot change within a transaction, so the command and its parameters are sent as two
+// back to back transactions, and the pre-transfer callback sets the D/C line for each of them.
+bool spi_display_write_command(struct SPIDisplay *spi_data, uint8_t command, const uint8_t *params, int params_len)
+{
+    spi_transaction_t transaction;
+    memset(&transaction, 0, sizeof(spi_transaction_t));
+
+    transaction.flags = SPI_TRANS_USE_TXDATA;
+    transaction.length = 8;
+    transaction.tx_data[0] = command;
+    transaction.user = &spi_data->dc_command;
+
+    if (!polling_transmit(spi_data, &transaction)) {
+        return false;
+    }
+
+    if (params_len == 0) {
+        // transactions without user data expect D/C to be left in data mode
+        gpio_set_level(spi_data->dc_data.gpio, spi_data->dc_data.level);
+        return true;
+    }
+
+    memset(&transaction, 0, sizeof(spi_transaction_t));
+    transaction.length = params_len * 8;
+    transaction.user = &spi_data->dc_data;
+    if (params_len <= 4) {
+        transaction.flags = SPI_TRANS_USE_TXDATA;
+        memcpy(transaction.tx_data, params, params_len);
+    } else {
+        transaction.tx_buffer = params;
+    }
+
+    return polling_transmit(spi_data, &transaction);
+}
+
+// The bus is acquired once for the whole sequence, it is released only while waiting for
+// commands that require a delay, such as sleep out.
+bool spi_display_write_sequence(struct SPIDisplay *spi_data, const struct SPIDisplayCommand *commands, int count)
+{
+    spi_device_acquire_bus(spi_data->handle, portMAX_DELAY);
+
+    for (int i = 0; i < count; i++) {
+        const struct SPIDisplayCommand *command = &commands[i];
+        if (UNLIKELY(!spi_display_write_command(spi_data, command->command, command->params, command->params_len))) {
+            spi_device_release_bus(spi_data->handle);
+            return false;
+        }
+
+        if (command->delay_ms > 0) {
+            spi_device_release_bus(spi_data->handle);
+            vTaskDelay(command->delay_ms / portTICK_PERIOD_MS);
+            spi_device_acquire_bus(spi_data->handle, portMAX_DELAY);
+        }
+    }
+
+    spi_device_release_bus(spi_data->handle);
+
+    return true;
+}
+
+// CS is kept active after the command when supported, since panels might end the read as soon
+// as CS is deasserted.
+bool spi_display_read_command(struct SPIDisplay *spi_data, uint8_t command, uint8_t *data, int data_len)
+{
+    spi_transaction_t transaction;
+    memset(&transaction, 0, sizeof(spi_transaction_t));
+
+    transaction.flags = SPI_TRANS_USE_TXDATA;
+#ifdef SPI_TRANS_CS_KEEP_ACTIVE
+    transaction.flags |= SPI_TRANS_CS_KEEP_ACTIVE;
+#endif
+    transaction.length = 8;
+    transaction.tx_data[0] = command;
+    transaction.user = &spi_data->dc_command;
+
+    if (!polling_transmit(spi_data, &transaction)) {
+        return false;
+    }
+
+    memset(&transaction, 0, sizeof(spi_transaction_t));
+    transaction.length = data_len * 8;
+    transaction.rxlength = data_len * 8;
+    transaction.rx_buffer = data;
+    transaction.user = &spi_data->dc_data;
+
+    int ret = spi_device_polling_transmit(spi_data->handle, &transaction);
+    if (UNLIKELY(ret != ESP_OK)) {
+        fprintf(stderr, "spiread: transmit error\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool spi_display_set_clock(struct SPIDisplay *spi_data, int clock_speed_hz)
+{
+    if (spi_data->devcfg.clock_speed_hz == clock_speed_hz) {
+        return true;
+    }
+
+    esp_err_t ret = spi_bus_remove_device(spi_data->handle);
+    if (UNLIKELY(ret != ESP_OK)) {
+        fprintf(stderr, "spi_display_set_clock: failed to remove device\n");
+        return false;
+    }
+
+    int prev_clock_speed_hz = spi_data->devcfg.clock_speed_hz;
+    spi_data->devcfg.clock_speed_hz = clock_speed_hz;
+    ret = spi_bus_add_device(spi_data->host_dev, &spi_data->devcfg, &spi_data->handle);
+    if (ret != ESP_OK) {
+        fprintf(stderr, "spi_display_set_clock: %i Hz is not supported\n", clock_speed_hz);
+        spi_data->devcfg.clock_speed_hz = prev_clock_speed_hz;
+        ret = spi_bus_add_device(spi_data->host_dev, &spi_data->devcfg, &spi_data->handle);
+        ESP_ERROR_CHECK(ret);
+        return false;
+    }
 
     return true;
 }
@@ -89,14 +321,40 @@ bool spi_display_parse_config(struct SPIDisplayConfig *spi_config, term opts, Gl
     term spi_port = interop_proplist_get_value(opts, spi_host_atom);
 
     ok = spi_driver_get_peripheral(spi_port, &spi_config->host_dev, global);
+    if (!ok) {
+        return false;
+    }
+
+    term clock = interop_kv_get_value_default(opts, ATOM_STR("\xC", "spi_clock_hz"),
+        term_from_int(spi_config->clock_speed_hz), global);
+    if (!term_is_integer(clock) || (term_to_int(clock) <= 0)) {
+        return false;
+    }
+    spi_config->clock_speed_hz = term_to_int(clock);
 
-    return ok;
+    return true;
+}
+
+static void IRAM_ATTR spi_display_pre_transfer(spi_transaction_t *transaction)
+{
+    const struct SPIDisplayDCLevel *dc = transaction->user;
+    if (dc) {
+        gpio_set_level(dc->gpio, dc->level);
+    }
 }
 
 bool spi_display_init(struct SPIDisplay *spi_disp, struct SPIDisplayConfig *spi_config)
 {
     memset(spi_disp, 0, sizeof(struct SPIDisplay));
 
+    int queue_size = (spi_config->queue_size > 0) ? spi_config->queue_size : 1;
+    spi_disp->transactions = malloc(sizeof(spi_transaction_t) * queue_size);
+    if (IS_NULL_PTR(spi_disp->transactions)) {
+        fprintf(stderr, "spi_display_init: failed to allocate transactions\n");
+        return false;
+    }
+    spi_disp->queue_size = queue_size;
+
     spi_device_interface_config_t devcfg = {
         .mode = spi_config->mode,
         .clock_speed_hz = spi_config->clock_speed_hz,
@@ -105,9 +363,22 @@ bool spi_display_init(struct SPIDisplay *spi_disp, struct SPIDisplayConfig *spi_
         .spics_io_num = spi_config->cs_gpio,
         .cs_ena_pretrans = spi_config->cs_ena_pretrans,
         .cs_ena_posttrans = spi_config->cs_ena_posttrans,
-        .queue_size = 1
+        .queue_size = queue_size,
+        .pre_cb = (spi_config->dc_gpio >= 0) ? spi_display_pre_transfer : NULL
     };
 
+    if (spi_config->dc_gpio >= 0) {
+        spi_disp->dc_command.gpio = spi_config->dc_gpio;
+        spi_disp->dc_command.level = 0;
+        spi_disp->dc_data.gpio = spi_config->dc_gpio;
+        spi_disp->dc_data.level = 1;
+        gpio_set_direction(spi_config->dc_gpio, GPIO_MODE_OUTPUT);
+        gpio_set_level(spi_config->dc_gpio, 1);
+    }
+
+    spi_disp->host_dev = spi_config->host_dev;
+    spi_disp->devcfg = devcfg;
+
     esp_err_t ret = spi_bus_add_device(spi_config->host_dev, &devcfg, &spi_disp->handle);
     ESP_ERROR_CHECK(ret);
 
@@ -117,4 +388,5 @@ bool spi_display_init(struct SPIDisplay *spi_disp, struct SPIDisplayConfig *spi_
 void spi_display_init_config(struct SPIDisplayConfig *spi_config)
 {
     memset(spi_config, 0, sizeof(struct SPIDisplayConfig));
+    spi_config->dc_gpio = -1;
 }
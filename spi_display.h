@@ -24,13 +24,66 @@
 #include <driver/spi_master.h>
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <globalcontext.h>
 
+// SPI transactions cannot be bigger than the bus max transfer size, that is 4092 bytes by default
+#ifndef SPI_DISPLAY_MAX_TRANSFER_SIZE
+#define SPI_DISPLAY_MAX_TRANSFER_SIZE 4092
+#endif
+
+#ifndef DISPLAY_STATS
+#define DISPLAY_STATS 0
+#endif
+
+// Longest parameter list of sequence commands, such as 15 bytes gamma tables. Commands with
+// longer parameters must be sent with spi_display_write_command.
+#define SPI_DISPLAY_MAX_COMMAND_PARAMS 16
+
+#define SPI_DISPLAY_SEQUENCE_LEN(commands) (sizeof(commands) / sizeof(struct SPIDisplayCommand))
+
+// An entry of a command sequence, delay_ms is waited after the command and its parameters have
+// been sent.
+struct SPIDisplayCommand
+{
+    uint8_t command;
+    uint8_t params_len;
+    uint16_t delay_ms;
+    uint8_t params[SPI_DISPLAY_MAX_COMMAND_PARAMS];
+};
+
+// Used as transaction user data, so the D/C line is set by the pre-transfer callback. Transactions
+// without user data leave it untouched.
+struct SPIDisplayDCLevel
+{
+    int gpio;
+    int level;
+};
+
 struct SPIDisplay
 {
     spi_device_handle_t handle;
     spi_transaction_t transaction;
+
+    // ring of transactions used by spi_display_queue_dmawrite
+    spi_transaction_t *transactions;
+    int queue_size;
+    int next_transaction;
+    int pending_transactions;
+
+    struct SPIDisplayDCLevel dc_command;
+    struct SPIDisplayDCLevel dc_data;
+
+    // kept for adding the device again when its clock is changed
+    spi_host_device_t host_dev;
+    spi_device_interface_config_t devcfg;
+
+#if DISPLAY_STATS
+    // see display_stats.h
+    uint64_t bytes_sent;
+    int64_t transfer_wait_us;
+#endif
 };
 
 struct SPIDisplayConfig
@@ -38,16 +91,35 @@ struct SPIDisplayConfig
     spi_host_device_t host_dev;
     int cs_gpio;
     int mode;
+    // driver default, that can be overridden with spi_clock_hz option
     int clock_speed_hz;
     bool cs_active_high : 1;
     bool bit_lsb_first : 1;
     int cs_ena_pretrans;
     int cs_ena_posttrans;
+    // max number of queued DMA transactions, 0 is the same as 1
+    int queue_size;
+    // D/C GPIO used by spi_display_write_command, -1 when commands are not sent with it
+    int dc_gpio;
 };
 
 bool spi_display_init(struct SPIDisplay *spi_disp, struct SPIDisplayConfig *spi_config);
 bool spi_display_dmawrite(struct SPIDisplay *spi_data, int data_len, const void *data);
 bool spi_display_write(struct SPIDisplay *spi_data, int data_len, uint32_t data);
+bool spi_display_queue_dmawrite(struct SPIDisplay *spi_data, int data_len, const void *data);
+const void *spi_display_wait_oldest(struct SPIDisplay *spi_data);
+void spi_display_wait_queued(struct SPIDisplay *spi_data);
+// waits for the transaction started with spi_display_dmawrite
+void spi_display_wait_dmawrite(struct SPIDisplay *spi_data);
+// the bus must be already acquired, and the D/C GPIO must have been configured
+bool spi_display_write_command(struct SPIDisplay *spi_data, uint8_t command, const uint8_t *params, int params_len);
+bool spi_display_write_sequence(struct SPIDisplay *spi_data, const struct SPIDisplayCommand *commands, int count);
+// the bus must be already acquired, data_len bytes are read right after the command
+bool spi_display_read_command(struct SPIDisplay *spi_data, uint8_t command, uint8_t *data, int data_len);
+// no transactions must be in flight, previous clock is kept when the new one is not supported
+bool spi_display_set_clock(struct SPIDisplay *spi_data, int clock_speed_hz);
+// true when data can be sent with DMA as it is, without a bounce buffer
+bool spi_display_is_dma_capable(const void *data);
 void spi_display_init_config(struct SPIDisplayConfig *spi_config);
 bool spi_display_parse_config(struct SPIDisplayConfig *spi_config, term opts, GlobalContext *global);
 
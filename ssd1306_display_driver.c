@@ -52,6 +52,14 @@
 #define CMD_SET_SEGMENT_REMAP 0xA1
 #define CMD_SET_COM_SCAN_MODE 0xC8
 #define CMD_SET_CHARGE_PUMP 0x8D
+#define CMD_SET_MEMORY_ADDRESSING_MODE 0x20
+#define CMD_SET_COLUMN_ADDRESS 0x21
+#define CMD_SET_PAGE_ADDRESS 0x22
+
+#define ADDRESSING_MODE_HORIZONTAL 0x00
+
+// SH1106 has 132 columns, and 128 pixel screens start at column 2
+#define SH1106_COLUMN_OFFSET 2
 
 // TODO: let's change name, since also non SPI display are supported now
 struct SPI
@@ -65,101 +73,203 @@ static void do_update(Context *ctx, term display_list);
 
 #include "font.c"
 #include "display_items.h"
-#include "draw_common.h"
 #include "monochrome.h"
+#include "draw_common.h"
 #include "message_helpers.h"
 
-static void do_update(Context *ctx, term display_list)
+// display list items are released all at once after each update
+static struct FrameArena frame_arena;
+
+// Pages are rendered into framebuffer, while shadow is what the display is showing, so only
+// changed columns are sent. Both are kept across updates.
+static uint8_t framebuffer[PAGES_NUM][DISPLAY_WIDTH];
+static uint8_t shadow[PAGES_NUM][DISPLAY_WIDTH];
+// false until the whole display has been sent, or after a failed transfer
+static bool shadow_valid;
+
+// Returns false when page did not change, otherwise the range of changed columns.
+static bool page_changed_columns(int page, int *first, int *last)
 {
-    int proper;
-    int len = term_list_length(display_list, &proper);
+    if (!shadow_valid) {
+        *first = 0;
+        *last = DISPLAY_WIDTH - 1;
+        return true;
+    }
 
-    BaseDisplayItem *items = malloc(sizeof(BaseDisplayItem) * len);
+    int i = 0;
+    while ((i < DISPLAY_WIDTH) && (framebuffer[page][i] == shadow[page][i])) {
+        i++;
+    }
+    if (i == DISPLAY_WIDTH) {
+        return false;
+    }
+    *first = i;
 
-    term t = display_list;
-    for (int i = 0; i < len; i++) {
-        init_item(&items[i], term_get_list_head(t), ctx);
-        t = term_get_list_tail(t);
+    i = DISPLAY_WIDTH - 1;
+    while (framebuffer[page][i] == shadow[page][i]) {
+        i--;
     }
+    *last = i;
+
+    return true;
+}
+
+static inline void write_command(i2c_cmd_handle_t cmd, uint8_t command)
+{
+    i2c_master_write_byte(cmd, CTRL_BYTE_CMD_SINGLE, true);
+    i2c_master_write_byte(cmd, command, true);
+}
+
+// SSD1306 horizontal addressing mode wraps to the next page at the end of the column window, so
+// all changed pages are sent with a single transaction.
+static esp_err_t ssd1306_send_window(i2c_port_t i2c_num, int first_page, int last_page, int first, int last)
+{
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    i2c_master_start(cmd);
+    i2c_master_write_byte(cmd, (I2C_ADDRESS << 1) | I2C_MASTER_WRITE, true);
+
+    write_command(cmd, CMD_SET_COLUMN_ADDRESS);
+    write_command(cmd, first);
+    write_command(cmd, last);
+    write_command(cmd, CMD_SET_PAGE_ADDRESS);
+    write_command(cmd, first_page);
+    write_command(cmd, last_page);
+
+    i2c_master_write_byte(cmd, CTRL_BYTE_DATA_STREAM, true);
+    for (int page = first_page; page <= last_page; page++) {
+        i2c_master_write(cmd, &framebuffer[page][first], last - first + 1, true);
+    }
+    DISPLAY_STATS_ADD(bytes_sent, (last_page - first_page + 1) * (last - first + 1));
+
+    i2c_master_stop(cmd);
+    DISPLAY_STATS_START(transfer_start);
+    esp_err_t res = i2c_master_cmd_begin(i2c_num, cmd, 100 / portTICK_PERIOD_MS);
+    DISPLAY_STATS_ADD_ELAPSED(transfer_wait_us, transfer_start);
+    i2c_cmd_link_delete(cmd);
+
+    return res;
+}
+
+// SH1106 supports just page addressing, so each page is a transaction.
+static esp_err_t sh1106_send_page(i2c_port_t i2c_num, int page, int first, int last)
+{
+    int column = first + SH1106_COLUMN_OFFSET;
+
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    i2c_master_start(cmd);
+    i2c_master_write_byte(cmd, (I2C_ADDRESS << 1) | I2C_MASTER_WRITE, true);
+
+    write_command(cmd, 0xB0 | page);
+    write_command(cmd, 0x00 | (column & 0xF));
+    write_command(cmd, 0x10 | (column >> 4));
+
+    i2c_master_write_byte(cmd, CTRL_BYTE_DATA_STREAM, true);
+    i2c_master_write(cmd, &framebuffer[page][first], last - first + 1, true);
+    DISPLAY_STATS_ADD(bytes_sent, last - first + 1);
+
+    i2c_master_stop(cmd);
+    DISPLAY_STATS_START(transfer_start);
+    esp_err_t res = i2c_master_cmd_begin(i2c_num, cmd, 10 / portTICK_PERIOD_MS);
+    DISPLAY_STATS_ADD_ELAPSED(transfer_wait_us, transfer_start);
+    i2c_cmd_link_delete(cmd);
+
+    return res;
+}
+
+static void do_update(Context *ctx, term display_list)
+{
+    DISPLAY_STATS_START(parse_start);
+    int len;
+    BaseDisplayItem *items = init_items(display_list, &len, NULL, 0, ctx, &frame_arena);
 
     int screen_width = DISPLAY_WIDTH;
     int screen_height = DISPLAY_HEIGHT;
     struct SPI *spi = ctx->platform_data;
 
-    int memsize = (DISPLAY_WIDTH * (PAGE_HEIGHT + 1)) / sizeof(uint8_t);
-    uint8_t *buf = malloc(memsize);
-    memset(buf, 0, memsize);
+    struct ScanlineIndex index;
+    scanline_index_init(&index, items, len, screen_width, &frame_arena);
+    DISPLAY_STATS_ADD_ELAPSED(parse_us, parse_start);
+    DISPLAY_STATS_ADD(frames, 1);
 
-    i2c_port_t i2c_num;
-    if (i2c_driver_acquire(spi->i2c_host, &i2c_num, ctx->global) != I2CAcquireOk) {
-        fprintf(stderr, "Invalid I2C peripheral\n");
-        return;
-    }
+    uint8_t line_buf[DISPLAY_WIDTH / 8];
+    memset(framebuffer, 0, sizeof(framebuffer));
+    DISPLAY_STATS_START(raster_start);
 
     for (int ypos = 0; ypos < screen_height; ypos++) {
+        memset(line_buf, 0, sizeof(line_buf));
+
         int xpos = 0;
         while (xpos < screen_width) {
-            int drawn_pixels = draw_x(buf, xpos, ypos, items, len);
+            int drawn_pixels = draw_x(line_buf, xpos, ypos, &index);
             xpos += drawn_pixels;
         }
 
-        uint8_t *out_buf = buf + (DISPLAY_WIDTH / 8);
+        uint8_t *page = framebuffer[ypos / PAGE_HEIGHT];
         for (int i = 0; i < DISPLAY_WIDTH; i++) {
-            out_buf[i] |= ((buf[i / 8] >> (i % 8)) & 1) << (ypos % 8);
+            page[i] |= ((line_buf[i / 8] >> (i % 8)) & 1) << (ypos % PAGE_HEIGHT);
         }
+    }
+    DISPLAY_STATS_ADD_ELAPSED(raster_us, raster_start);
+
+    frame_arena_reset(&frame_arena);
+
+    int first_page = -1;
+    int last_page = -1;
+    int first = DISPLAY_WIDTH;
+    int last = -1;
+    int page_first[PAGES_NUM];
+    int page_last[PAGES_NUM];
+    bool page_dirty[PAGES_NUM];
+    for (int page = 0; page < PAGES_NUM; page++) {
+        page_dirty[page] = page_changed_columns(page, &page_first[page], &page_last[page]);
+        if (page_dirty[page]) {
+            first_page = (first_page < 0) ? page : first_page;
+            last_page = page;
+            first = (page_first[page] < first) ? page_first[page] : first;
+            last = (page_last[page] > last) ? page_last[page] : last;
+        }
+    }
+    if (first_page < 0) {
+        DISPLAY_STATS_ADD(skipped_lines, DISPLAY_HEIGHT);
+        return;
+    }
 
-        if ((ypos % PAGE_HEIGHT) == (PAGE_HEIGHT - 1)) {
-            i2c_cmd_handle_t cmd;
-            cmd = i2c_cmd_link_create();
-            i2c_master_start(cmd);
-            i2c_master_write_byte(cmd, (I2C_ADDRESS << 1) | I2C_MASTER_WRITE, true);
-
-            i2c_master_write_byte(cmd, CTRL_BYTE_CMD_SINGLE, true);
-            i2c_master_write_byte(cmd, 0xB0 | ypos / 8, true);
-            if (spi->is_sh1106) {
-                // set the column, otherwise the starting column will be somewhere in the middle
-                i2c_master_write_byte(cmd, CTRL_BYTE_CMD_SINGLE, true);
-                i2c_master_write_byte(cmd, 0x00, true);
-                i2c_master_write_byte(cmd, CTRL_BYTE_CMD_SINGLE, true);
-                i2c_master_write_byte(cmd, 0x10, true);
-            }
-            i2c_master_write_byte(cmd, CTRL_BYTE_DATA_STREAM, true);
-
-
-            if (spi->is_sh1106) {
-                // add 2 empty pages on sh1106 since it can have up to 132 pixels
-                // and 128 pixel screen starts at (2, 0)
-                i2c_master_write_byte(cmd, 0, true);
-                i2c_master_write_byte(cmd, 0, true);
-            }
+    i2c_port_t i2c_num;
+    if (i2c_driver_acquire(spi->i2c_host, &i2c_num, ctx->global) != I2CAcquireOk) {
+        fprintf(stderr, "Invalid I2C peripheral\n");
+        return;
+    }
 
-            for (uint8_t j = 0; j < DISPLAY_WIDTH; j++) {
-                i2c_master_write_byte(cmd, out_buf[j], true);
+    esp_err_t res = ESP_OK;
+    if (spi->is_sh1106) {
+        for (int page = first_page; (page <= last_page) && (res == ESP_OK); page++) {
+            if (page_dirty[page]) {
+                res = sh1106_send_page(i2c_num, page, page_first[page], page_last[page]);
+            } else {
+                DISPLAY_STATS_ADD(skipped_lines, PAGE_HEIGHT);
             }
-
-            // no need to send the last 2 page, the position will be set on next line again
-            // if (spi->is_sh1106) {
-            //    i2c_master_write_byte(cmd, 0, true);
-            //    i2c_master_write_byte(cmd, 0, true);
-            // }
-
-            i2c_master_stop(cmd);
-            i2c_master_cmd_begin(i2c_num, cmd, 10 / portTICK_PERIOD_MS);
-            i2c_cmd_link_delete(cmd);
-
-            memset(buf, 0, memsize);
         }
+    } else {
+        // clean pages inside the window are sent anyway
+        res = ssd1306_send_window(i2c_num, first_page, last_page, first, last);
     }
+    DISPLAY_STATS_ADD(skipped_lines, (PAGES_NUM - 1 - last_page + first_page) * PAGE_HEIGHT);
 
     i2c_driver_release(spi->i2c_host, ctx->global);
 
-    free(buf);
-    destroy_items(items, len);
+    if (res == ESP_OK) {
+        memcpy(shadow, framebuffer, sizeof(shadow));
+        shadow_valid = true;
+    } else {
+        ESP_LOGE(TAG, "display update failed. error: 0x%.2X", res);
+        shadow_valid = false;
+    }
 }
 
 static void display_init(Context *ctx, term opts)
 {
     GlobalContext *glb = ctx->global;
+    display_atoms_init(glb);
 
     term i2c_host
         = interop_kv_get_value_default(opts, ATOM_STR("\x8", "i2c_host"), term_invalid_term(), glb);
@@ -170,7 +280,15 @@ static void display_init(Context *ctx, term opts)
 
     bool invert = interop_kv_get_value(opts, ATOM_STR("\x6", "invert"), glb) == TRUE_ATOM;
 
-    display_messages_queue = xQueueCreate(32, sizeof(Message *));
+    if (!display_messages_init(opts, glb)) {
+        ESP_LOGE(TAG, "Invalid coalesce_updates config option.");
+        return;
+    }
+
+    if (!monochrome_dither_init(opts, DISPLAY_WIDTH, glb)) {
+        ESP_LOGE(TAG, "Invalid dither config option.");
+        return;
+    }
 
     struct SPI *spi = malloc(sizeof(struct SPI));
     ctx->platform_data = spi;
@@ -215,6 +333,11 @@ static void display_init(Context *ctx, term opts)
     i2c_master_write_byte(cmd, CMD_SET_SEGMENT_REMAP, true);
     i2c_master_write_byte(cmd, CMD_SET_COM_SCAN_MODE, true);
 
+    if (!spi->is_sh1106) {
+        i2c_master_write_byte(cmd, CMD_SET_MEMORY_ADDRESSING_MODE, true);
+        i2c_master_write_byte(cmd, ADDRESSING_MODE_HORIZONTAL, true);
+    }
+
     if (invert) {
         i2c_master_write_byte(cmd, CMD_DISPLAY_INVERTED, true);
     }
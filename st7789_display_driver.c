@@ -51,6 +51,8 @@
 #include "backlight_gpio.h"
 #include "display_common.h"
 #include "display_items.h"
+#include "display_messages.h"
+#include "damage_tracking.h"
 #include "spi_display.h"
 
 // if needed it can be lowered to 27000000, while maximum is 62.5 Mhz
@@ -95,7 +97,11 @@
 #define TFT_MAD_BGR 0x08
 #define TFT_MAD_COLOR_ORDER TFT_MAD_RGB
 
+#define MAX_QUEUE_DEPTH 8
+
 #include "font.c"
+#include "rgb565.h"
+#include "draw_common.h"
 
 static const char *TAG = "st7789_display_driver";
 
@@ -115,6 +121,28 @@ struct SPI
     avm_int_t rotation;
 
     Context *ctx;
+
+    // last rendered display list, it is used for damage tracking
+    Message *prev_message;
+    BaseDisplayItem *prev_items;
+    int prev_items_len;
+
+    // previous display list is kept until next one has been built, so arenas are used in turn:
+    // prev_items always lives in arenas[next_arena ^ 1]
+    struct FrameArena arenas[2];
+    int next_arena;
+    // unchanged items are copied from previous display list instead of being parsed again
+    bool retain_items;
+
+    // draw_dma_buffer transactions are left in flight, with the bus acquired, until
+    // wait_dma_buffer is called, and dma_buffer_done is sent to dma_buffer_pid once they are done
+    bool dma_buffer_queued;
+    term dma_buffer_pid;
+    term dma_buffer_addr_low;
+    term dma_buffer_addr_high;
+
+    // when it is not NULL bands are sent by the transmitter task
+    struct DisplayPipeline *pipeline;
 };
 
 // This struct is just for compatibility reasons with the SDL display driver
@@ -123,57 +151,24 @@ struct Screen
 {
     int w;
     int h;
-    uint16_t *pixels;
-    uint16_t *pixels_out;
+    // ring of DMA buffers, each one holds band_height lines: while a band is being rendered
+    // previous ones are being sent
+    uint16_t **bands;
+    int bands_count;
+    int band_height;
+    int next_band;
+    // optional persistent framebuffer, when it is used bands are bounce buffers
+    uint16_t *framebuffer;
 };
 
 static struct Screen *screen;
 
-// This functions is taken from:
-// https://stackoverflow.com/questions/18937701/combining-two-16-bits-rgb-colors-with-alpha-blending
-static inline uint16_t alpha_blend_rgb565(uint32_t fg, uint32_t bg, uint8_t alpha)
-{
-    alpha = (alpha + 4) >> 3;
-    bg = (bg | (bg << 16)) & 0b00000111111000001111100000011111;
-    fg = (fg | (fg << 16)) & 0b00000111111000001111100000011111;
-    uint32_t result = ((((fg - bg) * alpha) >> 5) + bg) & 0b00000111111000001111100000011111;
-    return (uint16_t)((result >> 16) | result);
-}
-
-static inline uint8_t rgba8888_get_alpha(uint32_t color)
-{
-    return color & 0xFF;
-}
-
-static inline uint16_t rgba8888_color_to_rgb565(struct Screen *s, uint32_t color)
-{
-    uint8_t r = color >> 24;
-    uint8_t g = (color >> 16) & 0xFF;
-    uint8_t b = (color >> 8) & 0xFF;
-
-    return (((uint16_t)(r >> 3)) << 11) | (((uint16_t)(g >> 2)) << 5) | ((uint16_t) b >> 3);
-}
-
-static inline uint16_t rgb565_color_to_surface(struct Screen *s, uint16_t color16)
-{
-    return (uint16_t) SPI_SWAP_DATA_TX(color16, 16);
-}
-
-static inline uint16_t uint32_color_to_surface(struct Screen *s, uint32_t color)
-{
-    uint16_t color16 = rgba8888_color_to_rgb565(s, color);
-
-    return rgb565_color_to_surface(s, color16);
-}
-
 struct PendingReply
 {
     uint64_t pending_call_ref_ticks;
     term pending_call_pid;
 };
 
-static QueueHandle_t display_messages_queue;
-
 static NativeHandlerResult display_driver_consume_mailbox(Context *ctx);
 static void display_init(Context *ctx, term opts);
 static void display_init_alt_gamma_2(struct SPI *spi);
@@ -188,353 +183,328 @@ static inline void writedata(struct SPI *spi, uint32_t data)
 
 static inline void writecommand(struct SPI *spi, uint8_t command)
 {
-    gpio_set_level(spi->dc_gpio, 0);
-    writedata(spi, command);
-    gpio_set_level(spi->dc_gpio, 1);
+    spi_device_acquire_bus(spi->spi_disp.handle, portMAX_DELAY);
+    spi_display_write_command(&spi->spi_disp, command, NULL, 0);
+    spi_device_release_bus(spi->spi_disp.handle);
+}
+
+// The bus must be already acquired
+static inline void write_paint_area(struct SPI *spi, int x, int y, int width, int height)
+{
+    int x1 = (x + width) - 1;
+    int y1 = (y + height) - 1;
+    uint8_t columns[4] = { x >> 8, x & 0xFF, x1 >> 8, x1 & 0xFF };
+    uint8_t rows[4] = { y >> 8, y & 0xFF, y1 >> 8, y1 & 0xFF };
+
+    spi_display_write_command(&spi->spi_disp, ST7789_CASET, columns, sizeof(columns));
+    spi_display_write_command(&spi->spi_disp, ST7789_RASET, rows, sizeof(rows));
 }
 
 static inline void set_screen_paint_area(struct SPI *spi, int x, int y, int width, int height)
 {
-    writecommand(spi, ST7789_CASET);
     spi_device_acquire_bus(spi->spi_disp.handle, portMAX_DELAY);
-    spi_display_write(&spi->spi_disp, 32, (x << 16) | ((x + width) - 1));
+    write_paint_area(spi, x, y, width, height);
     spi_device_release_bus(spi->spi_disp.handle);
+}
 
-    writecommand(spi, ST7789_RASET);
+static void begin_ram_write(struct SPI *spi, int x, int y, int width, int height)
+{
     spi_device_acquire_bus(spi->spi_disp.handle, portMAX_DELAY);
-    spi_display_write(&spi->spi_disp, 32, (y << 16) | ((y + height) - 1));
+    write_paint_area(spi, x, y, width, height);
+    spi_display_write_command(&spi->spi_disp, ST7789_RAMWR, NULL, 0);
     spi_device_release_bus(spi->spi_disp.handle);
 }
 
-static int draw_image_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
-{
-    int x = item->x;
-    int y = item->y;
-
-    uint16_t bgcolor = 0;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor = rgba8888_color_to_rgb565(screen, item->brcolor);
-        visible_bg = true;
-    } else {
-        visible_bg = false;
-    }
+#include "display_pipeline.h"
 
-    int width = item->width;
-    const char *data = item->data.image_data.pix;
-
-    int drawn_pixels = 0;
-
-    uint32_t *pixels = ((uint32_t *) data) + (ypos - y) * width + (xpos - x);
-    uint16_t *pixmem16 = (uint16_t *) (((uint8_t *) screen->pixels) + xpos * sizeof(uint16_t));
+static void destroy_message(Message *m, GlobalContext *global)
+{
+    BEGIN_WITH_STACK_HEAP(1, temp_heap);
+    mailbox_message_dispose(&m->base, &temp_heap);
+    END_WITH_STACK_HEAP(temp_heap, global);
+}
 
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
+static void forget_prev_display_list(struct SPI *spi, GlobalContext *global)
+{
+    if (spi->prev_message) {
+        frame_arena_reset(&spi->arenas[spi->next_arena ^ 1]);
+        destroy_message(spi->prev_message, global);
     }
+    spi->prev_message = NULL;
+    spi->prev_items = NULL;
+    spi->prev_items_len = 0;
+}
 
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        uint8_t alpha = rgba8888_get_alpha(img_pixel);
-        if (alpha == 0xFF) {
-            uint16_t color = uint32_color_to_surface(screen, img_pixel);
-            pixmem16[drawn_pixels] = color;
-        } else if (visible_bg) {
-            uint16_t color = rgba8888_color_to_rgb565(screen, img_pixel);
-            uint16_t blended = alpha_blend_rgb565(color, bgcolor, alpha);
-            pixmem16[drawn_pixels] = rgb565_color_to_surface(screen, blended);
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        pixels++;
+static void begin_area(struct SPI *spi, int x, int y, int width, int height)
+{
+    if (spi->pipeline) {
+        pipeline_begin_window(spi->pipeline, x, y, width, height);
+        return;
     }
 
-    return drawn_pixels;
+    begin_ram_write(spi, x, y, width, height);
+    spi_device_acquire_bus(spi->spi_disp.handle, portMAX_DELAY);
 }
 
-static int draw_scaled_cropped_img_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static inline uint16_t *take_band(struct SPI *spi)
 {
-    int x = item->x;
-    int y = item->y;
-
-    uint16_t bgcolor = 0;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor = rgba8888_color_to_rgb565(screen, item->brcolor);
-        visible_bg = true;
-    } else {
-        visible_bg = false;
+    if (spi->pipeline) {
+        return pipeline_take_band(spi->pipeline);
     }
 
-    int width = item->width;
-    const char *data = item->data.image_data_with_size.pix;
-
-    int drawn_pixels = 0;
-
-    int y_scale = item->y_scale;
-    int x_scale = item->x_scale;
-    int img_width = item->data.image_data_with_size.width;
-
-    int source_x = item->source_x;
-    int source_y = item->source_y;
-
-    uint32_t *pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + ((xpos - x) / x_scale);
-    uint16_t *pixmem16 = (uint16_t *) (((uint8_t *) screen->pixels) + xpos * sizeof(uint16_t));
+    // there are queue depth + 1 bands, so the oldest one is not being sent anymore
+    uint16_t *band = screen->bands[screen->next_band];
+    screen->next_band = (screen->next_band + 1) % screen->bands_count;
 
-    if (source_x + (width / x_scale) > img_width) {
-        width = (img_width - source_x) * x_scale;
-    }
+    return band;
+}
 
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
+static inline void send_band(struct SPI *spi, uint16_t *band, int len)
+{
+    if (spi->pipeline) {
+        pipeline_send_band(spi->pipeline, band, len);
+    } else {
+        spi_display_queue_dmawrite(&spi->spi_disp, len, band);
     }
+}
 
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        uint8_t alpha = rgba8888_get_alpha(img_pixel);
-        if (alpha == 0xFF) {
-            uint16_t color = uint32_color_to_surface(screen, img_pixel);
-            pixmem16[drawn_pixels] = color;
-        } else if (visible_bg) {
-            uint16_t color = rgba8888_color_to_rgb565(screen, img_pixel);
-            uint16_t blended = alpha_blend_rgb565(color, bgcolor, alpha);
-            pixmem16[drawn_pixels] = rgb565_color_to_surface(screen, blended);
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        // TODO: optimize here
-        pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + (j / x_scale);
+static void end_area(struct SPI *spi)
+{
+    if (spi->pipeline) {
+        pipeline_end_window(spi->pipeline);
+        return;
     }
 
-    return drawn_pixels;
+    spi_display_wait_queued(&spi->spi_disp);
+    spi_device_release_bus(spi->spi_disp.handle);
 }
 
-static int draw_rect_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static void update_area(struct SPI *spi, const struct Rectangle *damaged, struct ScanlineIndex *index)
 {
-    int x = item->x;
-    int width = item->width;
-    uint16_t color = uint32_color_to_surface(screen, item->brcolor);
-
-    int drawn_pixels = 0;
-
-    uint16_t *pixmem16 = (uint16_t *) (((uint8_t *) screen->pixels) + xpos * sizeof(uint16_t));
+    // DMA works better with 32 bit aligned buffers, so let's start and end on even pixels
+    int x0 = damaged->x & ~1;
+    int x1 = int_min((damaged->x + damaged->width + 1) & ~1, screen->w);
+    int y0 = damaged->y;
+    int y1 = damaged->y + damaged->height;
+    int line_len = x1 - x0;
+
+    begin_area(spi, x0, y0, line_len, y1 - y0);
+
+    for (int band_y = y0; band_y < y1; band_y += screen->band_height) {
+        int lines = int_min(screen->band_height, y1 - band_y);
+        uint16_t *band = take_band(spi);
+
+        DISPLAY_STATS_START(raster_start);
+        for (int i = 0; i < lines; i++) {
+            uint16_t *line = band + i * screen->w;
+            int xpos = x0;
+            while (xpos < x1) {
+                int drawn_pixels = draw_x((uint8_t *) line, xpos, band_y + i, index);
+                xpos += drawn_pixels;
+            }
 
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
+            // lines are sent back to back, so they must be packed when the area is narrower
+            // than the screen (line i + 1 is always drawn after the packed area)
+            if (line_len != screen->w) {
+                memmove(band + i * line_len, line + x0, line_len * sizeof(uint16_t));
+            }
+        }
+        DISPLAY_STATS_ADD_ELAPSED(raster_us, raster_start);
 
-    for (int j = xpos - x; j < width; j++) {
-        pixmem16[drawn_pixels] = color;
-        drawn_pixels++;
+        // I did a quick measurement, and most of the time is spent waiting for DMA transaction
+        // eg. 23 us spent in draw_x, 188 us spent in spi_device_get_trans_result, so several
+        // transactions are queued while next bands are rendered
+        send_band(spi, band, lines * line_len * sizeof(uint16_t));
     }
 
-    return drawn_pixels;
+    end_area(spi);
 }
 
-static int draw_text_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+// Framebuffer rows are copied into the bands, that are used as bounce buffers, so each DMA
+// transaction can send many lines while next ones are being copied.
+static void push_framebuffer_area(struct SPI *spi, int x, int y, int width, int height)
 {
-    int x = item->x;
-    int y = item->y;
-    uint16_t fgcolor = uint32_color_to_surface(screen, item->data.text_data.fgcolor);
-    uint16_t bgcolor;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor = uint32_color_to_surface(screen, item->brcolor);
-        visible_bg = true;
-    } else {
-        visible_bg = false;
-    }
+    begin_area(spi, x, y, width, height);
 
-    char *text = (char *) item->data.text_data.text;
+    int line_size = width * sizeof(uint16_t);
+    int lines_per_transaction = int_min((screen->band_height * screen->w) / width, SPI_DISPLAY_MAX_TRANSFER_SIZE / line_size);
 
-    int width = item->width;
+    for (int ypos = y; ypos < y + height; ypos += lines_per_transaction) {
+        int lines = int_min(lines_per_transaction, y + height - ypos);
 
-    int drawn_pixels = 0;
-
-    uint16_t *pixmem32 = (uint16_t *) (((uint8_t *) screen->pixels) + xpos * sizeof(uint16_t));
+        uint16_t *band = take_band(spi);
+        for (int i = 0; i < lines; i++) {
+            memcpy(band + i * width, screen->framebuffer + (ypos + i) * screen->w + x, line_size);
+        }
 
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
+        send_band(spi, band, lines * line_size);
     }
 
-    for (int j = xpos - x; j < width; j++) {
-        int char_index = j / CHAR_WIDTH;
-        char c = text[char_index];
-        unsigned const char *glyph = fontdata + ((unsigned char) c) * 16;
-
-        unsigned char row = glyph[ypos - y];
-
-        bool opaque;
-        int k = j % CHAR_WIDTH;
-        if (row & (1 << (7 - k))) {
-            opaque = true;
-        } else {
-            opaque = false;
-        }
+    end_area(spi);
+}
 
-        if (opaque) {
-            pixmem32[drawn_pixels] = fgcolor;
-        } else if (visible_bg) {
-            pixmem32[drawn_pixels] = bgcolor;
-        } else {
-            return drawn_pixels;
+static void update_framebuffer_area(struct SPI *spi, const struct Rectangle *damaged, struct ScanlineIndex *index)
+{
+    // DMA works better with 32 bit aligned buffers, so let's start and end on even pixels
+    int x0 = damaged->x & ~1;
+    int x1 = int_min((damaged->x + damaged->width + 1) & ~1, screen->w);
+    int y0 = damaged->y;
+    int y1 = damaged->y + damaged->height;
+
+    DISPLAY_STATS_START(raster_start);
+    for (int ypos = y0; ypos < y1; ypos++) {
+        uint8_t *line_buf = (uint8_t *) (screen->framebuffer + ypos * screen->w);
+        int xpos = x0;
+        while (xpos < x1) {
+            int drawn_pixels = draw_x(line_buf, xpos, ypos, index);
+            xpos += drawn_pixels;
         }
-        drawn_pixels++;
     }
+    DISPLAY_STATS_ADD_ELAPSED(raster_us, raster_start);
 
-    return drawn_pixels;
+    push_framebuffer_area(spi, x0, y0, x1 - x0, y1 - y0);
 }
 
-static int find_max_line_len(BaseDisplayItem *items, int count, int xpos, int ypos)
+static void do_update(Context *ctx, Message *message, term display_list)
 {
-    int line_len = screen->w;
+    struct SPI *spi = ctx->platform_data;
+    struct FrameArena *arena = &spi->arenas[spi->next_arena];
 
-    for (int i = 0; i < count; i++) {
-        BaseDisplayItem *item = &items[i];
+    DISPLAY_STATS_START(parse_start);
+    int len;
+    BaseDisplayItem *items;
+    if (spi->retain_items) {
+        items = init_items(display_list, &len, spi->prev_items, spi->prev_items_len, ctx, arena);
+    } else {
+        items = init_items(display_list, &len, NULL, 0, ctx, arena);
+    }
 
-        if ((xpos < item->x) && (ypos >= item->y) && (ypos < item->y + item->height)) {
-            int len_to_item = item->x - xpos;
-            line_len = (line_len > len_to_item) ? len_to_item : line_len;
+    struct DamageList damaged;
+    damage_list_init(&damaged);
+    dumb_diff(spi->prev_items, spi->prev_items_len, items, len, &damaged);
+
+    // items keep pointers to binaries owned by the message, so it must be kept around
+    // as long as items are used for damage tracking
+    forget_prev_display_list(spi, ctx->global);
+    spi->prev_message = message;
+    spi->prev_items = items;
+    spi->prev_items_len = len;
+    spi->next_arena ^= 1;
+
+    struct Rectangle screen_rect = {
+        .x = 0,
+        .y = 0,
+        .width = screen->w,
+        .height = screen->h,
+        .valid = true
+    };
+    damage_list_clip(&damaged, &screen_rect);
+
+    struct ScanlineIndex index;
+    scanline_index_init(&index, items, len, screen->w, arena);
+    DISPLAY_STATS_ADD_ELAPSED(parse_us, parse_start);
+    DISPLAY_STATS_ADD(frames, 1);
+    DISPLAY_STATS_ADD(skipped_lines, screen->h - damage_list_rows(&damaged, screen->h));
+
+    // one windowed burst for each damaged rectangle, nothing is sent when nothing changed
+    for (int i = 0; i < damaged.count; i++) {
+        if (screen->framebuffer) {
+            update_framebuffer_area(spi, &damaged.rectangles[i], &index);
+        } else {
+            update_area(spi, &damaged.rectangles[i], &index);
         }
     }
-
-    return line_len;
 }
 
-static int draw_x(int xpos, int ypos, BaseDisplayItem *items, int items_count)
+// Pixels are byte swapped (or just copied) into the bands, that are allocated once, so next
+// chunk is prepared while previous ones are being sent.
+static void draw_buffer(struct SPI *spi, int x, int y, int width, int height, const void *imgdata, bool swap)
 {
-    bool below = false;
-
-    for (int i = 0; i < items_count; i++) {
-        BaseDisplayItem *item = &items[i];
-        if ((xpos < item->x) || (xpos >= item->x + item->width) || (ypos < item->y) || (ypos >= item->y + item->height)) {
-            continue;
-        }
-
-        int max_line_len = below ? 1 : find_max_line_len(items, i, xpos, ypos);
-
-        int drawn_pixels = 0;
-        switch (items[i].primitive) {
-            case Image:
-                drawn_pixels = draw_image_x(xpos, ypos, max_line_len, item);
-                break;
-
-            case Rect:
-                drawn_pixels = draw_rect_x(xpos, ypos, max_line_len, item);
-                break;
+    const uint16_t *data = imgdata;
+    int dest_size = width * height;
+    int band_pixels = screen->band_height * screen->w;
 
-            case ScaledCroppedImage:
-                drawn_pixels = draw_scaled_cropped_img_x(xpos, ypos, max_line_len, item);
-                break;
+    begin_area(spi, x, y, width, height);
 
-            case Text:
-                drawn_pixels = draw_text_x(xpos, ypos, max_line_len, item);
-                break;
-            default: {
-                fprintf(stderr, "unexpected display list command.\n");
+    for (int i = 0; i < dest_size; i += band_pixels) {
+        int chunk_size = int_min(band_pixels, dest_size - i);
+        uint16_t *band = take_band(spi);
+        if (swap) {
+            for (int j = 0; j < chunk_size; j++) {
+                band[j] = SPI_SWAP_DATA_TX(data[i + j], 16);
             }
+        } else {
+            memcpy(band, data + i, chunk_size * sizeof(uint16_t));
         }
-
-        if (drawn_pixels != 0) {
-            return drawn_pixels;
-        }
-
-        below = true;
+        send_band(spi, band, chunk_size * sizeof(uint16_t));
     }
 
-    return 1;
+    end_area(spi);
 }
 
-static void do_update(Context *ctx, term display_list)
+// Waits for draw_dma_buffer transactions, it must be called before the bus is used again.
+static void wait_dma_buffer(struct SPI *spi)
 {
-    int proper;
-    int len = term_list_length(display_list, &proper);
-
-    BaseDisplayItem *items = malloc(sizeof(BaseDisplayItem) * len);
-
-    term t = display_list;
-    for (int i = 0; i < len; i++) {
-        init_item(&items[i], term_get_list_head(t), ctx);
-        t = term_get_list_tail(t);
+    if (spi->dma_buffer_queued) {
+        spi_display_wait_queued(&spi->spi_disp);
+        spi_device_release_bus(spi->spi_disp.handle);
+        spi->dma_buffer_queued = false;
     }
+}
 
-    int screen_width = screen->w;
-    int screen_height = screen->h;
-    struct SPI *spi = ctx->platform_data;
-
-    set_screen_paint_area(spi, 0, 0, screen_width, screen_height);
-    writecommand(spi, ST7789_RAMWR);
-    spi_device_acquire_bus(spi->spi_disp.handle, portMAX_DELAY);
-
-    bool transaction_in_progress = false;
-
-    for (int ypos = 0; ypos < screen_height; ypos++) {
-        int xpos = 0;
-        while (xpos < screen_width) {
-            int drawn_pixels = draw_x(xpos, ypos, items, len);
-            xpos += drawn_pixels;
-        }
-
-        if (transaction_in_progress) {
-            spi_transaction_t *trans;
-            // I did a quick measurement, and most of the time is spent waiting for DMA transaction
-            // eg. 23 us spent in draw_x, 188 us spent in spi_device_get_trans_result
-            spi_device_get_trans_result(spi->spi_disp.handle, &trans, portMAX_DELAY);
-        }
-
-        // NEW CODE
-        void *tmp = screen->pixels;
-        screen->pixels = screen->pixels_out;
-        screen->pixels_out = tmp;
-        spi_display_dmawrite(&spi->spi_disp, screen_width * sizeof(uint16_t), screen->pixels_out);
-        transaction_in_progress = true;
-    }
+// Tells last draw_dma_buffer caller that its buffer can be reused, once it has been sent.
+static void complete_dma_buffer(struct SPI *spi, GlobalContext *global)
+{
+    wait_dma_buffer(spi);
 
-    if (transaction_in_progress) {
-        spi_transaction_t *trans;
-        spi_device_get_trans_result(spi->spi_disp.handle, &trans, portMAX_DELAY);
+    if (spi->dma_buffer_pid != term_invalid_term()) {
+        display_messages_send_dma_buffer_done(spi->dma_buffer_pid, spi->dma_buffer_addr_low,
+            spi->dma_buffer_addr_high, global);
+        spi->dma_buffer_pid = term_invalid_term();
     }
-
-    spi_device_release_bus(spi->spi_disp.handle);
-
-    destroy_items(items, len);
 }
 
-static void draw_buffer(struct SPI *spi, int x, int y, int width, int height, const void *imgdata)
+// The buffer is queued as it is, so it must be already in panel byte order, and transactions are
+// left in flight (see wait_dma_buffer). Buffers that cannot be used for DMA are sent through the
+// bands.
+static void draw_dma_buffer(struct SPI *spi, int x, int y, int width, int height, const void *imgdata)
 {
-    const uint16_t *data = imgdata;
-
-    set_screen_paint_area(spi, x, y, width, height);
+    wait_dma_buffer(spi);
 
-    writecommand(spi, ST7789_RAMWR);
-
-    int dest_size = width * height;
-    int buf_pixel_size = (dest_size > 1024) ? 1024 : dest_size;
+    if (!spi_display_is_dma_capable(imgdata)) {
+        draw_buffer(spi, x, y, width, height, imgdata, false);
+        return;
+    }
 
-    int chunks = dest_size / 1024;
+    // the buffer is not a band, so the transmitter task cannot be used
+    if (spi->pipeline) {
+        pipeline_sync(spi->pipeline);
+    }
 
-    uint16_t *tmpbuf = heap_caps_malloc(buf_pixel_size * sizeof(uint16_t), MALLOC_CAP_DMA);
+    const uint8_t *data = imgdata;
+    int size = width * height * sizeof(uint16_t);
 
+    begin_ram_write(spi, x, y, width, height);
     spi_device_acquire_bus(spi->spi_disp.handle, portMAX_DELAY);
-    for (int i = 0; i < chunks; i++) {
-        const uint16_t *data_b = data + 1024 * i;
-        for (int j = 0; j < 1024; j++) {
-            tmpbuf[j] = SPI_SWAP_DATA_TX(data_b[j], 16);
-        }
-        spi_display_dmawrite(&spi->spi_disp, buf_pixel_size * sizeof(uint16_t), tmpbuf);
-    }
-    int last_chunk_size = dest_size - chunks * 1024;
-    if (last_chunk_size) {
-        const uint16_t *data_b = data + chunks * 1024;
-        for (int j = 0; j < 1024; j++) {
-            tmpbuf[j] = SPI_SWAP_DATA_TX(data_b[j], 16);
-        }
-        spi_display_dmawrite(&spi->spi_disp, last_chunk_size * sizeof(uint16_t), tmpbuf);
+    for (int offset = 0; offset < size; offset += SPI_DISPLAY_MAX_TRANSFER_SIZE) {
+        spi_display_queue_dmawrite(&spi->spi_disp, int_min(SPI_DISPLAY_MAX_TRANSFER_SIZE, size - offset), data + offset);
     }
-    spi_device_release_bus(spi->spi_disp.handle);
+    spi->dma_buffer_queued = true;
+}
+
+#include "display_benchmark.h"
+#include "display_clock_probe.h"
 
-    free(tmpbuf);
+// SPI counters are updated by the transmitter task too, so it must be idle before they are used.
+static inline void sync_spi_stats(struct SPI *spi)
+{
+#if DISPLAY_STATS
+    if (spi->pipeline) {
+        pipeline_sync(spi->pipeline);
+    }
+#else
+    UNUSED(spi);
+#endif
 }
 
 static void process_message(Message *message, Context *ctx)
@@ -556,10 +526,14 @@ static void process_message(Message *message, Context *ctx)
     if (cmd == context_make_atom(ctx, "\x6"
                                       "update")) {
         term display_list = term_get_tuple_element(req, 1);
-        do_update(ctx, display_list);
-
-    } else if (cmd == context_make_atom(ctx, "\xB"
-                                             "draw_buffer")) {
+        do_update(ctx, message, display_list);
+
+    } else if ((cmd == context_make_atom(ctx, "\xB"
+                                              "draw_buffer"))
+        || (cmd == context_make_atom(ctx, "\xF"
+                                          "draw_dma_buffer"))) {
+        bool zero_copy = (cmd != context_make_atom(ctx, "\xB"
+                                                        "draw_buffer"));
         int x = term_to_int(term_get_tuple_element(req, 1));
         int y = term_to_int(term_get_tuple_element(req, 2));
         int width = term_to_int(term_get_tuple_element(req, 3));
@@ -569,9 +543,58 @@ static void process_message(Message *message, Context *ctx)
 
         const void *data = (const void *) ((addr_low | (addr_high << 16)));
 
-        draw_buffer(spi, x, y, width, height, data);
+        if (zero_copy) {
+            draw_dma_buffer(spi, x, y, width, height, data);
+        } else {
+            draw_buffer(spi, x, y, width, height, data, true);
+        }
+        // panel content is not anymore in sync with last display list
+        forget_prev_display_list(spi, ctx->global);
+
+        // draw_buffer is a kind of cast, no need to reply, while draw_dma_buffer reply tells
+        // that the buffer has been queued, and dma_buffer_done is sent once it can be reused
+        if (!zero_copy) {
+            return;
+        }
+        spi->dma_buffer_pid = gen_message.pid;
+        spi->dma_buffer_addr_low = term_get_tuple_element(req, 5);
+        spi->dma_buffer_addr_high = term_get_tuple_element(req, 6);
+
+    } else if (cmd == context_make_atom(ctx, "\xB"
+                                             "cache_image")) {
+        bool evicted = false;
+        bool cached = (term_get_tuple_arity(req) == 3)
+            && cache_image_tuple(term_get_tuple_element(req, 1), term_get_tuple_element(req, 2), ctx, &evicted);
+        // items of previous display list might point to evicted pixels
+        if (evicted) {
+            forget_prev_display_list(spi, ctx->global);
+        }
+        display_messages_send_reply(&gen_message, cached ? OK_ATOM : ERROR_ATOM, ctx->global);
+        return;
+
+    } else if (cmd == context_make_atom(ctx, "\xB"
+                                             "cache_stats")) {
+        display_messages_send_image_cache_stats(&gen_message, ctx->global);
+        return;
+
+    } else if (cmd == context_make_atom(ctx, "\x9"
+                                             "benchmark")) {
+        benchmark_handle_call(spi, &gen_message, ctx->global);
+        return;
 
-        // draw_buffer is a kind of cast, no need to reply
+    } else if (cmd == context_make_atom(ctx, "\x9"
+                                             "get_stats")) {
+        sync_spi_stats(spi);
+        DISPLAY_STATS_COLLECT_SPI(&spi->spi_disp);
+        display_messages_send_stats(&gen_message, ctx->global);
+        return;
+
+    } else if (cmd == context_make_atom(ctx, "\xB"
+                                             "reset_stats")) {
+        sync_spi_stats(spi);
+        display_messages_reset_stats();
+        DISPLAY_STATS_RESET_SPI(&spi->spi_disp);
+        display_messages_send_reply(&gen_message, OK_ATOM, ctx->global);
         return;
 
     } else {
@@ -593,14 +616,21 @@ static void process_messages(void *arg)
 {
     struct SPI *args = arg;
 
+    if (args->pipeline) {
+        pipeline_set_renderer(args->pipeline);
+    }
+
     while (true) {
-        Message *message;
-        xQueueReceive(display_messages_queue, &message, portMAX_DELAY);
+        // buffers are completed when there is nothing else to do, or before the bus is used again
+        complete_dma_buffer(args, args->ctx->global);
+
+        Message *message = display_messages_receive();
         process_message(message, args->ctx);
 
-        BEGIN_WITH_STACK_HEAP(1, temp_heap);
-        mailbox_message_dispose(&message->base, &temp_heap);
-        END_WITH_STACK_HEAP(temp_heap, args->ctx->global);
+        // last update message is kept until next update
+        if (message != args->prev_message) {
+            destroy_message(message, args->ctx->global);
+        }
     }
 }
 
@@ -609,7 +639,7 @@ static NativeHandlerResult display_driver_consume_mailbox(Context *ctx)
     MailboxMessage *mbox_msg = mailbox_take_message(&ctx->mailbox);
     Message *msg = CONTAINER_OF(mbox_msg, Message, base);
 
-    xQueueSend(display_messages_queue, &msg, 1);
+    display_messages_enqueue(msg);
 
     return NativeContinue;
 }
@@ -638,29 +668,98 @@ static void send_message(term pid, term message, GlobalContext *global)
 
 static void display_init(Context *ctx, term opts)
 {
+    display_atoms_init(ctx->global);
+
     screen = malloc(sizeof(struct Screen));
     // FIXME: hardcoded width and height
     screen->w = 320;
     screen->h = 240;
-    screen->pixels = heap_caps_malloc(screen->w * sizeof(uint16_t), MALLOC_CAP_DMA);
-    screen->pixels_out = heap_caps_malloc(screen->w * sizeof(uint16_t), MALLOC_CAP_DMA);
+    screen->framebuffer = NULL;
+
+    term framebuffer = interop_kv_get_value_default(opts, ATOM_STR("\xB", "framebuffer"), UNDEFINED_ATOM, ctx->global);
+    if (framebuffer == globalcontext_make_atom(ctx->global, ATOM_STR("\x5", "psram"))) {
+        screen->framebuffer = heap_caps_malloc(screen->w * screen->h * sizeof(uint16_t), MALLOC_CAP_SPIRAM);
+        if (screen->framebuffer) {
+            memset(screen->framebuffer, 0, screen->w * screen->h * sizeof(uint16_t));
+        } else {
+            ESP_LOGW(TAG, "Failed to allocate framebuffer in PSRAM, falling back to line buffers.");
+        }
+    } else if (framebuffer != UNDEFINED_ATOM) {
+        ESP_LOGW(TAG, "Unsupported framebuffer option, using line buffers.");
+    }
 
-    display_messages_queue = xQueueCreate(32, sizeof(Message *));
+    // bounce buffers can be as big as a transaction, since they are filled with a memcpy
+    int max_band_height = SPI_DISPLAY_MAX_TRANSFER_SIZE / (screen->w * sizeof(uint16_t));
+    int default_band_height = screen->framebuffer ? max_band_height : 1;
+    term band_height = interop_kv_get_value_default(opts, ATOM_STR("\xB", "band_height"), term_from_int(default_band_height), ctx->global);
+    term queue_depth = interop_kv_get_value_default(opts, ATOM_STR("\xB", "queue_depth"), term_from_int(1), ctx->global);
+    if (!term_is_integer(band_height) || (term_to_int(band_height) < 1) || !term_is_integer(queue_depth)
+        || (term_to_int(queue_depth) < 1) || (term_to_int(queue_depth) > MAX_QUEUE_DEPTH)) {
+        ESP_LOGE(TAG, "Failed init: invalid band_height or queue_depth.");
+        return;
+    }
+    struct PipelineConfig pipeline_config;
+    if (!pipeline_parse_config(&pipeline_config, opts, ctx->global)) {
+        ESP_LOGE(TAG, "Failed init: invalid pipeline options.");
+        return;
+    }
+    screen->band_height = term_to_int(band_height);
+    if (screen->band_height > max_band_height) {
+        ESP_LOGW(TAG, "band_height is too big for a single SPI transaction, using %i.", max_band_height);
+        screen->band_height = max_band_height;
+    }
+
+    // in pipelined mode one more band is allocated, so the renderer can fill a band while the
+    // transmitter is waiting for a free slot in the DMA queue
+    screen->bands_count = term_to_int(queue_depth) + (pipeline_config.enabled ? 2 : 1);
+    screen->next_band = 0;
+    screen->bands = malloc(sizeof(uint16_t *) * screen->bands_count);
+    for (int i = 0; i < screen->bands_count; i++) {
+        screen->bands[i] = heap_caps_malloc(screen->band_height * screen->w * sizeof(uint16_t), MALLOC_CAP_DMA);
+        if (IS_NULL_PTR(screen->bands[i])) {
+            ESP_LOGE(TAG, "Failed init: cannot allocate DMA buffers.");
+            return;
+        }
+    }
+
+    if (!display_messages_init(opts, ctx->global)) {
+        ESP_LOGE(TAG, "Failed init: invalid coalesce_updates option.");
+        return;
+    }
+
+    if (!image_cache_init(opts, ctx->global)) {
+        ESP_LOGE(TAG, "Failed init: invalid image cache options.");
+        return;
+    }
 
     struct SPI *spi = malloc(sizeof(struct SPI));
     ctx->platform_data = spi;
 
     spi->ctx = ctx;
+    spi->prev_message = NULL;
+    spi->prev_items = NULL;
+    spi->prev_items_len = 0;
+    frame_arena_init(&spi->arenas[0]);
+    frame_arena_init(&spi->arenas[1]);
+    spi->next_arena = 0;
+    spi->pipeline = NULL;
+    spi->dma_buffer_queued = false;
+    spi->dma_buffer_pid = term_invalid_term();
+
+    bool ok = display_common_gpio_from_opts(opts, ATOM_STR("\x2", "dc"), &spi->dc_gpio, ctx->global);
 
     struct SPIDisplayConfig spi_config;
     spi_display_init_config(&spi_config);
     spi_config.mode = SPI_MODE;
     spi_config.clock_speed_hz = SPI_CLOCK_HZ;
-    spi_display_parse_config(&spi_config, opts, ctx->global);
+    spi_config.queue_size = term_to_int(queue_depth);
+    spi_config.dc_gpio = ok ? spi->dc_gpio : -1;
+    if (!spi_display_parse_config(&spi_config, opts, ctx->global)) {
+        ESP_LOGE(TAG, "Failed init: invalid SPI options.");
+        return;
+    }
     spi_display_init(&spi->spi_disp, &spi_config);
 
-    bool ok = display_common_gpio_from_opts(opts, ATOM_STR("\x2", "dc"), &spi->dc_gpio, ctx->global);
-
     bool reset_configured = true;
     if (!display_common_gpio_from_opts(opts, ATOM_STR("\x5", "reset"), &spi->reset_gpio, ctx->global)) {
         ESP_LOGI(TAG, "Reset GPIO not configured.");
@@ -675,6 +774,13 @@ static void display_init(Context *ctx, term opts)
     ok = ok && ((invon == TRUE_ATOM) || (invon == FALSE_ATOM));
     bool enable_tft_invon = (invon == TRUE_ATOM);
 
+    term retain_items = interop_kv_get_value_default(opts, ATOM_STR("\xC", "retain_items"), FALSE_ATOM, ctx->global);
+    ok = ok && ((retain_items == TRUE_ATOM) || (retain_items == FALSE_ATOM));
+    spi->retain_items = (retain_items == TRUE_ATOM);
+
+    term probe_spi_clock = interop_kv_get_value_default(opts, ATOM_STR("\xF", "probe_spi_clock"), FALSE_ATOM, ctx->global);
+    ok = ok && ((probe_spi_clock == TRUE_ATOM) || (probe_spi_clock == FALSE_ATOM));
+
     if (UNLIKELY(!ok)) {
         ESP_LOGE(TAG, "Failed init: invalid display parameters.");
         return;
@@ -692,8 +798,6 @@ static void display_init(Context *ctx, term opts)
         spi_device_release_bus(spi->spi_disp.handle);
     }
 
-    gpio_set_direction(spi->dc_gpio, GPIO_MODE_OUTPUT);
-
     if (!reset_configured) {
         writecommand(spi, ST7789_SWRESET);
         delay(100);
@@ -718,209 +822,87 @@ static void display_init(Context *ctx, term opts)
     writecommand(spi, ST7789_DISPON);
     delay(120);
 
+    if (probe_spi_clock == TRUE_ATOM) {
+        int clock_speed_hz = clock_probe_run(spi, spi_config.clock_speed_hz);
+        if (clock_speed_hz > 0) {
+            ESP_LOGI(TAG, "Using %i Hz SPI clock.", clock_speed_hz);
+        } else {
+            ESP_LOGW(TAG, "SPI clock probe failed (is MISO connected?), using %i Hz.", spi_config.clock_speed_hz);
+        }
+    }
+
     struct BacklightGPIOConfig backlight_config;
     backlight_gpio_init_config(&backlight_config);
     backlight_gpio_parse_config(&backlight_config, opts, ctx->global);
     backlight_gpio_init(&backlight_config);
 
-    xTaskCreate(process_messages, "display", 10000, spi, 1, NULL);
-}
-
-static void display_init_alt_gamma_2(struct SPI *spi)
-{
-    writecommand(spi, ST7789_SLPOUT);
-    delay(120);
+    if (pipeline_config.enabled) {
+        spi->pipeline = pipeline_new(spi, screen->bands, screen->bands_count, &pipeline_config);
+        if (IS_NULL_PTR(spi->pipeline)) {
+            ESP_LOGW(TAG, "Failed to start transmitter task, pipelined mode is disabled.");
+        }
+    }
 
-    writecommand(spi, ST7789_NORON);
+    xTaskCreatePinnedToCore(process_messages, "display", 10000, spi, pipeline_config.renderer_priority, NULL,
+        pipeline_config.renderer_core);
+}
 
+static const struct SPIDisplayCommand alt_gamma_2_init_commands[] = {
+    { ST7789_SLPOUT, 0, 120, { 0 } },
+    { ST7789_NORON, 0, 0, { 0 } },
     // - display and color format setting - //
-    writecommand(spi, ST7789_MADCTL);
-    writedata(spi, TFT_MAD_COLOR_ORDER);
-
-    writecommand(spi, ST7789_COLMOD);
-    writedata(spi, 0x55);
-    delay(10);
-
+    { ST7789_MADCTL, 1, 0, { TFT_MAD_COLOR_ORDER } },
+    { ST7789_COLMOD, 1, 10, { 0x55 } },
     // - ST7789V frame rate setting - //
-    writecommand(spi, ST7789_PORCTRL);
-    writedata(spi, 0x0C);
-    writedata(spi, 0x0C);
-    writedata(spi, 0x00);
-    writedata(spi, 0x33);
-    writedata(spi, 0x33);
-
-    writecommand(spi, ST7789_GCTRL);
-    writedata(spi, 0x75);
-
+    { ST7789_PORCTRL, 5, 0, { 0x0C, 0x0C, 0x00, 0x33, 0x33 } },
+    { ST7789_GCTRL, 1, 0, { 0x75 } },
     // - ST7789V power setting - //
-    writecommand(spi, ST7789_VCOMS);
-    writedata(spi, 0x1A);
-
-    writecommand(spi, ST7789_LCMCTRL);
-    writedata(spi, 0x2C);
-
-    writecommand(spi, ST7789_VDVVRHEN);
-    writedata(spi, 0x01);
-
-    writecommand(spi, ST7789_VRHS);
-    writedata(spi, 0x13);
-
-    writecommand(spi, ST7789_VDVSET);
-    writedata(spi, 0x20);
-
-    writecommand(spi, ST7789_FRCTR2);
-    writedata(spi, 0x0F);
-
-    writecommand(spi, ST7789_PWCTRL1);
-    writedata(spi, 0xA4);
-    writedata(spi, 0xA1);
-
+    { ST7789_VCOMS, 1, 0, { 0x1A } },
+    { ST7789_LCMCTRL, 1, 0, { 0x2C } },
+    { ST7789_VDVVRHEN, 1, 0, { 0x01 } },
+    { ST7789_VRHS, 1, 0, { 0x13 } },
+    { ST7789_VDVSET, 1, 0, { 0x20 } },
+    { ST7789_FRCTR2, 1, 0, { 0x0F } },
+    { ST7789_PWCTRL1, 2, 0, { 0xA4, 0xA1 } },
     // - ST7789V gamma setting - //
-    writecommand(spi, ST7789_PVGAMCTRL);
-    writedata(spi, 0xD0);
-    writedata(spi, 0x0D);
-    writedata(spi, 0x14);
-    writedata(spi, 0x0D);
-    writedata(spi, 0x0D);
-    writedata(spi, 0x09);
-    writedata(spi, 0x38);
-    writedata(spi, 0x44);
-    writedata(spi, 0x4E);
-    writedata(spi, 0x3A);
-    writedata(spi, 0x17);
-    writedata(spi, 0x18);
-    writedata(spi, 0x2F);
-    writedata(spi, 0x30);
-
-    writecommand(spi, ST7789_NVGAMCTRL);
-    writedata(spi, 0xD0);
-    writedata(spi, 0x09);
-    writedata(spi, 0x0F);
-    writedata(spi, 0x08);
-    writedata(spi, 0x07);
-    writedata(spi, 0x14);
-    writedata(spi, 0x37);
-    writedata(spi, 0x44);
-    writedata(spi, 0x4D);
-    writedata(spi, 0x38);
-    writedata(spi, 0x15);
-    writedata(spi, 0x16);
-    writedata(spi, 0x2C);
-    writedata(spi, 0x3E);
-
-    writecommand(spi, ST7789_CASET);
-    writedata(spi, 0x00);
-    writedata(spi, 0x00);
-    writedata(spi, 0x00);
-    writedata(spi, 0xEF); // 239
-
-    writecommand(spi, ST7789_RASET);
-    writedata(spi, 0x00);
-    writedata(spi, 0x00);
-    writedata(spi, 0x01);
-    writedata(spi, 0x3F); // 319
-}
+    { ST7789_PVGAMCTRL, 14, 0, { 0xD0, 0x0D, 0x14, 0x0D, 0x0D, 0x09, 0x38, 0x44, 0x4E, 0x3A, 0x17, 0x18, 0x2F, 0x30 } },
+    { ST7789_NVGAMCTRL, 14, 0, { 0xD0, 0x09, 0x0F, 0x08, 0x07, 0x14, 0x37, 0x44, 0x4D, 0x38, 0x15, 0x16, 0x2C, 0x3E } },
+    { ST7789_CASET, 4, 0, { 0x00, 0x00, 0x00, 0xEF } },
+    { ST7789_RASET, 4, 0, { 0x00, 0x00, 0x01, 0x3F } },
+};
 
-static void display_init_std(struct SPI *spi)
+static void display_init_alt_gamma_2(struct SPI *spi)
 {
-    writecommand(spi, ST7789_SLPOUT);
-    delay(120);
-
-    writecommand(spi, ST7789_NORON);
+    spi_display_write_sequence(&spi->spi_disp, alt_gamma_2_init_commands, SPI_DISPLAY_SEQUENCE_LEN(alt_gamma_2_init_commands));
+}
 
+static const struct SPIDisplayCommand std_init_commands[] = {
+    { ST7789_SLPOUT, 0, 120, { 0 } },
+    { ST7789_NORON, 0, 0, { 0 } },
     // - display and color format setting - //
-    writecommand(spi, ST7789_MADCTL);
-    writedata(spi, TFT_MAD_COLOR_ORDER);
-
-    writecommand(spi, 0xB6);
-    writedata(spi, 0x0A);
-    writedata(spi, 0x82);
-
-    writecommand(spi, ST7789_RAMCTRL);
-    writedata(spi, 0x00);
-    writedata(spi, 0xE0);
-
-    writecommand(spi, ST7789_COLMOD);
-    writedata(spi, 0x55);
-    delay(10);
-
+    { ST7789_MADCTL, 1, 0, { TFT_MAD_COLOR_ORDER } },
+    { 0xB6, 2, 0, { 0x0A, 0x82 } },
+    { ST7789_RAMCTRL, 2, 0, { 0x00, 0xE0 } },
+    { ST7789_COLMOD, 1, 10, { 0x55 } },
     // - ST7789V frame rate setting - //
-    writecommand(spi, ST7789_PORCTRL);
-    writedata(spi, 0x0C);
-    writedata(spi, 0x0C);
-    writedata(spi, 0x00);
-    writedata(spi, 0x33);
-    writedata(spi, 0x33);
-
-    writecommand(spi, ST7789_GCTRL);
-    writedata(spi, 0x35);
-
+    { ST7789_PORCTRL, 5, 0, { 0x0C, 0x0C, 0x00, 0x33, 0x33 } },
+    { ST7789_GCTRL, 1, 0, { 0x35 } },
     // - ST7789V power setting - //
-    writecommand(spi, ST7789_VCOMS);
-    writedata(spi, 0x28);
-
-    writecommand(spi, ST7789_LCMCTRL);
-    writedata(spi, 0x0C);
-
-    writecommand(spi, ST7789_VDVVRHEN);
-    writedata(spi, 0x01);
-    writedata(spi, 0xFF);
-
-    writecommand(spi, ST7789_VRHS);
-    writedata(spi, 0x10);
-
-    writecommand(spi, ST7789_VDVSET);
-    writedata(spi, 0x20);
-
-    writecommand(spi, ST7789_FRCTR2);
-    writedata(spi, 0x0F);
-
-    writecommand(spi, ST7789_PWCTRL1);
-    writedata(spi, 0xA4);
-    writedata(spi, 0xA1);
-
+    { ST7789_VCOMS, 1, 0, { 0x28 } },
+    { ST7789_LCMCTRL, 1, 0, { 0x0C } },
+    { ST7789_VDVVRHEN, 2, 0, { 0x01, 0xFF } },
+    { ST7789_VRHS, 1, 0, { 0x10 } },
+    { ST7789_VDVSET, 1, 0, { 0x20 } },
+    { ST7789_FRCTR2, 1, 0, { 0x0F } },
+    { ST7789_PWCTRL1, 2, 0, { 0xA4, 0xA1 } },
     // - ST7789V gamma setting - //
-    writecommand(spi, ST7789_PVGAMCTRL);
-    writedata(spi, 0xD0);
-    writedata(spi, 0x00);
-    writedata(spi, 0x02);
-    writedata(spi, 0x07);
-    writedata(spi, 0x0A);
-    writedata(spi, 0x28);
-    writedata(spi, 0x32);
-    writedata(spi, 0x44);
-    writedata(spi, 0x42);
-    writedata(spi, 0x06);
-    writedata(spi, 0x0E);
-    writedata(spi, 0x12);
-    writedata(spi, 0x14);
-    writedata(spi, 0x17);
-
-    writecommand(spi, ST7789_NVGAMCTRL);
-    writedata(spi, 0xD0);
-    writedata(spi, 0x00);
-    writedata(spi, 0x02);
-    writedata(spi, 0x07);
-    writedata(spi, 0x0A);
-    writedata(spi, 0x28);
-    writedata(spi, 0x31);
-    writedata(spi, 0x54);
-    writedata(spi, 0x47);
-    writedata(spi, 0x0E);
-    writedata(spi, 0x1C);
-    writedata(spi, 0x17);
-    writedata(spi, 0x1B);
-    writedata(spi, 0x1E);
-
-    writecommand(spi, ST7789_CASET);
-    writedata(spi, 0x00);
-    writedata(spi, 0x00);
-    writedata(spi, 0x00);
-    writedata(spi, 0xEF); // 239
-
-    writecommand(spi, ST7789_RASET);
-    writedata(spi, 0x00);
-    writedata(spi, 0x00);
-    writedata(spi, 0x01);
-    writedata(spi, 0x3F); // 319
+    { ST7789_PVGAMCTRL, 14, 0, { 0xD0, 0x00, 0x02, 0x07, 0x0A, 0x28, 0x32, 0x44, 0x42, 0x06, 0x0E, 0x12, 0x14, 0x17 } },
+    { ST7789_NVGAMCTRL, 14, 0, { 0xD0, 0x00, 0x02, 0x07, 0x0A, 0x28, 0x31, 0x54, 0x47, 0x0E, 0x1C, 0x17, 0x1B, 0x1E } },
+    { ST7789_CASET, 4, 0, { 0x00, 0x00, 0x00, 0xEF } },
+    { ST7789_RASET, 4, 0, { 0x00, 0x00, 0x01, 0x3F } },
+};
+
+static void display_init_std(struct SPI *spi)
+{
+    spi_display_write_sequence(&spi->spi_disp, std_init_commands, SPI_DISPLAY_SEQUENCE_LEN(std_init_commands));
 }